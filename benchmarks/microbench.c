@@ -0,0 +1,337 @@
+// Microbenchmarks of the runtime primitives, built as the fml-microbench
+// executable. Every benchmark is run in a number of samples, each sample runs
+// a batch of operations and its time divided by the batch size gives one
+// ns/op value. Reported are the mean, standard deviation, minimum and median
+// of the samples, so changes to the primitives can be compared without the
+// noise of whole programs.
+//
+// Usage: fml-microbench [filter], only benchmarks whose name contains the
+// filter are run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/arena.h"
+#include "../src/parser.h"
+#include "../src/heap/heap.h"
+#include "../src/bc/bc_interpreter.h"
+
+#define SAMPLES 15
+
+//results are accumulated here so the compiler can't optimize the measured work away
+static volatile uintptr_t sink;
+
+static const char *filter = NULL;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int double_cmp(const void *a, const void *b) {
+    double d1 = *(const double *)a;
+    double d2 = *(const double *)b;
+    return d1 < d2 ? -1 : d1 > d2;
+}
+
+//runs `batch` `SAMPLES` times, each call performs `ops` operations
+static void measure(const char *name, void (*batch)(size_t ops), size_t ops) {
+    if (filter != NULL && strstr(name, filter) == NULL)
+        return;
+    double samples[SAMPLES];
+    //warm up the caches and the allocator
+    batch(ops);
+    for (int i = 0; i < SAMPLES; i++) {
+        double start = now_ns();
+        batch(ops);
+        samples[i] = (now_ns() - start) / ops;
+    }
+    double mean = 0;
+    for (int i = 0; i < SAMPLES; i++)
+        mean += samples[i];
+    mean /= SAMPLES;
+    double var = 0;
+    for (int i = 0; i < SAMPLES; i++)
+        var += (samples[i] - mean) * (samples[i] - mean);
+    var /= SAMPLES - 1;
+    qsort(samples, SAMPLES, sizeof(double), double_cmp);
+    printf("%-32s %10.2f %10.2f %10.2f %10.2f\n", name, mean, sqrt(var), samples[0], samples[SAMPLES / 2]);
+}
+
+// HEAP
+
+static Heap bench_heap;
+//the bytecode benchmarks run in their own VM, it has a heap of its own
+static VM bench_vm;
+
+static void bench_heap_alloc(size_t ops) {
+    bench_heap.heap_free = bench_heap.heap_start;
+    bench_heap.heap_size = 0;
+    for (size_t i = 0; i < ops; i++) {
+        sink = (uintptr_t)heap_alloc(sizeof(Integer), VK_INTEGER, &bench_heap);
+    }
+}
+
+static void bench_construct_integer(size_t ops) {
+    bench_heap.heap_free = bench_heap.heap_start;
+    bench_heap.heap_size = 0;
+    for (size_t i = 0; i < ops; i++) {
+        sink = (uintptr_t)construct_integer(i, &bench_heap);
+    }
+}
+
+// ARENAS
+
+static void bench_arena_alloc(size_t ops) {
+    Arena arena;
+    arena_init(&arena);
+    for (size_t i = 0; i < ops; i++) {
+        sink = (uintptr_t)arena_alloc(&arena, 24);
+    }
+    arena_destroy(&arena);
+}
+
+static void bench_arena_save_restore(size_t ops) {
+    Arena arena;
+    arena_init(&arena);
+    for (size_t i = 0; i < ops; i++) {
+        size_t pos = arena_save(&arena);
+        sink = (uintptr_t)arena_alloc(&arena, 64);
+        sink = (uintptr_t)arena_alloc(&arena, 64);
+        arena_restore(&arena, pos);
+    }
+    arena_destroy(&arena);
+}
+
+static void bench_garena_alloc(size_t ops) {
+    GArena garena;
+    garena_init(&garena);
+    for (size_t i = 0; i < ops; i++) {
+        sink = (uintptr_t)garena_alloc(&garena, 16, 8);
+    }
+    garena_destroy(&garena);
+}
+
+// STRINGS
+
+static u8 str_a[256];
+static u8 str_b[256];
+static size_t str_len;
+
+static void bench_str_eq(size_t ops) {
+    Str a = { str_a, str_len };
+    Str b = { str_b, str_len };
+    for (size_t i = 0; i < ops; i++) {
+        sink += str_eq(a, b);
+    }
+}
+
+static void bench_str_eq_len_mismatch(size_t ops) {
+    Str a = { str_a, str_len };
+    Str b = { str_b, str_len - 1 };
+    for (size_t i = 0; i < ops; i++) {
+        sink += str_eq(a, b);
+    }
+}
+
+// FIELD LOOKUP
+
+static Object *field_obj;
+static Bc_String *field_name;
+
+static Bc_String *make_name(size_t i) {
+    Bc_String *name = malloc(sizeof(Bc_String) + 16);
+    name->kind = VK_STRING;
+    name->len = snprintf((char *)name->value, 16, "field_%zu", i);
+    return name;
+}
+
+//object with `width` fields, `field_name` is the last one so the lookup scans all of them
+//the names are unique across objects, so lookups in a parent chain don't stop early
+static void make_object(size_t width, Value parent) {
+    static size_t next_name = 0;
+    field_obj = (Object *)construct_object(width, parent, &bench_heap);
+    for (size_t i = 0; i < width; i++) {
+        Bc_String *name = make_name(next_name++);
+        field_obj->val[i].name = (Str){ name->value, name->len };
+        field_obj->val[i].val = parent;
+        field_name = name;
+    }
+}
+
+static void bench_get_field(size_t ops) {
+    for (size_t i = 0; i < ops; i++) {
+        sink = (uintptr_t)get_field(&bench_vm, field_obj, field_name);
+    }
+}
+
+// BYTECODE
+
+static char pool_file[] = "/tmp/fml-microbench-XXXXXX";
+
+static void put_u8(FILE *f, uint8_t v) { fwrite(&v, 1, 1, f); }
+static void put_u16(FILE *f, uint16_t v) { put_u8(f, v & 0xff); put_u8(f, v >> 8); }
+static void put_u32(FILE *f, uint32_t v) { put_u16(f, v & 0xffff); put_u16(f, v >> 16); }
+
+//writes a synthetic program with `cnt` constants: integers, strings, functions and classes
+//the last constant is the entry point
+static void write_pool(size_t cnt) {
+    int fd = mkstemp(pool_file);
+    FILE *f = fdopen(fd, "wb");
+    fwrite("FML\n", 1, 4, f);
+    put_u16(f, cnt);
+    for (size_t i = 0; i + 1 < cnt; i++) {
+        switch (i % 4) {
+            case 0:
+                put_u8(f, VK_INTEGER);
+                put_u32(f, i);
+                break;
+            case 1: {
+                char buf[32];
+                int len = snprintf(buf, sizeof(buf), "name_%zu", i);
+                put_u8(f, VK_STRING);
+                put_u32(f, len);
+                fwrite(buf, 1, len, f);
+                break;
+            }
+            case 2:
+                //CONSTANT i-2; PRINT i-1 0; DROP; RETURN
+                put_u8(f, VK_FUNCTION);
+                put_u8(f, 1);
+                put_u16(f, 0);
+                put_u32(f, 9);
+                put_u8(f, CONSTANT);
+                put_u16(f, i - 2);
+                put_u8(f, PRINT);
+                put_u16(f, i - 1);
+                put_u8(f, 0);
+                put_u8(f, DROP);
+                put_u8(f, RETURN);
+                break;
+            case 3:
+                put_u8(f, VK_CLASS);
+                put_u16(f, 1);
+                put_u16(f, i - 2);
+                break;
+        }
+    }
+    put_u8(f, VK_FUNCTION);
+    put_u8(f, 1);
+    put_u16(f, 0);
+    put_u32(f, 1);
+    put_u8(f, RETURN);
+    //globals
+    put_u16(f, 1);
+    put_u16(f, 1);
+    put_u16(f, cnt - 1);
+    fclose(f);
+}
+
+static void bench_deserialize(size_t ops) {
+    for (size_t i = 0; i < ops; i++) {
+        VM vm = { 0 };
+        deserialize(&vm, pool_file);
+        sink = (uintptr_t)vm.const_pool_map[0];
+        bc_unload(&vm);
+    }
+}
+
+static Value builtin_lhs;
+static Value builtin_rhs;
+static Str builtin_name;
+
+//the same path as CALL_METHOD on a primitive receiver takes
+static void bench_builtin(size_t ops) {
+    for (size_t i = 0; i < ops; i++) {
+        push_operand(&bench_vm, builtin_lhs);
+        push_operand(&bench_vm, builtin_rhs);
+        init_frame(&bench_vm, 2, true);
+        bc_method_call(&bench_vm, builtin_lhs, builtin_name, 2);
+        sink = (uintptr_t)pop_operand(&bench_vm);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        filter = argv[1];
+
+    printf("%-32s %10s %10s %10s %10s\n", "benchmark (ns/op)", "mean", "stddev", "min", "median");
+
+    heap_init(&bench_heap, 0);
+    measure("heap_alloc", bench_heap_alloc, 1000000);
+    measure("construct_integer", bench_construct_integer, 1000000);
+
+    measure("arena_alloc", bench_arena_alloc, 1000000);
+    measure("arena_save_restore", bench_arena_save_restore, 1000000);
+    measure("garena_alloc", bench_garena_alloc, 1000000);
+
+    size_t lens[] = { 4, 16, 64, 256 };
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        char name[64];
+        str_len = lens[i];
+        memset(str_a, 'a', str_len);
+        memset(str_b, 'a', str_len);
+        snprintf(name, sizeof(name), "str_eq/%zu", str_len);
+        measure(name, bench_str_eq, 1000000);
+        snprintf(name, sizeof(name), "str_eq_len_mismatch/%zu", str_len);
+        measure(name, bench_str_eq_len_mismatch, 1000000);
+    }
+
+    //the objects are built on the bench heap, start from a clean one
+    bench_heap.heap_free = bench_heap.heap_start;
+    bench_heap.heap_size = 0;
+    Value null = construct_null(&bench_heap);
+    size_t widths[] = { 1, 4, 16, 64 };
+    for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        char name[64];
+        make_object(widths[i], null);
+        snprintf(name, sizeof(name), "get_field/%zu", widths[i]);
+        measure(name, bench_get_field, 1000000);
+    }
+    //field found in the grandparent, one hop per level
+    make_object(4, null);
+    Object *grandparent = field_obj;
+    Bc_String *inherited = field_name;
+    make_object(4, (Value)grandparent);
+    make_object(4, (Value)field_obj);
+    field_name = inherited;
+    measure("get_field/4x3_parent_chain", bench_get_field, 1000000);
+
+    size_t pool_sizes[] = { 64, 1024, 16384 };
+    for (size_t i = 0; i < sizeof(pool_sizes) / sizeof(pool_sizes[0]); i++) {
+        char name[64];
+        strcpy(pool_file, "/tmp/fml-microbench-XXXXXX");
+        write_pool(pool_sizes[i]);
+        snprintf(name, sizeof(name), "deserialize/%zu", pool_sizes[i]);
+        measure(name, bench_deserialize, 20);
+        unlink(pool_file);
+    }
+
+    //bc_builtins needs a loaded program and an interpreter with the entry frame
+    strcpy(pool_file, "/tmp/fml-microbench-XXXXXX");
+    write_pool(64);
+    deserialize(&bench_vm, pool_file);
+    unlink(pool_file);
+    bc_init(&bench_vm);
+    push_operand(&bench_vm, bench_vm.const_pool_map[bench_vm.entry_point]);
+    init_frame(&bench_vm, 0, false);
+    init_fun_call(&bench_vm, 0, false);
+    builtin_lhs = construct_integer(20, &bench_heap);
+    builtin_rhs = construct_integer(22, &bench_heap);
+    const char *builtins[] = { "+", "<=", "==", "!=" };
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        char name[64];
+        builtin_name = (Str){ (const u8 *)builtins[i], strlen(builtins[i]) };
+        snprintf(name, sizeof(name), "bc_builtins/%s", builtins[i]);
+        measure(name, bench_builtin, 100000);
+    }
+    bc_free(&bench_vm);
+
+    heap_destroy(&bench_heap);
+    return EXIT_SUCCESS;
+}
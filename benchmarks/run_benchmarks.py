@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""Runs the FML benchmark corpus and reports the results as JSON.
+
+Every benchmark is an FML program `<name>.fml` with its compiled bytecode
+`<name>.bc` next to it. The bytecode was compiled from the source according to
+the NI-RUN bytecode specification and has to be regenerated when the source
+changes. `ast_interpret` runs the source, `bc_interpret` the bytecode.
+
+For each benchmark and mode the program is run `--repeat` times with its output
+discarded. The report contains the wall time, the peak RSS of the interpreter
+and the executed instructions per second. The instruction count comes from one
+extra run with --stats, so the timed runs are not slowed down by counting. For
+ast_interpret an instruction is an evaluated AST node.
+
+Used by the `meson benchmark` target, but can be run by hand as well:
+
+    benchmarks/run_benchmarks.py --fml build/fml recursion arrays
+"""
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+BENCHMARKS = ["recursion", "objects", "arrays", "print", "dispatch"]
+MODES = ["ast_interpret", "bc_interpret"]
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def program_path(directory, name, mode):
+    ext = ".fml" if mode == "ast_interpret" else ".bc"
+    return os.path.join(directory, name + ext)
+
+
+def run_once(fml, mode, program, extra_args=(), capture_stderr=False):
+    """Runs the interpreter and returns (wall time, peak RSS in KiB, stderr)."""
+    start = time.perf_counter()
+    proc = subprocess.Popen(
+        [fml, mode, *extra_args, program],
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.PIPE if capture_stderr else None,
+    )
+    stderr = proc.stderr.read().decode() if capture_stderr else ""
+    # wait4 gives us the resource usage of this particular child
+    _, status, rusage = os.wait4(proc.pid, 0)
+    wall = time.perf_counter() - start
+    # let Popen know the child is gone, we reaped it ourselves
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        raise RuntimeError(f"{mode} {program} exited with {proc.returncode}")
+    return wall, rusage.ru_maxrss, stderr
+
+
+def count_instructions(fml, mode, program):
+    _, _, stderr = run_once(fml, mode, program, ["--stats"], capture_stderr=True)
+    match = re.search(r"^(?:instructions|AST nodes) +(\d+)$", stderr, re.MULTILINE)
+    return int(match.group(1)) if match else None
+
+
+def run_benchmark(fml, directory, name, mode, repeat):
+    program = program_path(directory, name, mode)
+    walls = []
+    peak_rss = 0
+    for _ in range(repeat):
+        wall, rss, _ = run_once(fml, mode, program)
+        walls.append(wall)
+        peak_rss = max(peak_rss, rss)
+    instructions = count_instructions(fml, mode, program)
+    median = statistics.median(walls)
+    return {
+        "benchmark": name,
+        "mode": mode,
+        "program": program,
+        "runs": repeat,
+        "wall_time_s": {
+            "min": min(walls),
+            "median": median,
+            "mean": statistics.mean(walls),
+            "stdev": statistics.stdev(walls) if repeat > 1 else 0.0,
+        },
+        "instructions": instructions,
+        "instructions_per_second": instructions / median if instructions else None,
+        "peak_rss_kib": peak_rss,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--fml", required=True, help="path to the fml executable")
+    parser.add_argument("--mode", choices=MODES + ["both"], default="both")
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--dir", default=BENCH_DIR, help="directory with the benchmark programs")
+    parser.add_argument("--output", help="also write the JSON report to this file")
+    parser.add_argument("benchmarks", nargs="*", default=BENCHMARKS)
+    args = parser.parse_args()
+
+    modes = MODES if args.mode == "both" else [args.mode]
+    results = []
+    for name in args.benchmarks:
+        for mode in modes:
+            results.append(run_benchmark(args.fml, args.dir, name, mode, args.repeat))
+
+    report = json.dumps({"fml": os.path.abspath(args.fml), "results": results}, indent=2)
+    print(report)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(report + "\n")
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except RuntimeError as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
@@ -1,27 +1,33 @@
 #include <stdio.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #include "ast_interpreter.h"
 #include "../heap/heap.h"
 #include "../parser.h"
 #include "../utils.h"
+#include "../stats.h"
+#include "../trace_events.h"
+#include "../heap/alloc_sites.h"
+#include "../heap/heap_snapshot.h"
 
-const long long int MEM_SZ = (1024L * 1024 * 1024 * 1);
-
-IState* init_interpreter() {
+IState* init_interpreter(size_t heap_limit) {
     IState *state = malloc(sizeof(IState));
     state->heap = malloc(sizeof(Heap));
-    state->heap->heap_start = malloc(MEM_SZ);
-    state->heap->heap_free = state->heap->heap_start;
-    state->heap->heap_size = 0;
-    state->envs = malloc(sizeof(Environment) * MAX_ENVS);
+    heap_init(state->heap, heap_limit);
+    state->stats = (Stats){ 0 };
+    budget_init(&state->budget, 0, 0);
+    trace_events_heap(state->heap);
+    //zeroed so the sampling profiler never sees garbage names in unused envs
+    state->envs = calloc(MAX_ENVS, sizeof(Environment));
     state->current_env = 0;
+    state->envs[GLOBAL_ENV_INDEX].name = STR("<top>");
     state->null = construct_null(state->heap);
     return state;
 }
 
 void free_interpreter(IState *state) {
-    free(state->heap->heap_start);
+    heap_destroy(state->heap);
     free(state->heap);
     free(state->envs);
     free(state);
@@ -31,8 +37,7 @@ void add_to_scope(Value val, Str name, IState *state) {
     size_t env = state->current_env;
     size_t scope_cnt = state->envs[env].scope_cnt;
     if (state->envs[env].scopes[scope_cnt].var_cnt == MAX_VARS) {
-        printf("Too many variables in local scope\n");
-        exit(1);
+        runtime_error("Too many variables in local scope\n");
     }
     else {
         size_t var_cnt = state->envs[env].scopes[scope_cnt].var_cnt;
@@ -52,32 +57,43 @@ Value builtins(Value obj, int argc, Value *argv, Str m_name, IState *state) {
 			if (sizeof(name) - 1 == method_name_len && memcmp(name, method_name, method_name_len) == 0) /* body*/
     uint8_t kind = *(uint8_t *)obj;
     if (kind == VK_INTEGER || kind == VK_BOOLEAN || kind == VK_NULL) { 
-        assert(argc == 1);
+        check_argc(argc, 1, m_name);
         METHOD("+") {
+            check_integer_operands(obj, argv[0], m_name);
             return construct_integer(((Integer *)obj)->val + ((Integer *)argv[0])->val, state->heap);
         }
         METHOD("-") {
+            check_integer_operands(obj, argv[0], m_name);
             return construct_integer(((Integer *)obj)->val - ((Integer *)argv[0])->val, state->heap);
         }
         METHOD("*") { 
+            check_integer_operands(obj, argv[0], m_name);
             return construct_integer(((Integer *)obj)->val * ((Integer *)argv[0])->val, state->heap);
         }
         METHOD("/") {
+            check_integer_operands(obj, argv[0], m_name);
+            check_divisor(((Integer *)obj)->val, ((Integer *)argv[0])->val);
             return construct_integer(((Integer *)obj)->val / ((Integer *)argv[0])->val, state->heap);
         }
         METHOD("%") {
+            check_integer_operands(obj, argv[0], m_name);
+            check_divisor(((Integer *)obj)->val, ((Integer *)argv[0])->val);
             return construct_integer(((Integer *)obj)->val % ((Integer *)argv[0])->val, state->heap);
         }
         METHOD("<=") {
+            check_integer_operands(obj, argv[0], m_name);
             return construct_boolean(((Integer *)obj)->val <= ((Integer *)argv[0])->val, state->heap);
         }
         METHOD(">=") {
+            check_integer_operands(obj, argv[0], m_name);
             return construct_boolean(((Integer *)obj)->val >= ((Integer *)argv[0])->val, state->heap);
         }
         METHOD(">") {
+            check_integer_operands(obj, argv[0], m_name);
             return construct_boolean(((Integer *)obj)->val > ((Integer *)argv[0])->val, state->heap);
         }
         METHOD("<") {
+            check_integer_operands(obj, argv[0], m_name);
             return construct_boolean(((Integer *)obj)->val < ((Integer *)argv[0])->val, state->heap );
         }
         METHOD("==") {
@@ -88,6 +104,8 @@ Value builtins(Value obj, int argc, Value *argv, Str m_name, IState *state) {
                 return construct_boolean(((Integer *)obj)->val == ((Integer *)argv[0])->val, state->heap);
             else if (kind == VK_NULL)
                 return construct_boolean(*argv[0] == VK_NULL, state->heap);
+            else if (*argv[0] != VK_BOOLEAN)
+                return construct_boolean(false, state->heap);
             else
                 return construct_boolean(((Boolean *)obj)->val == ((Boolean *)argv[0])->val, state->heap);
         }
@@ -100,22 +118,29 @@ Value builtins(Value obj, int argc, Value *argv, Str m_name, IState *state) {
             else if (kind == VK_NULL){
                 return construct_boolean(*argv[0] != VK_NULL, state->heap);
             }
+            else if (*argv[0] != VK_BOOLEAN)
+                return construct_boolean(true, state->heap);
             else
                 return construct_boolean(((Boolean *)obj)->val != ((Boolean *)argv[0])->val, state->heap);
         }
     }
     if (kind == VK_BOOLEAN) {
-        assert(argc == 1);
         METHOD("&") {
+            if (*argv[0] != VK_BOOLEAN)
+                runtime_error("Error: The operands of & have to be booleans\n");
             return construct_boolean(((Boolean *)obj)->val & ((Boolean *)argv[0])->val, state->heap);
         }
         METHOD("|") {
+            if (*argv[0] != VK_BOOLEAN)
+                runtime_error("Error: The operands of | have to be booleans\n");
             return construct_boolean(((Boolean *)obj)->val | ((Boolean *)argv[0])->val, state->heap);
         }
     }
 
     METHOD("set") {
         if (kind == VK_ARRAY) {
+            check_argc(argc, 2, m_name);
+            check_array_index(obj, argv[0]);
             Array *array = (Array *)obj;
             array->val[((Integer *)argv[0])->val] = argv[1];
             return obj;
@@ -124,15 +149,14 @@ Value builtins(Value obj, int argc, Value *argv, Str m_name, IState *state) {
 
     METHOD("get") { 
         if (kind == VK_ARRAY) {
+            check_argc(argc, 1, m_name);
+            check_array_index(obj, argv[0]);
             Array *array = (Array *)obj;
-            Integer *test = argv[0];
-            size_t index = test->val;
-            assert(index < array->size);
             return array->val[((Integer *)argv[0])->val];
         }
     }
 
-    return (Value){NULL};
+    runtime_error("Unknown built-in method: %.*s\n", (int)m_name.len, m_name.str);
 }
 
 Value *find_in_env(Str name, Environment *env, size_t scope_cnt) {
@@ -167,17 +191,48 @@ Value *get_var_ptr(Str name, IState *state) {
     return val;
 }
 
-void push_env(IState *state) {
+void push_env(IState *state, Str name) {
     if (state->current_env == MAX_ENVS - 1) {
-        printf("max envs reached");
-        exit(1);
+        runtime_error("max envs reached");
     }
+    //set the name before the env becomes visible to the sampling profiler
+    state->envs[state->current_env + 1].name = name;
+    atomic_signal_fence(memory_order_release);
     state->current_env++;
+    stats_frame_depth(&state->stats, state->current_env + 1);
     state->envs[state->current_env].scope_cnt = 0;
     state->envs[state->current_env].scopes[0].var_cnt = 0;
+    trace_begin(name, "call");
+    heap_snapshot_poll();
+}
+
+void ast_roots(void *ctx, HeapVisit visit, void *visit_ctx) {
+    IState *state = ctx;
+    visit(visit_ctx, (Value *)&state->null);
+    for (int env = 0; env <= state->current_env; env++) {
+        Environment *e = &state->envs[env];
+        for (size_t scope = 0; scope <= e->scope_cnt; scope++) {
+            for (size_t i = 0; i < e->scopes[scope].var_cnt; i++) {
+                visit(visit_ctx, &e->scopes[scope].vars[i].val);
+            }
+        }
+        if (e->ret_val != NULL)
+            visit(visit_ctx, &e->ret_val);
+    }
+}
+
+size_t ast_sample_walk(void *ctx, Str *frames, size_t max) {
+    IState *state = ctx;
+    size_t envs = state->current_env + 1;
+    size_t start = envs > max ? envs - max : 0;
+    for (size_t i = start; i < envs; i++) {
+        frames[i - start] = state->envs[i].name;
+    }
+    return envs - start;
 }
 
 void pop_env(IState *state) {
+    trace_end("call");
     memset(&state->envs[state->current_env], 0, sizeof(Environment));
     //state->envs[state->current_env].scope_cnt = 0;
     state->current_env--;
@@ -185,8 +240,7 @@ void pop_env(IState *state) {
 
 void push_scope(IState *state) {
     if (state->envs[state->current_env].scope_cnt == MAX_SCOPES - 1) {
-        printf("max scopes reached");
-        exit(1);
+        runtime_error("max scopes reached");
     }
     size_t env = state->current_env;
     size_t scope_cnt = state->envs[env].scope_cnt;
@@ -206,13 +260,15 @@ void pop_scope(IState *state) {
 
 Value *field_access(Value obj, Str name, IState *state) {
     Object *object = (Object *)obj;
-    assert(*obj == VK_OBJECT);
-    //print_val(obj);
+    //the parents end in null or a primitive without fields
+    if (*obj != VK_OBJECT)
+        runtime_error("Error: Field %.*s not found\n", (int)name.len, name.str);
     for (size_t i = 0; i < object->field_cnt; i++) {
         if (str_eq(object->val[i].name, name)) {
             return &object->val[i].val;
         }
     }
+    state->stats.parent_hops++;
     return field_access(object->parent, name, state);
 }
 
@@ -225,11 +281,13 @@ Value method_call(Value obj, Str name, int argc, Value *argv, IState *state) {
     for (size_t i = 0; i < object->field_cnt; i++) {
         if (str_eq(object->val[i].name, name)) {
             Value ret;
-            push_env(state);
+            push_env(state, name);
             add_to_scope(obj, STR("this"), state);
             Field field = object->val[i];
-            assert(*field.val == VK_FUNCTION);
+            if (*field.val != VK_FUNCTION)
+                runtime_error("Error: Field %.*s is not a method\n", (int)name.len, name.str);
             Function *func = (Function *)field.val;
+            check_argc(argc, func->val->parameter_cnt, name);
             for (int j = 0; j < argc; j++) {
                 add_to_scope(argv[j], func->val->parameters[j], state);
                 
@@ -239,11 +297,26 @@ Value method_call(Value obj, Str name, int argc, Value *argv, IState *state) {
             return state->envs[state->current_env + 1].ret_val = ret;
         }
     }
+    state->stats.parent_hops++;
     return method_call(object->parent, name, argc, argv, state);
 }
 
 
-Value interpret(Ast *ast, IState *state) {
+//kept out of line so the safepoints stay a decrement and a branch
+__attribute__((noinline, cold))
+static void fuel_exhausted(IState *state) {
+    budget_charge(&state->budget);
+    budget_refuel(&state->budget, UINT32_MAX);
+}
+
+//loop iterations and calls, where the limits of the budget are checked
+static inline void safepoint(IState *state) {
+    if (__builtin_expect(--state->budget.fuel == 0, 0))
+        fuel_exhausted(state);
+}
+
+static Value interpret_node(Ast *ast, IState *state) {
+    state->stats.instructions++;
     switch(ast->kind) {
         case AST_INTEGER: {
             AstInteger *integer = (AstInteger *) ast;
@@ -290,11 +363,18 @@ Value interpret(Ast *ast, IState *state) {
         case AST_FUNCTION_CALL: {
             AstFunctionCall *fc = (AstFunctionCall *) ast; 
             Function *fun = interpret(fc->function, state);
+            if (fun->kind != VK_FUNCTION)
+                runtime_error("Error: Only functions can be called\n");
             Value *args = (Value *)malloc(sizeof(Value) * fc->argument_cnt);
             for (size_t i = 0; i < fc->argument_cnt; i++) {
                 args[i] = interpret(fc->arguments[i], state);
             }
-            push_env(state);
+            //anonymous functions get an empty name
+            Str name = fc->function->kind == AST_VARIABLE_ACCESS ? ((AstVariableAccess *)fc->function)->name : (Str){ 0 };
+            check_argc(fc->argument_cnt, fun->val->parameter_cnt, name.len > 0 ? name : STR("<anonymous>"));
+            state->stats.calls++;
+            safepoint(state);
+            push_env(state, name);
             add_to_scope(construct_null(state->heap), STR("this"), state);
             for (size_t i = 0; i < fc->argument_cnt; i++) {
                 add_to_scope(args[i], ((AstFunction *)fun->val)->parameters[i], state);
@@ -310,41 +390,7 @@ Value interpret(Ast *ast, IState *state) {
             for (size_t i = 0; i < prnt->argument_cnt; i++) {
                 val[i] = interpret(prnt->arguments[i], state);
             }
-            size_t tilda = 0;
-            for (size_t i = 0; i < prnt->format.len; i++) {
-                if (prnt->format.str[i] == '~') {
-                    //we are only concerned with valid programs so each ~ will have a corresponding value
-                    print_val(val[tilda]);
-                    tilda++;
-                }
-                else {
-                    char c = prnt->format.str[i];
-                    //check for escape characters
-                    if (c == '\\' && prnt->format.len > i + 1) {
-                        char next = prnt->format.str[i + 1];
-                        //increment i so we don't print the next character two times
-                        i++;
-                        if (next == 'n') {
-                            printf("\n");
-                        }
-                        else if (next == 't') {
-                            printf("\t");
-                        }
-                        else if (next == 'r') {
-                            printf("\r");
-                        }
-                        else if (next == '~') {
-                            printf("~");
-                        }
-                        else {
-                            printf("%c", next);
-                        }
-                    }
-                    else {
-                        printf("%c", prnt->format.str[i]);
-                    }
-                }
-            } 
+            print_format(prnt->literals, prnt->argument_cnt, val);
             return construct_null(state->heap);
         }
         case AST_BLOCK: {
@@ -377,6 +423,7 @@ Value interpret(Ast *ast, IState *state) {
                 //if the condition is false we return null
                 interpret(loop->body, state);
                 pop_scope(state);
+                safepoint(state);
                 cond = interpret(loop->condition, state);
             }
         }
@@ -400,8 +447,8 @@ Value interpret(Ast *ast, IState *state) {
         case AST_ARRAY: {
             AstArray *array = (AstArray *) ast;
             Integer *sz = interpret(array->size, state);
-            assert(sz->kind == VK_INTEGER);
-            assert(sz->val >= 0);
+            if (sz->kind != VK_INTEGER || sz->val < 0)
+                runtime_error("Error: The size of an array has to be a non-negative integer\n");
             //alloc space for the array and gete the value (pointer) to the array
             Array *arr = construct_array(sz->val, state->heap);
             //eval the initializer `sz` times and assign it to the array
@@ -453,6 +500,7 @@ Value interpret(Ast *ast, IState *state) {
         case AST_FIELD_ACCESS: { 
             AstFieldAccess *fa = (AstFieldAccess *) ast;
             Value obj = interpret(fa->object, state);
+            state->stats.field_lookups++;
             return *field_access(obj, fa->field, state);
         }
         
@@ -461,6 +509,7 @@ Value interpret(Ast *ast, IState *state) {
             Object *obj = interpret(fa->object, state);
             Value val = interpret(fa->value, state);
 
+            state->stats.field_lookups++;
             Value *field = field_access(obj, fa->field, state);
 
             *field = val;
@@ -471,8 +520,9 @@ Value interpret(Ast *ast, IState *state) {
         case AST_METHOD_CALL: {
             AstMethodCall *mc = (AstMethodCall *) ast;
             Object *obj = interpret(mc->object, state);
-            assert(obj->kind == VK_OBJECT || is_primitive(obj->kind));
             uint8_t vk = *(uint8_t *)obj;
+            state->stats.method_calls[vk]++;
+            safepoint(state);
             Value *args = malloc(sizeof(Value) * mc->argument_cnt);
             Value val;
             for (size_t i = 0; i < mc->argument_cnt; i++) {
@@ -489,9 +539,79 @@ Value interpret(Ast *ast, IState *state) {
         }
 
         default: {
-            printf("Ast node not implemented\n");
-            exit(1);
+            runtime_error("Ast node not implemented\n");
             return NULL;
         }
     }
 }
+
+Value interpret(Ast *ast, IState *state) {
+    if (!alloc_sites_enabled)
+        return interpret_node(ast, state);
+    //allocations are attributed to the innermost node being evaluated
+    //restored after the children so e.g. the result of a builtin belongs to the method call
+    const void *prev = alloc_site;
+    alloc_site = ast;
+    Value val = interpret_node(ast, state);
+    alloc_site = prev;
+    return val;
+}
+
+static const char *ast_kind_names[] = {
+    [AST_NULL] = "null",
+    [AST_BOOLEAN] = "boolean",
+    [AST_INTEGER] = "integer",
+    [AST_ARRAY] = "array",
+    [AST_OBJECT] = "object",
+    [AST_FUNCTION] = "function",
+    [AST_DEFINITION] = "definition",
+    [AST_VARIABLE_ACCESS] = "variable access",
+    [AST_VARIABLE_ASSIGNMENT] = "variable assignment",
+    [AST_INDEX_ACCESS] = "index access",
+    [AST_INDEX_ASSIGNMENT] = "index assignment",
+    [AST_FIELD_ACCESS] = "field access",
+    [AST_FIELD_ASSIGNMENT] = "field assignment",
+    [AST_FUNCTION_CALL] = "function call",
+    [AST_METHOD_CALL] = "method call",
+    [AST_CONDITIONAL] = "conditional",
+    [AST_LOOP] = "loop",
+    [AST_PRINT] = "print",
+    [AST_BLOCK] = "block",
+    [AST_TOP] = "top",
+};
+
+Str ast_alloc_site_frame(void *ctx, const void *site) {
+    (void)site;
+    IState *state = ctx;
+    return state->envs[state->current_env].name;
+}
+
+void ast_alloc_site_describe(void *ctx, const void *site, Str frame, char *buf, size_t buf_sz) {
+    (void)ctx;
+    const Ast *ast = site;
+    //the name of the variable, field or method the node works with, if any
+    Str detail = { 0 };
+    switch (ast->kind) {
+        case AST_DEFINITION: detail = ((AstDefinition *)ast)->name; break;
+        case AST_VARIABLE_ACCESS: detail = ((AstVariableAccess *)ast)->name; break;
+        case AST_VARIABLE_ASSIGNMENT: detail = ((AstVariableAssignment *)ast)->name; break;
+        case AST_FIELD_ACCESS: detail = ((AstFieldAccess *)ast)->field; break;
+        case AST_FIELD_ASSIGNMENT: detail = ((AstFieldAssignment *)ast)->field; break;
+        case AST_METHOD_CALL: detail = ((AstMethodCall *)ast)->name; break;
+        case AST_FUNCTION_CALL: {
+            Ast *fun = ((AstFunctionCall *)ast)->function;
+            if (fun->kind == AST_VARIABLE_ACCESS)
+                detail = ((AstVariableAccess *)fun)->name;
+            break;
+        }
+        default: break;
+    }
+    if (frame.len == 0)
+        frame = STR("<anonymous>");
+    if (ast->kind == AST_INTEGER) {
+        snprintf(buf, buf_sz, "%.*s: integer %d", (int)frame.len, frame.str, (int)((AstInteger *)ast)->value);
+        return;
+    }
+    snprintf(buf, buf_sz, "%.*s: %s %.*s", (int)frame.len, frame.str, ast_kind_names[ast->kind],
+             (int)detail.len, detail.str);
+}
@@ -3,6 +3,8 @@
 #include "../parser.h"
 #include "../heap/heap.h"
 #include "../types.h"
+#include "../stats.h"
+#include "../budget.h"
 
 #define MAX_ENVS 256
 #define MAX_VARS 256
@@ -29,13 +31,13 @@ typedef struct {
      Scope scopes[MAX_SCOPES];
      size_t scope_cnt;
      Value ret_val;
+     //name of the called function or method, for the sampling profiler
+     Str name;
 } Environment;
 
 typedef struct {
     //ptr to the heap where we store the vars
     Heap *heap;
-    //size of the currently allocated memory
-    long long int heap_size;
     //environments for functions
     //index 0 is the global environment
     Environment *envs;
@@ -43,11 +45,14 @@ typedef struct {
     int current_env;
     //optmization, have just one null
     Value *null;
+    Stats stats;
+    //the loop iterations and calls are its safepoints, init_interpreter starts it without limits
+    Budget budget;
 } IState;
 
 
-//initializes the state of the itp
-IState* init_interpreter();
+//initializes the state of the itp, `heap_limit` in bytes or 0 for HEAP_DEFAULT_LIMIT
+IState* init_interpreter(size_t heap_limit);
 
 void free_interpreter(IState *state);
 
@@ -59,3 +64,15 @@ void print_val(Value val);
 
 //interprets the ast `ast` using the state `state
 Value interpret(Ast *ast, IState *state);
+
+//HeapRoots of the AST interpreter, the variables of all the environments, `ctx` is the IState
+//values only held in C locals of interpret are not visible
+void ast_roots(void *ctx, HeapVisit visit, void *visit_ctx);
+
+//SampleWalk for the sampling profiler, `ctx` is the IState
+size_t ast_sample_walk(void *ctx, Str *frames, size_t max);
+
+//callbacks for the allocation-site profiler, the sites are Ast nodes and `ctx` is the IState
+Str ast_alloc_site_frame(void *ctx, const void *site);
+
+void ast_alloc_site_describe(void *ctx, const void *site, Str frame, char *buf, size_t buf_sz);
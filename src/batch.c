@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "batch.h"
+#include "fml.h"
+
+typedef struct {
+    char *path;
+    //what the script printed
+    uint8_t *out;
+    size_t out_len;
+    size_t out_cap;
+    //NULL when it ran fine
+    char *error;
+    bool done;
+} Script;
+
+typedef struct Batch Batch;
+
+typedef struct {
+    Batch *batch;
+    int id;
+    unsigned seed;
+    //the scripts [next, end) are queued on this worker
+    //the owner takes from the front, thieves from the back
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+    size_t stolen;
+    pthread_t thread;
+} Worker;
+
+struct Batch {
+    Script *scripts;
+    size_t cnt;
+    size_t heap_limit;
+    FmlLimits limits;
+    Worker *workers;
+    int worker_cnt;
+    //--green: the source scripts, which run to completion in their first turn
+    size_t unsliced;
+    //signalled whenever a script is done, the main thread prints them in order
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//FmlWrite, appends to the output of the script
+static void collect_output(void *ctx, const uint8_t *data, size_t len) {
+    Script *script = ctx;
+    if (script->out_len + len > script->out_cap) {
+        script->out_cap = script->out_cap * 2 > script->out_len + len ? script->out_cap * 2 : script->out_len + len;
+        script->out = realloc(script->out, script->out_cap);
+    }
+    memcpy(script->out + script->out_len, data, len);
+    script->out_len += len;
+}
+
+static void run_script(Batch *batch, Script *script) {
+    FmlVm *vm = fml_vm_new(batch->heap_limit, &(FmlOptions){ .limits = batch->limits });
+    fml_set_output(vm, collect_output, script);
+    int status = fml_load_file(vm, script->path) ? fml_run(vm) : FML_ERROR;
+    if (status != FML_OK)
+        script->error = strdup(fml_error(vm));
+    fml_vm_free(vm);
+    pthread_mutex_lock(&batch->done_lock);
+    script->done = true;
+    pthread_cond_signal(&batch->done_cond);
+    pthread_mutex_unlock(&batch->done_lock);
+}
+
+static bool take(Worker *w, size_t *index) {
+    pthread_mutex_lock(&w->lock);
+    bool found = w->next < w->end;
+    if (found)
+        *index = w->next++;
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+//moves the back half of the queue of another worker to `w`, false when all are empty
+//a script in flight between two workers is run by the thief, so nothing is lost when w gives up
+static bool steal(Worker *w) {
+    Batch *batch = w->batch;
+    int start = rand_r(&w->seed) % batch->worker_cnt;
+    for (int i = 0; i < batch->worker_cnt; i++) {
+        Worker *victim = &batch->workers[(start + i) % batch->worker_cnt];
+        if (victim == w)
+            continue;
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->end - victim->next;
+        size_t from = victim->end - (left + 1) / 2;
+        size_t to = victim->end;
+        victim->end = from;
+        pthread_mutex_unlock(&victim->lock);
+        if (left == 0)
+            continue;
+        pthread_mutex_lock(&w->lock);
+        w->next = from;
+        w->end = to;
+        w->stolen += to - from;
+        pthread_mutex_unlock(&w->lock);
+        return true;
+    }
+    return false;
+}
+
+static void *worker_loop(void *arg) {
+    Worker *w = arg;
+    for (;;) {
+        size_t index;
+        while (take(w, &index)) {
+            run_script(w->batch, &w->batch->scripts[index]);
+        }
+        if (!steal(w))
+            return NULL;
+    }
+}
+
+//reads the script paths, false when the manifest can't be read
+static bool read_manifest(Batch *batch, const char *manifest) {
+    FILE *f = fopen(manifest, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open the manifest %s\n", manifest);
+        return false;
+    }
+    //relative paths are relative to the manifest
+    const char *slash = strrchr(manifest, '/');
+    int dir_len = slash == NULL ? 0 : (int)(slash - manifest + 1);
+    size_t cap = 64;
+    batch->scripts = malloc(sizeof(Script) * cap);
+    batch->cnt = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, f)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+        if (batch->cnt == cap) {
+            cap *= 2;
+            batch->scripts = realloc(batch->scripts, sizeof(Script) * cap);
+        }
+        Script *script = &batch->scripts[batch->cnt++];
+        *script = (Script){ 0 };
+        if (line[0] == '/' || dir_len == 0) {
+            script->path = strdup(line);
+        } else {
+            script->path = malloc(dir_len + len + 1);
+            sprintf(script->path, "%.*s%s", dir_len, manifest, line);
+        }
+    }
+    free(line);
+    fclose(f);
+    return true;
+}
+
+//runs all the scripts as green threads on this thread, they are done when it returns
+static void run_green(Batch *batch, uint32_t slice) {
+    FmlSched *sched = fml_sched_new(batch->heap_limit, slice);
+    FmlVm **vms = malloc(sizeof(FmlVm *) * batch->cnt);
+    for (size_t i = 0; i < batch->cnt; i++) {
+        Script *script = &batch->scripts[i];
+        //the heap limit is the one of the shared heap
+        vms[i] = fml_vm_new(0, &(FmlOptions){ .limits = batch->limits });
+        fml_set_output(vms[i], collect_output, script);
+        if (!fml_load_file(vms[i], script->path) || !fml_sched_add(sched, vms[i]))
+            script->error = strdup(fml_error(vms[i]));
+        //only bytecode can be suspended, see fml_sched_new
+        size_t len = strlen(script->path);
+        if (len < 3 || strcmp(script->path + len - 3, ".bc") != 0)
+            batch->unsliced++;
+    }
+    fml_sched_run(sched);
+    for (size_t i = 0; i < batch->cnt; i++) {
+        Script *script = &batch->scripts[i];
+        if (script->error == NULL && fml_error(vms[i])[0] != '\0')
+            script->error = strdup(fml_error(vms[i]));
+        script->done = true;
+        fml_vm_free(vms[i]);
+    }
+    free(vms);
+    fml_sched_free(sched);
+}
+
+int batch(const char *manifest, int workers, size_t heap_limit, FmlLimits limits, uint32_t green_slice) {
+    Batch batch = { .heap_limit = heap_limit, .limits = limits };
+    if (!read_manifest(&batch, manifest))
+        return EXIT_FAILURE;
+    uint64_t start = now_ns();
+    pthread_mutex_init(&batch.done_lock, NULL);
+    pthread_cond_init(&batch.done_cond, NULL);
+    if (green_slice > 0) {
+        run_green(&batch, green_slice);
+        workers = 0;
+    }
+    batch.worker_cnt = workers;
+    batch.workers = calloc(workers, sizeof(Worker));
+    for (int i = 0; i < workers; i++) {
+        Worker *w = &batch.workers[i];
+        w->batch = &batch;
+        w->id = i;
+        w->seed = i + 1;
+        pthread_mutex_init(&w->lock, NULL);
+        w->next = batch.cnt * i / workers;
+        w->end = batch.cnt * (i + 1) / workers;
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&batch.workers[i].thread, NULL, worker_loop, &batch.workers[i]);
+    }
+
+    //print every script as soon as it and all before it are done
+    size_t failed = 0;
+    for (size_t i = 0; i < batch.cnt; i++) {
+        Script *script = &batch.scripts[i];
+        pthread_mutex_lock(&batch.done_lock);
+        while (!script->done)
+            pthread_cond_wait(&batch.done_cond, &batch.done_lock);
+        pthread_mutex_unlock(&batch.done_lock);
+        printf("==> %s <==\n", script->path);
+        fwrite(script->out, 1, script->out_len, stdout);
+        if (script->error != NULL) {
+            //the output may end in the middle of a line
+            if (script->out_len > 0 && script->out[script->out_len - 1] != '\n')
+                putchar('\n');
+            printf("error: %s\n", script->error);
+            failed++;
+        }
+        free(script->out);
+        free(script->error);
+        free(script->path);
+    }
+    fflush(stdout);
+
+    for (int i = 0; i < workers; i++) {
+        pthread_join(batch.workers[i].thread, NULL);
+    }
+    //the workers look into each others queues until the last one is done
+    size_t stolen = 0;
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_destroy(&batch.workers[i].lock);
+        stolen += batch.workers[i].stolen;
+    }
+    if (green_slice > 0)
+        fprintf(stderr, "fml batch: %zu scripts, %zu failed, green threads, %zu source not interleaved, %.3f s\n",
+                batch.cnt, failed, batch.unsliced, (now_ns() - start) / 1e9);
+    else
+        fprintf(stderr, "fml batch: %zu scripts, %zu failed, %d workers, %zu stolen, %.3f s\n",
+                batch.cnt, failed, workers, stolen, (now_ns() - start) / 1e9);
+    free(batch.workers);
+    free(batch.scripts);
+    pthread_mutex_destroy(&batch.done_lock);
+    pthread_cond_destroy(&batch.done_cond);
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fml.h"
+
+// Batch mode (fml batch <manifest>). Runs many independent scripts on all
+// cores. The manifest lists one script per line, bytecode when the name ends
+// in .bc and source otherwise. Relative paths are taken from the directory of
+// the manifest, empty lines and lines starting with # are skipped.
+//
+// Every script runs in a fresh FmlVm on one of the worker threads, with the
+// output collected in memory. The manifest is split into contiguous ranges,
+// one per worker, and a worker runs its range front to back. A worker which
+// runs out of scripts steals the back half of the range of another one, so
+// a few slow scripts don't leave the other cores idle.
+//
+// The outputs are written to stdout in manifest order, each after a
+// `==> <script> <==` line and followed by an `error: <message>` line when the
+// script failed. A summary goes to stderr. The exit status is 1 when any of
+// the scripts failed.
+//
+// With --green the scripts don't get a thread each: all of them run
+// interleaved on the main thread as the green threads of an FmlSched, each
+// suspended after --slice safepoints (backward jumps and calls), with one
+// heap of --heap-size shared by all of them. See fml_sched_new in fml.h.
+// Only bytecode can be suspended, a source script runs to completion in its
+// first turn. The summary counts the source scripts which weren't
+// interleaved.
+
+//safepoints per turn of a green thread unless --slice says otherwise
+#define BATCH_DEFAULT_SLICE 1000
+
+//returns the exit status for fml, `heap_limit` in bytes, 0 for the default
+//every script runs with `limits`
+//`green_slice` runs the scripts as green threads, 0 runs them on the worker threads
+int batch(const char *manifest, int workers, size_t heap_limit, FmlLimits limits, uint32_t green_slice);
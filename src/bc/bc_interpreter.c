@@ -6,404 +6,459 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "bc_interpreter.h"
+#include "bc_profile.h"
+#include "bc_snapshot.h"
+#include "../sampler.h"
+#include "../stats.h"
+#include "../perf_counters.h"
+#include "../trace_events.h"
+#include "../heap/alloc_sites.h"
+#include "../heap/heap_snapshot.h"
+#include "../heap/gc_concurrent.h"
 #include "../heap/heap.h"
 #include "../utils.h"
+#include "../output.h"
 
-//we can have max 1024 * 16 ptrs to the heap
-#define MAX_OPERANDS (1024 * 16)
-#define MAX_FRAMES (1024 * 16)
 
-
-
-typedef struct {
-    uint8_t *ret_addr;
-    //ptrs to the heap
-    uint8_t **locals;
-    size_t locals_sz;
-} Frame;
-
-//struct for representing the inner state of the itp
-typedef struct {
-    //instruction pointer
-    uint8_t *ip;
-    Frame *frames;
-    size_t frames_sz;
-    //operands stack
-    //ptrs to the heap
-    Value *operands;
-    size_t op_sz;
-} Bc_Interpreter;
-
-//GLOBAL VARIABLES
-void *const_pool = NULL;
-uint8_t **const_pool_map = NULL;
-//number of constants in the const pool
-uint16_t const_pool_count = 0;
-Bc_Globals globals;
-uint16_t entry_point = 0;
-Bc_Interpreter *itp;
-Heap *heap;
-Value global_null;
-
-void bc_init() {
-    itp = malloc(sizeof(Bc_Interpreter));
-    itp->ip = const_pool_map[entry_point];
-    itp->frames = malloc(sizeof(Frame) * MAX_FRAMES);
+void bc_init(VM *vm) {
+    vm->ip = vm->const_pool_map[vm->entry_point];
+    vm->frames = malloc(sizeof(Frame) * MAX_FRAMES);
     //we have 1 frame at the beginning for global frame
-    itp->frames_sz = 0;
-    itp->operands = malloc(sizeof(void *) * MAX_OPERANDS);
-    itp->op_sz = 0;
-    heap = malloc(sizeof(Heap));
-    heap->heap_start = malloc(MEM_SZ);
-    heap->heap_free = heap->heap_start;
-    heap->heap_size = 0;
-    global_null = construct_null(heap);
+    vm->frames_sz = 0;
+    vm->operands = malloc(sizeof(void *) * MAX_OPERANDS);
+    vm->op_sz = 0;
+    budget_init(&vm->budget, 0, 0);
+    vm->preemptible = false;
+    vm->stop_depth = 0;
+    if (!vm->heap_shared) {
+        vm->heap = malloc(sizeof(Heap));
+        heap_init(vm->heap, vm->heap_limit);
+        heap_set_roots(vm->heap, bc_roots, vm);
+    }
+    vm->stats = (Stats){ 0 };
+    trace_events_heap(vm->heap);
+    //a shared heap can be collected by the first allocation, the roots have to be complete before it
+    vm->global_null = NULL;
+    vm->snapshot_mark = NULL;
     //array that acts like a hash map - we just allocate as big array as there are constants
-    globals.values = malloc(sizeof(void *) * const_pool_count);
+    vm->globals.values = calloc(vm->const_pool_count, sizeof(void *));
+    vm->global_null = construct_null(vm->heap);
     //TODO could we use memset here or smth similar?
-    for (int i = 0; i < const_pool_count; i++) {
-        globals.values[i] = global_null;
+    for (int i = 0; i < vm->const_pool_count; i++) {
+        vm->globals.values[i] = vm->global_null;
+    }
+    //snapshot() is a no-op unless the program defines its own function of that name
+    for (int i = 0; i < vm->globals.count; i++) {
+        uint16_t index = vm->globals.indexes[i];
+        if (index >= vm->const_pool_count || *vm->const_pool_map[index] != VK_STRING)
+            continue;
+        Bc_String *name = (Bc_String *)vm->const_pool_map[index];
+        if (str_eq((Str){name->value, name->len}, STR("snapshot"))) {
+            vm->snapshot_mark = construct_null(vm->heap);
+            vm->globals.values[index] = vm->snapshot_mark;
+        }
+    }
+}
+
+void bc_unload(VM *vm) {
+    if (vm->image != NULL)
+        munmap(vm->image, vm->image_sz);
+    else if (vm->const_pool != NULL)
+        munmap(vm->const_pool, vm->const_pool_sz);
+    free(vm->const_pool_map);
+    if (vm->const_pool_formats != NULL) {
+        for (int i = 0; i < vm->const_pool_count; i++) {
+            free(vm->const_pool_formats[i]);
+        }
+    }
+    free(vm->const_pool_formats);
+    free(vm->globals.indexes);
+}
+
+void bc_free(VM *vm) {
+    //frames are left behind by a run that ended with an error or by an image that failed to restore
+    for (size_t i = 0; i < vm->frames_sz; i++) {
+        free(vm->frames[i].locals);
     }
+    free(vm->frames);
+    free(vm->operands);
+    if (vm->heap != NULL && !vm->heap_shared) {
+        heap_destroy(vm->heap);
+        free(vm->heap);
+    }
+    free(vm->globals.values);
+    bc_unload(vm);
 }
 
-void bc_free() {
-    free(itp->frames);
-    free(itp->operands);
-    free(itp);
-    free(const_pool);
-    free(const_pool_map);
-    free(heap->heap_start);
-    free(heap);
-    free(globals.values);
-    free(globals.indexes);
+//bc_verify doesn't track the depth of the operand stack, a program can still take more than it pushed
+static inline void need_operands(VM *vm, size_t n) {
+    if (__builtin_expect(vm->op_sz < n, 0))
+        runtime_error("Error: Operand stack underflow\n");
 }
 
-Value pop_operand() {
-    assert(itp->op_sz > 0);
-    return itp->operands[--itp->op_sz];
+Value pop_operand(VM *vm) {
+    need_operands(vm, 1);
+    return vm->operands[--vm->op_sz];
 }
 
-void pop_n_operands(size_t n) {
-    assert(itp->op_sz >= n);
-    itp->op_sz -= n;
+void pop_n_operands(VM *vm, size_t n) {
+    need_operands(vm, n);
+    vm->op_sz -= n;
 }
 
-Value peek_operand() {
-    assert(itp->op_sz > 0);
-    return itp->operands[itp->op_sz - 1];
+Value peek_operand(VM *vm) {
+    need_operands(vm, 1);
+    return vm->operands[vm->op_sz - 1];
 }
 
-void push_operand(uint8_t *value) {
-    assert(itp->op_sz < MAX_OPERANDS);
-    itp->operands[itp->op_sz++] = value;
+void push_operand(VM *vm, uint8_t *value) {
+    if (__builtin_expect(vm->op_sz == MAX_OPERANDS, 0))
+        runtime_error("Error: Operand stack overflow\n");
+    vm->operands[vm->op_sz++] = value;
 }
 
-void push_frame() {
-    assert(itp->frames_sz < MAX_FRAMES);
-    itp->frames_sz++;
+void push_frame(VM *vm) {
+    if (vm->frames_sz == MAX_FRAMES)
+        runtime_error("Error: Call stack overflow\n");
+    vm->frames_sz++;
+    stats_frame_depth(&vm->stats, vm->frames_sz);
 }
 
-void pop_frame() {
-    assert(itp->frames_sz > 0);
-    free(itp->frames[--itp->frames_sz].locals);
+void pop_frame(VM *vm) {
+    assert(vm->frames_sz > 0);
+    free(vm->frames[--vm->frames_sz].locals);
 }
 
-bool index_is_global(uint16_t index) {
-    assert(*const_pool_map[index] == VK_STRING);
-    for (int i = 0; i < globals.count; ++i) {
-        if (globals.indexes[i] == index) {
+bool index_is_global(VM *vm, uint16_t index) {
+    assert(*vm->const_pool_map[index] == VK_STRING);
+    for (int i = 0; i < vm->globals.count; ++i) {
+        if (vm->globals.indexes[i] == index) {
             return true;
         }
     }
     return false;
 }
 
-void exec_drop() {
-    //assert that there is something to be dropped
-    assert(itp->op_sz > 0);
-    pop_operand();
+void exec_drop(VM *vm) {
+    pop_operand(vm);
 }
 
-void init_frame(uint8_t argc, bool is_method) {
+void init_frame(VM *vm, uint8_t argc, bool is_method) {
     //we will pop argc args
-    assert(itp->op_sz >= argc);
+    need_operands(vm, argc);
     //itp->frames[itp->frames_sz].locals = malloc(fun->params + fun->locals);
-    itp->frames[itp->frames_sz].locals = malloc(sizeof(uint8_t *) * (argc + 1));
+    vm->frames[vm->frames_sz].locals = malloc(sizeof(uint8_t *) * (argc + 1));
     for (int i = is_method ? argc - 1: argc; i > 0; --i) {
-        itp->frames[itp->frames_sz].locals[i] = pop_operand();
+        vm->frames[vm->frames_sz].locals[i] = pop_operand(vm);
     }
     if (is_method) {
         //set the receiver
-        Value obj = pop_operand();
-        itp->frames[itp->frames_sz].locals[0] = obj;
+        Value obj = pop_operand(vm);
+        vm->frames[vm->frames_sz].locals[0] = obj;
     }
     else {
         //for normal function calls set the receiver to null
-        itp->frames[itp->frames_sz].locals[0] = global_null;
+        vm->frames[vm->frames_sz].locals[0] = vm->global_null;
     }
 
 
 }
 
-void init_fun_call(uint8_t argc, bool is_method) {
-    Bc_Func *fun = (Bc_Func *)pop_operand();
-    assert(fun->kind == VK_FUNCTION);
+void init_fun_call(VM *vm, uint8_t argc, bool is_method) {
+    Bc_Func *fun = (Bc_Func *)pop_operand(vm);
+    if (fun->kind != VK_FUNCTION)
+        runtime_error("Error: Only functions can be called\n");
     //TODO: we can read the function from the stack beforehand and prevent realloc
     //doing this because it's simple :)
-    itp->frames[itp->frames_sz].locals = realloc(itp->frames[itp->frames_sz].locals,
+    vm->frames[vm->frames_sz].locals = realloc(vm->frames[vm->frames_sz].locals,
                                                 sizeof(uint8_t *)*(fun->params + fun->locals));
-    assert(is_method ? argc == fun->params : argc + 1 == fun->params);
+    if (is_method ? argc != fun->params : argc + 1 != fun->params)
+        runtime_error("Error: The function takes %d arguments, got %d\n", fun->params - 1, is_method ? argc - 1 : argc);
     //set the rest of the locals to null
     for (int i = argc + 1; i < fun->params + fun->locals; ++i) {
-        itp->frames[itp->frames_sz].locals[i] = global_null;
+        vm->frames[vm->frames_sz].locals[i] = vm->global_null;
     }
-    itp->frames[itp->frames_sz].locals_sz = fun->params + fun->locals;
+    vm->frames[vm->frames_sz].locals_sz = fun->params + fun->locals;
 
     //set the return address
-    itp->frames[itp->frames_sz].ret_addr = itp->ip;
-    push_frame();
-    itp->ip = fun->bytecode;
+    vm->frames[vm->frames_sz].ret_addr = vm->ip;
+    push_frame(vm);
+    vm->ip = fun->bytecode;
+    //the name is resolved from the function pointer when the trace is written
+    trace_begin((Str){ .str = (uint8_t *)fun, .len = 0 }, "call");
+    heap_snapshot_poll();
 }
 
-void exec_constant() {
-    uint16_t index = deserialize_u16(itp->ip);
+void exec_constant(VM *vm) {
+    uint16_t index = deserialize_u16(vm->ip);
 
     //print_heap(heap);
-    switch (*const_pool_map[index]) {
+    switch (*vm->const_pool_map[index]) {
         case VK_INTEGER: {
-            Integer *integer = (Integer *)const_pool_map[index];
+            Integer *integer = (Integer *)vm->const_pool_map[index];
             assert(integer->kind == VK_INTEGER);
-            push_operand(construct_integer(integer->val, heap));
+            push_operand(vm, construct_integer(integer->val, vm->heap));
             break;
         }
         case VK_NULL: {
-            Null *null = (Null *)const_pool_map[index];
+            Null *null = (Null *)vm->const_pool_map[index];
             assert(null->kind == VK_NULL);
-            push_operand(global_null);
+            push_operand(vm, vm->global_null);
             break;
         }
         case VK_BOOLEAN: {
-            Boolean *boolean = (Boolean *)const_pool_map[index];
+            Boolean *boolean = (Boolean *)vm->const_pool_map[index];
             assert(boolean->kind == VK_BOOLEAN);
-            push_operand(construct_boolean(boolean->val, heap));
+            push_operand(vm, construct_boolean(boolean->val, vm->heap));
             break;
         }
         case VK_STRING: {
-            Bc_String *string = (Bc_String *)const_pool_map[index];
+            Bc_String *string = (Bc_String *)vm->const_pool_map[index];
             assert(string->kind == VK_STRING);
-            push_operand(construct_bc_string(string, heap));
+            push_operand(vm, construct_bc_string(string, vm->heap));
             break;
         }
 
         case VK_FUNCTION: {
-            Bc_Func *function = (Bc_Func *)const_pool_map[index];
+            Bc_Func *function = (Bc_Func *)vm->const_pool_map[index];
             assert(function->kind == VK_FUNCTION);
-            push_operand(construct_bc_function(function, heap));
+            push_operand(vm, construct_bc_function(function, vm->heap));
             break;
         }
         default: {
-            printf("Unknown constant type\n");
-            exit(1);
+            runtime_error("Unknown constant type\n");
         }
     }
     //print_heap(heap);
-    itp->ip += 2;
+    vm->ip += 2;
 }
 
-void exec_print() {
+void exec_print(VM *vm) {
     //assert that there is index to the constant pool, where the format str is stored
     //assert(itp.op_sz);
-    uint16_t index = deserialize_u16(itp->ip);
-    itp->ip += 2;
-    uint8_t num_args = *itp->ip;
-    itp->ip += 1;
-    Bc_String *prnt = (Bc_String *)const_pool_map[index];
-    assert(prnt->kind == VK_STRING);
-
-    //pop all the operands at once, see the comment before print_val
-    pop_n_operands(num_args);
-    size_t tilda = 0;
-    for (size_t i = 0; i < prnt->len; i++) {
-        if (prnt->value[i] == '~') {
-            //we popped num_args operands from the stack
-            //thus the current stack pointer points to the first argument of the print
-            //arg1 is the first field of the "print_args" array thus we only add tilda
-            print_val(itp->operands[itp->op_sz + tilda]);
-            //print_val((Value)pop_operand());
-            tilda++;
-        }
-        else {
-            char c = prnt->value[i];
-            //check for escape characters
-            if (c == '\\' && prnt->len > i + 1) {
-                char next = prnt->value[i + 1];
-                //increment i so we don't print the next character two times
-                i++;
-                if (next == 'n') {
-                    printf("\n");
-                }
-                else if (next == 't') {
-                    printf("\t");
-                }
-                else if (next == 'r') {
-                    printf("\r");
-                }
-                else if (next == '~') {
-                    printf("~");
-                }
-                else {
-                    printf("%c", next);
-                }
-            }
-            else {
-                printf("%c", prnt->value[i]);
-            }
-        }
-    }
-    push_operand(global_null);
+    uint16_t index = deserialize_u16(vm->ip);
+    vm->ip += 2;
+    uint8_t num_args = *vm->ip;
+    vm->ip += 1;
+    //the format was split into literal runs by prescan_formats
+    assert(vm->const_pool_formats[index] != NULL);
+
+    //pop all the operands at once
+    //the current stack pointer then points to the first argument of the print
+    pop_n_operands(vm, num_args);
+    print_format(vm->const_pool_formats[index], num_args, vm->operands + vm->op_sz);
+    push_operand(vm, vm->global_null);
 }
 
-void exec_return() {
-    assert(itp->frames_sz > 0);
-    itp->ip = itp->frames[--itp->frames_sz].ret_addr;
-    free(itp->frames[itp->frames_sz].locals);
+void exec_return(VM *vm) {
+    assert(vm->frames_sz > 0);
+    vm->ip = vm->frames[--vm->frames_sz].ret_addr;
+    free(vm->frames[vm->frames_sz].locals);
+    trace_end("call");
 }
 
-void exec_get_local() {
-    uint16_t index = deserialize_u16(itp->ip);
-    itp->ip += 2;
+void exec_get_local(VM *vm) {
+    uint16_t index = deserialize_u16(vm->ip);
+    vm->ip += 2;
     //printf("get local: \n");
     //print_val((Value)itp->frames[itp->frames_sz - 1].locals[index]);
-    push_operand(itp->frames[itp->frames_sz - 1].locals[index]);
+    push_operand(vm, vm->frames[vm->frames_sz - 1].locals[index]);
+}
+
+void exec_set_local(VM *vm) {
+    uint16_t index = deserialize_u16(vm->ip);
+    vm->ip += 2;
+    vm->frames[vm->frames_sz - 1].locals[index] = peek_operand(vm);
 }
 
-void exec_set_local() {
-    uint16_t index = deserialize_u16(itp->ip);
-    itp->ip += 2;
-    itp->frames[itp->frames_sz - 1].locals[index] = peek_operand();
+void exec_set_global(VM *vm) {
+    uint16_t index = deserialize_u16(vm->ip);
+    assert(index_is_global(vm, index));
+    vm->ip += 2;
+    vm->globals.values[index] = peek_operand(vm);
 }
 
-void exec_set_global() {
-    uint16_t index = deserialize_u16(itp->ip);
-    assert(index_is_global(index));
-    itp->ip += 2;
-    globals.values[index] = peek_operand();
+void exec_get_global(VM *vm) {
+    uint16_t index = deserialize_u16(vm->ip);
+    assert(index_is_global(vm, index));
+    vm->ip += 2;
+    push_operand(vm, vm->globals.values[index]);
 }
 
-void exec_get_global() {
-    uint16_t index = deserialize_u16(itp->ip);
-    assert(index_is_global(index));
-    itp->ip += 2;
-    push_operand(globals.values[index]);
+//out of fuel at a safepoint, kept out of line so the safepoints stay a decrement and a branch
+__attribute__((noinline, cold))
+static void fuel_exhausted(VM *vm) {
+    budget_charge(&vm->budget);
+    if (!vm->preemptible) {
+        budget_refuel(&vm->budget, UINT32_MAX);
+        return;
+    }
+    vm->slice_left -= vm->budget.chunk;
+    if (vm->slice_left == 0) {
+        //ends the loop after this instruction, bc_resume goes on from here
+        vm->stop_depth = SIZE_MAX;
+        return;
+    }
+    budget_refuel(&vm->budget, vm->slice_left);
 }
 
-void exec_jump() {
-    int16_t offset = deserialize_i16(itp->ip);
-    itp->ip += 2;
-    itp->ip += offset;
+//backedges and calls are the safepoints, every loop iteration and every recursion passes one
+//called when the instruction is done, so a suspended VM resumes at the next one
+static inline void safepoint(VM *vm) {
+    if (__builtin_expect(--vm->budget.fuel == 0, 0))
+        fuel_exhausted(vm);
 }
 
-void exec_branch() {
-    int16_t offset = deserialize_i16(itp->ip);
-    itp->ip += 2;
-    if (truthiness(pop_operand()))
-        itp->ip += offset;
+void exec_jump(VM *vm) {
+    int16_t offset = deserialize_i16(vm->ip);
+    vm->ip += 2;
+    vm->ip += offset;
+    if (offset < 0)
+        safepoint(vm);
 }
 
-void exec_call_function() {
-    uint8_t argc = *itp->ip;
-    itp->ip += 1;
+void exec_branch(VM *vm) {
+    int16_t offset = deserialize_i16(vm->ip);
+    vm->ip += 2;
+    if (truthiness(pop_operand(vm))) {
+        vm->ip += offset;
+        if (offset < 0)
+            safepoint(vm);
+    }
+}
+
+//the call of snapshot(), returns null and with an image file set writes the image and ends the run
+static void exec_snapshot_mark(VM *vm, uint8_t argc) {
+    if (argc != 0)
+        runtime_error("Error: snapshot() takes no arguments\n");
+    pop_operand(vm);
+    push_operand(vm, vm->global_null);
+    if (vm->image_file == NULL)
+        return;
+    bc_snapshot_write(vm, vm->image_file);
+    vm->snapshot_taken = true;
+    //unwinding the frames stops the bytecode loop
+    while (vm->frames_sz > 0) {
+        pop_frame(vm);
+        trace_end("call");
+    }
+    vm->op_sz = 0;
+}
+
+void exec_call_function(VM *vm) {
+    uint8_t argc = *vm->ip;
+    vm->ip += 1;
+    //the function is below the arguments
+    need_operands(vm, argc + 1);
+    if (vm->operands[vm->op_sz - argc - 1] == vm->snapshot_mark) {
+        exec_snapshot_mark(vm, argc);
+        return;
+    }
     //Bc_Func *fun= (Bc_Func *)pop_operand();
     //assert(fun->kind == VK_FUNCTION);
     //in normal fun call the receiver is null
-    init_frame(argc, false);
-    init_fun_call(argc, false);
+    vm->stats.calls++;
+    init_frame(vm, argc, false);
+    init_fun_call(vm, argc, false);
+    safepoint(vm);
 }
 
-void exec_array() {
-    Value init_val = pop_operand();
-    Integer *size = (Integer *)pop_operand();
-    assert(size->kind == VK_INTEGER);
-    assert(size->val >= 0);
-    Array *array = (Array *)construct_array(size->val, heap);
-    for (int i = 0; i < size->val; i++) {
+void exec_array(VM *vm) {
+    //the operands stay on the stack during the allocation, the collector has to see init_val
+    //and may move both, so they are read only after it
+    need_operands(vm, 2);
+    Integer *size = (Integer *)vm->operands[vm->op_sz - 2];
+    if (size->kind != VK_INTEGER || size->val < 0)
+        runtime_error("Error: The size of an array has to be a non-negative integer\n");
+    int len = size->val;
+    Array *array = (Array *)construct_array(len, vm->heap);
+    Value init_val = pop_operand(vm);
+    pop_operand(vm);
+    for (int i = 0; i < len; i++) {
         array->val[i] = init_val;
     }
-    push_operand((uint8_t *)array);
+    push_operand(vm, (uint8_t *)array);
 }
 
-void exec_object() {
-    uint16_t index = deserialize_u16(itp->ip);
-    itp->ip += 2;
-    Bc_Class *cls = (Bc_Class *)const_pool_map[index];
+void exec_object(VM *vm) {
+    uint16_t index = deserialize_u16(vm->ip);
+    vm->ip += 2;
+    Bc_Class *cls = (Bc_Class *)vm->const_pool_map[index];
     assert(cls->kind == VK_CLASS);
+    //the fields and the parent
+    need_operands(vm, cls->count + 1);
     //construct the object with parent global_null, will modify this later
-    Object *obj = (Object *)construct_object(cls->count, global_null, heap);
+    Object *obj = (Object *)construct_object(cls->count, vm->global_null, vm->heap);
     //print_heap(heap);
 
     Bc_String *name;
-    assert(itp->op_sz >= cls->count);
     //traverse the class fields in reverse order and set the fields of the object
+    //the object is fresh, so the stores need no heap_write_barrier
     for (int i = cls->count - 1; i >= 0; i--) {
-        name = (Bc_String *)const_pool_map[cls->members[i]];
+        name = (Bc_String *)vm->const_pool_map[cls->members[i]];
         assert(name->kind == VK_STRING);
         obj->val[i].name.len = name->len;
         obj->val[i].name.str = (uint8_t *)name->value;
-        obj->val[i].val = pop_operand();
+        obj->val[i].val = pop_operand(vm);
     }
-    obj->parent = pop_operand();
-    push_operand((uint8_t *)obj);
+    obj->parent = pop_operand(vm);
+    push_operand(vm, (uint8_t *)obj);
     //print_heap(heap);
 }
 
-Field *get_field(Object *obj, Bc_String *name) {
-    assert(obj->kind == VK_OBJECT);
+Field *get_field(VM *vm, Object *obj, Bc_String *name) {
+    if (obj->kind != VK_OBJECT)
+        runtime_error("Error: Field %.*s not found\n", (int)name->len, name->value);
     for (size_t i = 0; i < obj->field_cnt; ++i) {
         if (str_eq(obj->val[i].name, (Str){name->value, name->len})) {
             return &obj->val[i];
         }
     }
     //if the parent is of primitive type then the field is not found
-    if (*obj->parent == VK_OBJECT)
-        return get_field((Object *)obj->parent, name);
-    printf("field not found: %s", name->value);
-    exit(1);
+    if (*obj->parent == VK_OBJECT) {
+        vm->stats.parent_hops++;
+        return get_field(vm, (Object *)obj->parent, name);
+    }
+    runtime_error("field not found: %s", name->value);
 }
 
-void exec_get_field() {
-    uint16_t index = deserialize_u16(itp->ip);
-    itp->ip += 2;
-    Bc_String *name = (Bc_String *)const_pool_map[index];
+void exec_get_field(VM *vm) {
+    uint16_t index = deserialize_u16(vm->ip);
+    vm->ip += 2;
+    Bc_String *name = (Bc_String *)vm->const_pool_map[index];
     assert(name->kind == VK_STRING);
-    Object *obj = (Object *)pop_operand();
-    assert(obj->kind == VK_OBJECT);
-    Field *field = get_field(obj, name);
-    push_operand(field->val);
+    Object *obj = (Object *)pop_operand(vm);
+    vm->stats.field_lookups++;
+    Field *field = get_field(vm, obj, name);
+    push_operand(vm, field->val);
 }
 
-void exec_set_field() {
-    uint16_t index = deserialize_u16(itp->ip);
-    itp->ip += 2;
-    Bc_String *name = (Bc_String *)const_pool_map[index];
+void exec_set_field(VM *vm) {
+    uint16_t index = deserialize_u16(vm->ip);
+    vm->ip += 2;
+    Bc_String *name = (Bc_String *)vm->const_pool_map[index];
     assert(name->kind == VK_STRING);
     //val is new value for field name
-    Value val = (Value)pop_operand();
-    Object *obj = (Object *)pop_operand();
-    assert(obj->kind == VK_OBJECT);
-    Field *field = get_field(obj, name);
+    Value val = (Value)pop_operand(vm);
+    Object *obj = (Object *)pop_operand(vm);
+    vm->stats.field_lookups++;
+    Field *field = get_field(vm, obj, name);
+    heap_write_barrier(vm->heap, &field->val);
     field->val = val;
-    push_operand(val);
+    push_operand(vm, val);
 }
 
-uint8_t *get_nth_local(size_t n) {
-    assert(n <= itp->frames[itp->frames_sz - 1].locals_sz);
+uint8_t *get_nth_local(VM *vm, size_t n) {
+    assert(n <= vm->frames[vm->frames_sz - 1].locals_sz);
     //TODO this is hacky.. for builtins we don't call init_fun_call and thus a new frame is not created
-    return itp->frames[itp->frames_sz].locals[n];
+    return vm->frames[vm->frames_sz].locals[n];
 }
 
-void bc_builtins(Value obj, int argc, Str m_name) {
+void bc_builtins(VM *vm, Value obj, int argc, Str m_name) {
     /*
         FROM REFERENCE IMPLEMENTATION
     */
@@ -411,135 +466,140 @@ void bc_builtins(Value obj, int argc, Str m_name) {
     size_t method_name_len = m_name.len;
     #define METHOD(name) \
 			if (sizeof(name) - 1 == method_name_len && memcmp(name, method_name, method_name_len) == 0) /* body*/
-    print_op_stack(itp->operands, itp->op_sz);
+    //argc counts the receiver
     if (*obj == VK_INTEGER || *obj == VK_BOOLEAN || *obj == VK_NULL) {
-        assert(argc == 2);
-        Value second = get_nth_local(1);
+        check_argc(argc - 1, 1, m_name);
+        Value second = get_nth_local(vm, 1);
         METHOD("+") {
-            assert(*obj == VK_INTEGER && *second == VK_INTEGER);
-            push_operand(construct_integer(((Integer *)obj)->val + ((Integer *)second)->val, heap));
+            check_integer_operands(obj, second, m_name);
+            push_operand(vm, construct_integer(((Integer *)obj)->val + ((Integer *)second)->val, vm->heap));
             return;
         }
         METHOD("-") {
-            assert(*obj == VK_INTEGER && *second == VK_INTEGER);
-            push_operand(construct_integer(((Integer *)obj)->val - ((Integer *)second)->val, heap));
+            check_integer_operands(obj, second, m_name);
+            push_operand(vm, construct_integer(((Integer *)obj)->val - ((Integer *)second)->val, vm->heap));
             return;
         }
         METHOD("*") {
-            assert(*obj == VK_INTEGER && *second == VK_INTEGER);
-            push_operand(construct_integer(((Integer *)obj)->val * ((Integer *)second)->val, heap));
+            check_integer_operands(obj, second, m_name);
+            push_operand(vm, construct_integer(((Integer *)obj)->val * ((Integer *)second)->val, vm->heap));
             return;
         }
         METHOD("/") {
-            assert(*obj == VK_INTEGER && *second == VK_INTEGER);
-            push_operand(construct_integer(((Integer *)obj)->val / ((Integer *)second)->val, heap));
+            check_integer_operands(obj, second, m_name);
+            check_divisor(((Integer *)obj)->val, ((Integer *)second)->val);
+            push_operand(vm, construct_integer(((Integer *)obj)->val / ((Integer *)second)->val, vm->heap));
             return;
         }
         METHOD("%") {
-            assert(*obj == VK_INTEGER && *second == VK_INTEGER);
-            push_operand(construct_integer(((Integer *)obj)->val % ((Integer *)second)->val, heap));
+            check_integer_operands(obj, second, m_name);
+            check_divisor(((Integer *)obj)->val, ((Integer *)second)->val);
+            push_operand(vm, construct_integer(((Integer *)obj)->val % ((Integer *)second)->val, vm->heap));
             return;
         }
         METHOD("<=") {
-            assert(*obj == VK_INTEGER && *second == VK_INTEGER);
-            push_operand(construct_boolean(((Integer *)obj)->val <= ((Integer *)second)->val, heap));
+            check_integer_operands(obj, second, m_name);
+            push_operand(vm, construct_boolean(((Integer *)obj)->val <= ((Integer *)second)->val, vm->heap));
             return;
         }
         METHOD(">=") {
-            assert(*obj == VK_INTEGER && *second == VK_INTEGER);
-            push_operand(construct_boolean(((Integer *)obj)->val >= ((Integer *)second)->val, heap));
+            check_integer_operands(obj, second, m_name);
+            push_operand(vm, construct_boolean(((Integer *)obj)->val >= ((Integer *)second)->val, vm->heap));
             return;
         }
         METHOD(">") {
-            assert(*obj == VK_INTEGER && *second == VK_INTEGER);
-            push_operand(construct_boolean(((Integer *)obj)->val > ((Integer *)second)->val, heap));
+            check_integer_operands(obj, second, m_name);
+            push_operand(vm, construct_boolean(((Integer *)obj)->val > ((Integer *)second)->val, vm->heap));
             return;
         }
         METHOD("<") {
-            assert(*obj == VK_INTEGER && *second == VK_INTEGER);
-            push_operand(construct_boolean(((Integer *)obj)->val < ((Integer *)second)->val, heap));
+            check_integer_operands(obj, second, m_name);
+            push_operand(vm, construct_boolean(((Integer *)obj)->val < ((Integer *)second)->val, vm->heap));
             return;
         }
         METHOD("==") {
             if (*obj == VK_INTEGER && *second != VK_INTEGER)
-                push_operand(construct_boolean(false, heap));
+                push_operand(vm, construct_boolean(false, vm->heap));
             else if (*obj == VK_INTEGER && *second == VK_INTEGER)
-                push_operand(construct_boolean(((Integer *)obj)->val == ((Integer *)second)->val, heap));
+                push_operand(vm, construct_boolean(((Integer *)obj)->val == ((Integer *)second)->val, vm->heap));
             else if (*obj == VK_NULL && *second != VK_NULL)
-                push_operand(construct_boolean(false, heap));
+                push_operand(vm, construct_boolean(false, vm->heap));
             else if (*obj == VK_NULL && *second == VK_NULL)
-                push_operand(construct_boolean(true, heap));
+                push_operand(vm, construct_boolean(true, vm->heap));
             else if (*obj == VK_BOOLEAN && *second != VK_BOOLEAN)
-                push_operand(construct_boolean(false, heap));
+                push_operand(vm, construct_boolean(false, vm->heap));
             else
-                push_operand(construct_boolean(((Boolean *) obj)->val == ((Boolean *) second)->val, heap));
+                push_operand(vm, construct_boolean(((Boolean *) obj)->val == ((Boolean *) second)->val, vm->heap));
             return;
         }
         METHOD("!=") {
             if (*obj == VK_INTEGER && *second != VK_INTEGER)
-                push_operand(construct_boolean(true, heap));
+                push_operand(vm, construct_boolean(true, vm->heap));
             else if (*obj == VK_INTEGER && *second == VK_INTEGER)
-                push_operand(construct_boolean(((Integer *)obj)->val != ((Integer *)second)->val, heap));
+                push_operand(vm, construct_boolean(((Integer *)obj)->val != ((Integer *)second)->val, vm->heap));
             else if (*obj == VK_NULL && *second != VK_NULL)
-                push_operand(construct_boolean(true, heap));
+                push_operand(vm, construct_boolean(true, vm->heap));
             else if (*obj == VK_NULL && *second == VK_NULL)
-                push_operand(construct_boolean(false, heap));
+                push_operand(vm, construct_boolean(false, vm->heap));
             else if (*obj == VK_BOOLEAN && *second != VK_BOOLEAN)
-                push_operand(construct_boolean(true, heap));
+                push_operand(vm, construct_boolean(true, vm->heap));
             else
-                push_operand(construct_boolean(((Boolean *) obj)->val != ((Boolean *) second)->val, heap));
+                push_operand(vm, construct_boolean(((Boolean *) obj)->val != ((Boolean *) second)->val, vm->heap));
             return;
         }
     }
     if (*obj == VK_BOOLEAN) {
-        assert(argc == 2);
-        Value second = get_nth_local(1);
+        Value second = get_nth_local(vm, 1);
         METHOD("&") {
-            assert(*obj == VK_BOOLEAN && *second == VK_BOOLEAN);
-            push_operand(construct_boolean(((Boolean *)obj)->val & ((Boolean *)second)->val, heap));
+            if (*second != VK_BOOLEAN)
+                runtime_error("Error: The operands of & have to be booleans\n");
+            push_operand(vm, construct_boolean(((Boolean *)obj)->val & ((Boolean *)second)->val, vm->heap));
             return;
         }
         METHOD("|") {
-            assert(*obj == VK_BOOLEAN && *second == VK_BOOLEAN);
-            push_operand(construct_boolean(((Boolean *)obj)->val | ((Boolean *)second)->val, heap));
+            if (*second != VK_BOOLEAN)
+                runtime_error("Error: The operands of | have to be booleans\n");
+            push_operand(vm, construct_boolean(((Boolean *)obj)->val | ((Boolean *)second)->val, vm->heap));
             return;
         }
     }
 
     METHOD("set") {
         if (*obj == VK_ARRAY) {
-            Value index = get_nth_local(1);
-            Value val = get_nth_local(2);
-            assert(*index == VK_INTEGER);
+            check_argc(argc - 1, 2, m_name);
+            Value index = get_nth_local(vm, 1);
+            Value val = get_nth_local(vm, 2);
+            check_array_index(obj, index);
             Array *array = (Array *)obj;
             //TODO this is fishy: should i just peek?
             //Array(arr)	set	Integer(i), v	arr(i) ← v; v
+            heap_write_barrier(vm->heap, &array->val[((Integer *)index)->val]);
             array->val[((Integer *)index)->val] = val;
-            push_operand(val);
+            push_operand(vm, val);
+            return;
         }
-        return;
     }
 
     METHOD("get") {
         if (*obj == VK_ARRAY) {
+            check_argc(argc - 1, 1, m_name);
             Array *array = (Array *)obj;
-            Integer *index = (Integer *) get_nth_local(1);
-            assert(index->kind == VK_INTEGER);
-            assert(index->val >= 0 && (size_t)index->val < array->size);
-            push_operand(array->val[index->val]);
+            Integer *index = (Integer *) get_nth_local(vm, 1);
+            check_array_index(obj, (Value)index);
+            push_operand(vm, array->val[index->val]);
+            return;
         }
-        return;
     }
-    printf("Unknown built-in method: ");
-    printf("%.*s\n", (int)m_name.len, m_name.str);
-    exit(1);
+    runtime_error("Unknown built-in method: %.*s\n", (int)m_name.len, m_name.str);
 }
 
-void bc_method_call(Value obj, Str name, int argc) {
+void bc_method_call(VM *vm, Value obj, Str name, int argc) {
     Object *object = (Object *)obj;
     //if inheriting from a primitive type then call the builtin
     if (object->kind != VK_OBJECT) {
-        bc_builtins(obj, argc, name);
+        bc_builtins(vm, obj, argc, name);
+        //the frame was never pushed, nothing returns from it
+        free(vm->frames[vm->frames_sz].locals);
         return;
     }
     for (size_t i = 0; i < object->field_cnt; i++) {
@@ -547,240 +607,786 @@ void bc_method_call(Value obj, Str name, int argc) {
         //and prepare the locals, rest will be handled in the bytecode_loop
         if (str_eq(object->val[i].name, name)) {
             Field field = object->val[i];
-            assert(*field.val == VK_FUNCTION);
+            if (*field.val != VK_FUNCTION)
+                runtime_error("Error: Field %.*s is not a method\n", (int)name.len, name.str);
             Function *func = (Function *)field.val;
             //we push here the pointer to the function object
             //this function object will be popped by the init_fun_call function
-            push_operand((uint8_t *)func);
-            init_fun_call(argc, true);
+            push_operand(vm, (uint8_t *)func);
+            init_fun_call(vm, argc, true);
             return;
         }
     }
-    bc_method_call(object->parent, name, argc);
+    vm->stats.parent_hops++;
+    bc_method_call(vm, object->parent, name, argc);
 }
 
 
-void exec_call_method() {
+void exec_call_method(VM *vm) {
     //index for the method to be called
-    uint16_t index = deserialize_u16(itp->ip);
-    itp->ip += 2;
-    uint8_t argc = *itp->ip;
-    itp->ip += 1;
+    uint16_t index = deserialize_u16(vm->ip);
+    vm->ip += 2;
+    uint8_t argc = *vm->ip;
+    vm->ip += 1;
 
     //name of the method
-    Bc_String *m_name = (Bc_String *)const_pool_map[index];
+    Bc_String *m_name = (Bc_String *)vm->const_pool_map[index];
 
     assert(m_name->kind == VK_STRING);
 
-    init_frame(argc, true);
-    print_op_stack(itp->operands, itp->op_sz);
+    init_frame(vm, argc, true);
 
-    Object *obj = (Object *)itp->frames[itp->frames_sz].locals[0];
+    Object *obj = (Object *)vm->frames[vm->frames_sz].locals[0];
+    vm->stats.method_calls[obj->kind]++;
 
-    bc_method_call((Value)obj, (Str) {m_name->value, m_name->len}, argc);
+    bc_method_call(vm, (Value)obj, (Str) {m_name->value, m_name->len}, argc);
+    safepoint(vm);
 }
 
-void bytecode_loop(){
-    while (itp->frames_sz) {
-        //print_heap(heap);
-        print_instruction_type(*itp->ip);
-        switch (*itp->ip++) {
-            case DROP: {
-                exec_drop();
-                break;
-            }
-            case CONSTANT: {
-                exec_constant();
+//executes the instruction at ip, inlined into both the plain and the traced loop
+static inline void exec_instruction(VM *vm) {
+    switch (*vm->ip++) {
+        case DROP: {
+            exec_drop(vm);
+            break;
+        }
+        case CONSTANT: {
+            exec_constant(vm);
+            break;
+        }
+        case PRINT:
+            exec_print(vm);
+            break;
+        case ARRAY:
+            exec_array(vm);
+            break;
+        case OBJECT:
+            exec_object(vm);
+            break;
+        case GET_FIELD:
+            exec_get_field(vm);
+            break;
+        case SET_FIELD:
+            exec_set_field(vm);
+            break;
+        case CALL_METHOD:
+            exec_call_method(vm);
+            break;
+        case CALL_FUNCTION:
+            exec_call_function(vm);
+            break;
+        case SET_LOCAL:
+            exec_set_local(vm);
+            break;
+        case GET_LOCAL:
+            exec_get_local(vm);
+            break;
+        case SET_GLOBAL:
+            exec_set_global(vm);
+            break;
+        case GET_GLOBAL:
+            exec_get_global(vm);
+            break;
+        case BRANCH:
+            exec_branch(vm);
+            break;
+        case JUMP:
+            exec_jump(vm);
+            break;
+        case RETURN:
+            exec_return(vm);
+            break;
+        default:
+            runtime_error("Unknown instruction: 0x%02X\n", *vm->ip);
+    }
+}
+
+void bytecode_loop(VM *vm) {
+    while (vm->frames_sz > vm->stop_depth) {
+        exec_instruction(vm);
+    }
+}
+
+//counts the executed instruction and tracks the operand stack depth for --stats
+static inline void count_instruction(VM *vm) {
+    vm->stats.instructions++;
+    if (vm->op_sz > vm->stats.max_operands)
+        vm->stats.max_operands = vm->op_sz;
+}
+
+//same as bytecode_loop but collects the statistics only the loop can see and tracks the allocation site
+//the traced and profiled loops do the same, so --stats and --alloc-sites combine with them
+void bytecode_loop_instrumented(VM *vm) {
+    while (vm->frames_sz > vm->stop_depth) {
+        alloc_site = vm->ip;
+        exec_instruction(vm);
+        count_instruction(vm);
+    }
+}
+
+#if FML_TRACE
+//same as bytecode_loop but prints every executed instruction and the operand stack after it
+//kept as a separate loop so the plain one doesn't pay anything for tracing
+void bytecode_loop_traced(VM *vm) {
+    while (vm->frames_sz > vm->stop_depth) {
+        print_instruction_type(*vm->ip);
+        alloc_site = vm->ip;
+        exec_instruction(vm);
+        count_instruction(vm);
+        print_op_stack(vm->operands, vm->op_sz);
+    }
+}
+#endif
+
+//const pool index of the function whose bytecode contains `ip`
+//the constants are laid out in the pool in order, so we can bisect const_pool_map
+//index of the constant `at` points into, `at` has to lie in the const pool
+static uint16_t constant_index(VM *vm, uint8_t *at) {
+    uint16_t lo = 0;
+    uint16_t hi = vm->const_pool_count - 1;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi - lo + 1) / 2;
+        if (vm->const_pool_map[mid] <= at)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+uint16_t function_index(VM *vm, uint8_t *ip) {
+    uint16_t index = constant_index(vm, ip);
+    assert(*vm->const_pool_map[index] == VK_FUNCTION);
+    return index;
+}
+
+//same as bytecode_loop but measures every instruction with the TSC
+//the function currently executing is tracked in a side stack parallel to the frames
+void bytecode_loop_profiled(VM *vm, OpProfile *prof) {
+    uint16_t *funs = malloc(sizeof(uint16_t) * (MAX_FRAMES + 1));
+    //only the entry point for a fresh run, a VM restored from a snapshot has more frames
+    //every frame runs the function its callee returns into, the top one the function of ip
+    for (size_t i = 0; i < vm->frames_sz; i++) {
+        funs[i] = function_index(vm, i + 1 < vm->frames_sz ? vm->frames[i + 1].ret_addr : vm->ip);
+    }
+    prof->calls[funs[vm->frames_sz - 1]]++;
+    //there is no pair for the first instruction
+    Instruction prev = INSTRUCTION_CNT;
+    uint64_t prev_cycles = 0;
+    while (vm->frames_sz > vm->stop_depth) {
+        Instruction ins = *vm->ip;
+        size_t frames_sz = vm->frames_sz;
+        alloc_site = vm->ip;
+        uint64_t start = read_tsc();
+        exec_instruction(vm);
+        uint64_t cycles = read_tsc() - start;
+        count_instruction(vm);
+
+        prof->ops[ins].count++;
+        prof->ops[ins].cycles += cycles;
+        if (prev != INSTRUCTION_CNT) {
+            prof->pairs[prev][ins].count++;
+            prof->pairs[prev][ins].cycles += prev_cycles + cycles;
+        }
+        prof->funcs[funs[frames_sz - 1]].count++;
+        prof->funcs[funs[frames_sz - 1]].cycles += cycles;
+        if (vm->frames_sz > frames_sz) {
+            //a call, ip now points to the start of the callee
+            uint16_t callee = function_index(vm, vm->ip);
+            funs[vm->frames_sz - 1] = callee;
+            prof->calls[callee]++;
+        }
+        prev = ins;
+        prev_cycles = cycles;
+    }
+    free(funs);
+}
+
+//HeapRoots of the bytecode interpreter: globals, operands and locals of the frames, `ctx` is the VM
+void bc_roots(void *ctx, HeapVisit visit, void *visit_ctx) {
+    VM *vm = ctx;
+    visit(visit_ctx, &vm->global_null);
+    for (int i = 0; i < vm->const_pool_count; i++) {
+        visit(visit_ctx, &vm->globals.values[i]);
+    }
+    if (vm->snapshot_mark != NULL) {
+        visit(visit_ctx, &vm->snapshot_mark);
+    }
+    for (size_t i = 0; i < vm->op_sz; i++) {
+        visit(visit_ctx, &vm->operands[i]);
+    }
+    for (size_t i = 0; i < vm->frames_sz; i++) {
+        for (size_t j = 0; j < vm->frames[i].locals_sz; j++) {
+            visit(visit_ctx, &vm->frames[i].locals[j]);
+        }
+    }
+}
+
+//names for the profile report, taken from the globals the functions are stored in
+Str *function_names(VM *vm) {
+    Str *names = calloc(vm->const_pool_count, sizeof(Str));
+    for (int i = 0; i < vm->globals.count; ++i) {
+        uint16_t name_index = vm->globals.indexes[i];
+        Value val = vm->globals.values[name_index];
+        if (*val != VK_FUNCTION)
+            continue;
+        Bc_String *name = (Bc_String *)vm->const_pool_map[name_index];
+        names[function_index(vm, val)] = (Str){name->value, name->len};
+    }
+    return names;
+}
+
+//called from the SIGPROF handler, the ip of a frame is the return address stored in the frame above it
+size_t sample_walk(void *ctx, Str *frames, size_t max) {
+    VM *vm = ctx;
+    size_t frames_sz = vm->frames_sz;
+    size_t start = frames_sz > max ? frames_sz - max : 0;
+    for (size_t i = start; i < frames_sz; ++i) {
+        uint8_t *ip = i + 1 < frames_sz ? vm->frames[i + 1].ret_addr : vm->ip;
+        //the names are only known at exit, store the function index as the key
+        frames[i - start] = (Str){ .str = NULL, .len = function_index(vm, ip) };
+    }
+    return frames_sz - start;
+}
+
+typedef struct {
+    VM *vm;
+    Str *names;
+    //for the generated names of functions which are not stored in globals
+    Arena arena;
+} SampleNames;
+
+Str sample_resolve(void *ctx, Str frame) {
+    SampleNames *sn = ctx;
+    Str *name = &sn->names[frame.len];
+    if (name->len == 0) {
+        //typically methods, name them after their const pool index
+        char *buf = arena_alloc(&sn->arena, 16);
+        int len = snprintf(buf, 16, "fun#%zu", frame.len);
+        *name = (Str){ (uint8_t *)buf, len };
+    }
+    return *name;
+}
+
+//trace events of calls carry the pointer to the Bc_Func with len 0, the phases their names
+Str trace_resolve(void *ctx, Str name) {
+    SampleNames *sn = ctx;
+    if (name.len > 0)
+        return name;
+    return sample_resolve(sn, (Str){ .str = NULL, .len = function_index(sn->vm, (uint8_t *)name.str) });
+}
+
+//the names for the allocation-site report are built on the first use
+//that is at exit or when the heap gets full, the globals hold the functions by then
+void alloc_site_describe(void *ctx, const void *site, Str frame, char *buf, size_t buf_sz) {
+    (void)frame;
+    SampleNames *sn = ctx;
+    VM *vm = sn->vm;
+    if (sn->names == NULL) {
+        sn->names = function_names(vm);
+        arena_init(&sn->arena);
+        sn->names[vm->entry_point] = STR("<entry>");
+    }
+    uint8_t *ip = (uint8_t *)site;
+    uint16_t index = function_index(vm, ip);
+    Bc_Func *fun = (Bc_Func *)vm->const_pool_map[index];
+    Str name = sample_resolve(sn, (Str){ .str = NULL, .len = index });
+    const char *ins = instruction_name(*ip);
+    snprintf(buf, buf_sz, "%.*s+%zu %s", (int)name.len, name.str, (size_t)(ip - fun->bytecode), ins ? ins : "?");
+}
+
+void report_op_profile(VM *vm, OpProfile *prof, const char *csv_file) {
+    FILE *csv = NULL;
+    if (csv_file != NULL) {
+        csv = fopen(csv_file, "w");
+        if (csv == NULL)
+            fprintf(stderr, "failed to open the profile file %s\n", csv_file);
+    }
+    Str *names = function_names(vm);
+    names[vm->entry_point] = STR("<entry>");
+    profile_report(prof, names, stderr, csv);
+    free(names);
+    if (csv != NULL)
+        fclose(csv);
+}
+
+void bc_start(VM *vm) {
+    //we push the etry point function to the operand stack
+    //this function will be popped by the init_fun_call function
+    push_operand(vm, vm->ip);
+    init_frame(vm, 0, false);
+    init_fun_call(vm, 0, false);
+    vm->stats.calls++;
+}
+
+bool bc_resume(VM *vm, uint32_t fuel) {
+    vm->slice_left = fuel;
+    budget_refuel(&vm->budget, fuel);
+    vm->preemptible = true;
+    vm->stop_depth = 0;
+    bytecode_loop(vm);
+    return vm->frames_sz == 0;
+}
+
+void bc_interpret(VM *vm, BcOptions *opts) {
+    //opened before the call of the entry point so the call nests inside it
+    trace_begin(STR("execute"), "phase");
+    if (opts->heap_snapshot_file != NULL) {
+        heap_snapshot_setup(opts->heap_snapshot_file, vm->heap, bc_roots, vm);
+    }
+    SampleNames alloc_site_names = { .vm = vm, .names = NULL };
+    if (opts->alloc_sites) {
+        alloc_sites_start(NULL, alloc_site_describe, &alloc_site_names);
+    }
+    vm->image_file = opts->image_file;
+    //a restored VM resumes in the frames of the snapshot
+    if (vm->frames_sz == 0) {
+        bc_start(vm);
+    } else {
+        //the calls of the restored frames are opened again, so their returns are balanced in the trace
+        for (size_t i = 0; i < vm->frames_sz; i++) {
+            uint8_t *ip = i + 1 < vm->frames_sz ? vm->frames[i + 1].ret_addr : vm->ip;
+            trace_begin((Str){ .str = vm->const_pool_map[function_index(vm, ip)], .len = 0 }, "call");
+        }
+    }
+    if (opts->perf_counters) {
+        perf_phase_begin("execute");
+    }
+    if (opts->sample_file != NULL) {
+        sampler_start(sample_walk, vm);
+    }
+    if (opts->profile_ops) {
+        OpProfile prof;
+        profile_init(&prof, vm->const_pool_count);
+        bytecode_loop_profiled(vm, &prof);
+        report_op_profile(vm, &prof, opts->profile_ops_file);
+        profile_free(&prof);
+    }
+#if FML_TRACE
+    else if (opts->trace) {
+        bytecode_loop_traced(vm);
+    }
+#endif
+    else if (opts->stats || opts->alloc_sites) {
+        bytecode_loop_instrumented(vm);
+    }
+    else {
+        bytecode_loop(vm);
+    }
+    trace_end("phase");
+    if (opts->perf_counters) {
+        perf_phase_end();
+    }
+    if (opts->sample_file != NULL) {
+        sampler_stop();
+    }
+    if (opts->sample_file != NULL || trace_events_enabled) {
+        SampleNames sn = { .vm = vm, .names = function_names(vm) };
+        arena_init(&sn.arena);
+        sn.names[vm->entry_point] = STR("<entry>");
+        if (opts->sample_file != NULL)
+            sampler_write(opts->sample_file, sample_resolve, &sn);
+        if (trace_events_enabled)
+            trace_events_write(trace_resolve, &sn);
+        arena_destroy(&sn.arena);
+        free(sn.names);
+    }
+    if (opts->heap_snapshot_file != NULL) {
+        heap_snapshot_write(opts->heap_snapshot_file);
+    }
+    if (opts->alloc_sites) {
+        alloc_sites_report(stderr);
+        if (alloc_site_names.names != NULL) {
+            arena_destroy(&alloc_site_names.arena);
+            free(alloc_site_names.names);
+        }
+    }
+    if (opts->stats) {
+        print_stats(&vm->stats, vm->heap, "instructions", true, stderr);
+    }
+    //the output buffer belongs to this thread, a VM on another thread would miss the flush at exit
+    out_flush();
+}
+
+uint8_t *align_address(uint8_t *ptr){
+    size_t diff = 8 - ((uintptr_t)ptr % 8);
+    if (diff != 8) {
+        ptr += diff;
+    }
+    return ptr;
+}
+
+//size of the instruction including its operands
+size_t instruction_len(Instruction ins) {
+    switch (ins) {
+        case DROP:
+        case ARRAY:
+        case RETURN:
+            return 1;
+        case CONSTANT:
+        case OBJECT:
+        case GET_FIELD:
+        case SET_FIELD:
+        case SET_LOCAL:
+        case GET_LOCAL:
+        case SET_GLOBAL:
+        case GET_GLOBAL:
+        case BRANCH:
+        case JUMP:
+            return 3;
+        case CALL_FUNCTION:
+            return 2;
+        case PRINT:
+        case CALL_METHOD:
+            return 4;
+        default:
+            runtime_error("Unknown instruction: 0x%02X\n", ins);
+    }
+}
+
+static bool is_constant(VM *vm, uint16_t index, ValueKind kind) {
+    return index < vm->const_pool_count && *vm->const_pool_map[index] == kind;
+}
+
+//checks the operands of the instructions of `fun` against the program, so the interpreter can rely on them
+//the instructions have to lie within the function, control can't run off its end and jumps land on instructions
+//`is_global` is indexed like the constants
+static bool verify_function(VM *vm, Bc_Func *fun, const bool *is_global) {
+    if (fun->len == 0)
+        return false;
+    //the instructions start at the set bits, jump targets are checked against them after the walk
+    uint8_t *starts = calloc((fun->len + 7) / 8, 1);
+    uint8_t *end = fun->bytecode + fun->len;
+    uint8_t *last = NULL;
+    for (uint8_t *ip = fun->bytecode; ip < end; ip += instruction_len(*ip)) {
+        if (*ip >= INSTRUCTION_CNT || instruction_len(*ip) > (size_t)(end - ip)) {
+            free(starts);
+            return false;
+        }
+        size_t offset = ip - fun->bytecode;
+        starts[offset / 8] |= 1 << (offset % 8);
+        last = ip;
+    }
+    bool valid = *last == RETURN || *last == JUMP;
+    for (uint8_t *ip = fun->bytecode; valid && ip < end; ip += instruction_len(*ip)) {
+        uint16_t index = deserialize_u16(ip + 1);
+        switch (*ip) {
+            case CONSTANT:
+                valid = index < vm->const_pool_count && *vm->const_pool_map[index] != VK_CLASS;
                 break;
-            }
             case PRINT:
-                exec_print();
-                break;
-            case ARRAY:
-                exec_array();
-                break;
-            case OBJECT:
-                exec_object();
-                break;
             case GET_FIELD:
-                exec_get_field();
-                break;
             case SET_FIELD:
-                exec_set_field();
-                break;
-            case CALL_METHOD:
-                exec_call_method();
+                valid = is_constant(vm, index, VK_STRING);
                 break;
-            case CALL_FUNCTION:
-                exec_call_function();
+            case OBJECT:
+                valid = is_constant(vm, index, VK_CLASS);
                 break;
-            case SET_LOCAL:
-                exec_set_local();
+            case CALL_METHOD:
+                //the receiver counts as an argument
+                valid = is_constant(vm, index, VK_STRING) && ip[3] >= 1;
                 break;
             case GET_LOCAL:
-                exec_get_local();
-                break;
-            case SET_GLOBAL:
-                exec_set_global();
+            case SET_LOCAL:
+                valid = index < fun->params + fun->locals;
                 break;
             case GET_GLOBAL:
-                exec_get_global();
+            case SET_GLOBAL:
+                valid = is_constant(vm, index, VK_STRING) && is_global[index];
                 break;
             case BRANCH:
-                exec_branch();
-                break;
-            case JUMP:
-                exec_jump();
-                break;
-            case RETURN:
-                exec_return();
+            case JUMP: {
+                //relative to the next instruction
+                ptrdiff_t target = ip + 3 - fun->bytecode + deserialize_i16(ip + 1);
+                valid = target >= 0 && target < fun->len && (starts[target / 8] & (1 << (target % 8)));
                 break;
+            }
             default:
-                printf("Unknown instruction: 0x%02X\n", *itp->ip);
-                exit(1);
+                break;
         }
-        print_op_stack(itp->operands, itp->op_sz);
     }
+    free(starts);
+    return valid;
 }
 
+//the functions and the constants referring to other constants, called once all constants are read
+void bc_verify(VM *vm) {
+    for (uint16_t i = 0; i < vm->globals.count; ++i) {
+        if (vm->globals.indexes[i] >= vm->const_pool_count)
+            runtime_error("Error: Invalid global\n");
+    }
+    //the globals looked up by the instructions in one step instead of by index_is_global
+    bool *is_global = calloc(vm->const_pool_count, sizeof(bool));
+    for (uint16_t i = 0; i < vm->globals.count; ++i)
+        is_global[vm->globals.indexes[i]] = true;
+    bool valid = true;
+    for (uint16_t i = 0; valid && i < vm->const_pool_count; ++i) {
+        if (*vm->const_pool_map[i] == VK_CLASS) {
+            Bc_Class *cls = (Bc_Class *)vm->const_pool_map[i];
+            for (uint16_t j = 0; valid && j < cls->count; ++j)
+                valid = is_constant(vm, cls->members[j], VK_STRING);
+        } else if (*vm->const_pool_map[i] == VK_FUNCTION) {
+            valid = verify_function(vm, (Bc_Func *)vm->const_pool_map[i], is_global);
+        }
+    }
+    free(is_global);
+    if (!valid)
+        runtime_error("Error: Invalid bytecode\n");
+}
 
-void bc_interpret() {
-    bc_init();
-    //we push the etry point function to the operand stack
-    //this function will be popped by the init_fun_call function
-    push_operand(itp->ip);
-    init_frame(0, false);
-    init_fun_call(0, false);
-    bytecode_loop();
-    bc_free();
+//walk the bytecode of all functions and split every string used as a print format
+//into literal runs, so exec_print doesn't have to parse the format on each execution
+void prescan_formats(VM *vm) {
+    vm->const_pool_formats = calloc(vm->const_pool_count, sizeof(Str *));
+    for (uint16_t i = 0; i < vm->const_pool_count; ++i) {
+        if (*vm->const_pool_map[i] != VK_FUNCTION)
+            continue;
+        Bc_Func *fun = (Bc_Func *)vm->const_pool_map[i];
+        for (uint8_t *ip = fun->bytecode; ip < fun->bytecode + fun->len; ip += instruction_len(*ip)) {
+            if (*ip != PRINT)
+                continue;
+            uint16_t index = deserialize_u16(ip + 1);
+            uint8_t num_args = ip[3];
+            if (index >= vm->const_pool_count || *vm->const_pool_map[index] != VK_STRING)
+                runtime_error("Error: Invalid print format\n");
+            if (vm->const_pool_formats[index] != NULL)
+                continue;
+            Bc_String *fmt = (Bc_String *)vm->const_pool_map[index];
+            //the literal runs and the unescaped characters share one allocation
+            Str *literals = malloc(sizeof(Str) * (num_args + 1) + fmt->len);
+            format_split((Str){fmt->value, fmt->len}, num_args, literals, (uint8_t *)(literals + num_args + 1));
+            vm->const_pool_formats[index] = literals;
+        }
+    }
 }
 
-uint8_t *align_address(uint8_t *ptr){
-    size_t diff = 8 - ((uintptr_t)ptr % 8);
-    if (diff != 8) {
-        ptr += diff;
+//unmaps the unused rest of the const pool and makes the constants read-only
+//the pool is never written after loading, so its pages stay shared between forked processes
+static void seal_const_pool(VM *vm) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t used = vm->const_pool_map[vm->const_pool_count] - (uint8_t *)vm->const_pool;
+    size_t sz = (used + page - 1) / page * page;
+    if (sz == 0)
+        sz = page;
+    munmap((uint8_t *)vm->const_pool + sz, vm->const_pool_sz - sz);
+    vm->const_pool_sz = sz;
+    mprotect(vm->const_pool, sz, PROT_READ);
+}
+
+//the fixed part of a constant of kind `tag`, which tells the size of the rest, 0 for an unknown kind
+static size_t constant_head_sz(uint8_t tag) {
+    switch (tag) {
+        case VK_INTEGER:
+            return sizeof(Integer);
+        case VK_BOOLEAN:
+            return sizeof(Boolean);
+        case VK_NULL:
+            return sizeof(Null);
+        case VK_STRING:
+            return sizeof(Bc_String);
+        case VK_FUNCTION:
+            return sizeof(Bc_Func);
+        case VK_CLASS:
+            return sizeof(Bc_Class);
+        default:
+            return 0;
     }
-    return ptr;
 }
 
-void deserialize(const char* filename) {
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        printf("Error: Cannot open file %s\n", filename);
-        exit(1);
+//bytes of the constant at `at` without the padding to the next one, its fixed part has to be read
+static size_t constant_sz(const uint8_t *at) {
+    switch (*at) {
+        case VK_STRING:
+            return sizeof(Bc_String) + (size_t)((const Bc_String *)at)->len;
+        case VK_FUNCTION:
+            return sizeof(Bc_Func) + (size_t)((const Bc_Func *)at)->len;
+        case VK_CLASS:
+            return sizeof(Bc_Class) + sizeof(uint16_t) * ((const Bc_Class *)at)->count;
+        default:
+            return constant_head_sz(*at);
+    }
+}
+
+bool bc_pool_valid(VM *vm, size_t pool_sz) {
+    uint8_t *end = (uint8_t *)vm->const_pool + pool_sz;
+    if (vm->const_pool_map[0] != vm->const_pool)
+        return false;
+    for (uint16_t i = 0; i < vm->const_pool_count; ++i) {
+        uint8_t *at = vm->const_pool_map[i];
+        if (at >= end)
+            return false;
+        size_t room = end - at;
+        size_t head = constant_head_sz(*at);
+        if (head == 0 || head > room || constant_sz(at) > room)
+            return false;
+        if (vm->const_pool_map[i + 1] != align_address(at + constant_sz(at)))
+            return false;
     }
+    return true;
+}
+
+Bc_Func *bc_instruction_function(VM *vm, uint8_t *ip) {
+    if (ip < vm->const_pool_map[0] || ip >= vm->const_pool_map[vm->const_pool_count])
+        return NULL;
+    uint8_t *at = vm->const_pool_map[constant_index(vm, ip)];
+    if (*at != VK_FUNCTION)
+        return NULL;
+    Bc_Func *fun = (Bc_Func *)at;
+    uint8_t *pos = fun->bytecode;
+    //bc_verify has checked that the instructions tile the function
+    while (pos < ip && pos < fun->bytecode + fun->len)
+        pos += instruction_len(*pos);
+    return pos == ip && pos < fun->bytecode + fun->len ? fun : NULL;
+}
+
+//checks that a constant of `sz` bytes starting at `at` fits into the const pool
+static bool pool_fits(VM *vm, uint8_t *at, size_t sz) {
+    return sz <= CONST_POOL_SZ - (size_t)(at - (uint8_t *)vm->const_pool);
+}
+
+void bc_load(VM *vm, FILE *file) {
+    //whatever is allocated is set right away, so bc_unload can clean up after an error
+    vm->const_pool = NULL;
+    vm->const_pool_map = NULL;
+    vm->const_pool_formats = NULL;
+    vm->globals.indexes = NULL;
 
     // Read and check the header
     uint8_t header[4];
-    fread(header, sizeof(uint8_t), 4, file);
-    if (header[0] != 0x46 || header[1] != 0x4D || header[2] != 0x4C || header[3] != 0x0A) {
-        printf("Error: Invalid header\n");
-        fclose(file);
-        exit(1);
+    if (fread(header, sizeof(uint8_t), 4, file) != 4
+        || header[0] != 0x46 || header[1] != 0x4D || header[2] != 0x4C || header[3] != 0x0A) {
+        runtime_error("Error: Invalid header\n");
     }
 
     // Read how many objs are in the const pool
-    fread(&const_pool_count, sizeof(uint16_t), 1, file);
+    fread(&vm->const_pool_count, sizeof(uint16_t), 1, file);
 
     // Allocate the const pool
     // The pool has constant size, we don't initially know how big the objs actually are
-    // If the pool is full we have to exit(1)
-    //TODO implement the checks on cp size
-    const_pool = malloc(CONST_POOL_SZ);
+    // Every constant is checked to fit before it is read
+    // Only the pages the constants are read into get committed, the rest is trimmed by seal_const_pool
+    vm->const_pool = mmap(NULL, CONST_POOL_SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (vm->const_pool == MAP_FAILED) {
+        vm->const_pool = NULL;
+        runtime_error("Error: Cannot allocate the constant pool\n");
+    }
+    vm->const_pool_sz = CONST_POOL_SZ;
 
     //we allocate + 1 because in the for-loop below we always assign the addr for i+1th element
     //this would be annoying to solve for the last elem
-    const_pool_map  = malloc(sizeof(void*) * (const_pool_count + 1));
+    vm->const_pool_map  = malloc(sizeof(void*) * (vm->const_pool_count + 1));
 
     //the first obj start at the beginning of the const_pool
-    const_pool_map[0] = const_pool;
+    vm->const_pool_map[0] = vm->const_pool;
     //tmp array for deserialization
     uint8_t tmp_data[4];
     // Read the constant pool objects and fill the const_pool & const_pool_map array
     uint8_t tag;
-    for (uint16_t i = 0; i < const_pool_count; ++i) {
-        fread(&tag, sizeof(uint8_t), 1, file);
+    for (uint16_t i = 0; i < vm->const_pool_count; ++i) {
+        if (fread(&tag, sizeof(uint8_t), 1, file) != 1)
+            runtime_error("Error: Unexpected end of the bytecode\n");
+        //the largest fixed part of a constant, the variable parts are checked separately
+        if (!pool_fits(vm, vm->const_pool_map[i], sizeof(Bc_Func) + 8))
+            runtime_error("Error: The constant pool is larger than %d bytes\n", CONST_POOL_SZ);
 
         switch (tag) {
             case VK_INTEGER: {
-                Integer *integer = (Integer  *)const_pool_map[i];
+                Integer *integer = (Integer  *)vm->const_pool_map[i];
                 integer->kind = tag;
                 fread(&tmp_data, sizeof(int32_t), 1, file);
                 integer->val = (tmp_data[0]<<0) | (tmp_data[1]<<8) | (tmp_data[2]<<16) | ((uint32_t)tmp_data[3]<<24);
                 //we use ValueKind and not uint8_t as tag, thus we don't have jsut sizeof(Integer)
-                const_pool_map[i + 1] = align_address(const_pool_map[i] + sizeof(Integer));
+                vm->const_pool_map[i + 1] = align_address(vm->const_pool_map[i] + constant_sz(vm->const_pool_map[i]));
                 break;
             }
             case VK_BOOLEAN: {
-                Boolean *boolean = (Boolean  *)const_pool_map[i];
+                Boolean *boolean = (Boolean  *)vm->const_pool_map[i];
                 boolean->kind = tag;
                 fread(&boolean->val, sizeof(uint8_t), 1, file);
-                const_pool_map[i + 1] = align_address(const_pool_map[i] + sizeof(Boolean));
+                vm->const_pool_map[i + 1] = align_address(vm->const_pool_map[i] + constant_sz(vm->const_pool_map[i]));
                 break;
             }
             case VK_NULL: {
-                Null *null = (Null  *)const_pool_map[i];
+                Null *null = (Null  *)vm->const_pool_map[i];
                 null->kind = tag;
-                const_pool_map[i + 1] = align_address(const_pool_map[i] + sizeof(Null));
+                vm->const_pool_map[i + 1] = align_address(vm->const_pool_map[i] + constant_sz(vm->const_pool_map[i]));
                 break;
             }
             case VK_STRING: {
-                Bc_String *string = (Bc_String  *)const_pool_map[i];
+                Bc_String *string = (Bc_String  *)vm->const_pool_map[i];
                 string->kind = tag;
                 fread(&string->len, sizeof(uint32_t), 1, file);
+                if (!pool_fits(vm, vm->const_pool_map[i], constant_sz(vm->const_pool_map[i]) + 8))
+                    runtime_error("Error: The constant pool is larger than %d bytes\n", CONST_POOL_SZ);
                 fread(string->value, sizeof(char), string->len, file);
                 string->value[string->len] = '\0';
-                const_pool_map[i + 1] = align_address(const_pool_map[i] + sizeof(Bc_String) + string->len);
+                vm->const_pool_map[i + 1] = align_address(vm->const_pool_map[i] + constant_sz(vm->const_pool_map[i]));
                 break;
             }
             case VK_FUNCTION: {
-                Bc_Func *function = (Bc_Func  *)const_pool_map[i];
+                Bc_Func *function = (Bc_Func  *)vm->const_pool_map[i];
                 function->kind = tag;
                 fread(&function->params, sizeof(uint8_t), 1, file);
                 fread(&tmp_data, sizeof(uint16_t), 1, file);
                 function->locals = (tmp_data[0]<<0) | (tmp_data[1]<<8);
                 fread(&tmp_data, sizeof(uint32_t), 1, file);
-                function->len = (tmp_data[0]<<0) | (tmp_data[1]<<8) | (tmp_data[2]<<16) | (tmp_data[3]<<24);
+                function->len = (tmp_data[0]<<0) | (tmp_data[1]<<8) | (tmp_data[2]<<16) | ((uint32_t)tmp_data[3]<<24);
+                if (!pool_fits(vm, vm->const_pool_map[i], constant_sz(vm->const_pool_map[i]) + 8))
+                    runtime_error("Error: The constant pool is larger than %d bytes\n", CONST_POOL_SZ);
                 //we don't have a special deserialization for bytecode, bytecode is deserialized upon execution
                 fread(function->bytecode, sizeof(uint8_t), function->len, file);
-                const_pool_map[i + 1] = align_address(const_pool_map[i] + sizeof(Bc_Func) + function->len);
+                vm->const_pool_map[i + 1] = align_address(vm->const_pool_map[i] + constant_sz(vm->const_pool_map[i]));
                 break;
             }
             case VK_CLASS: {
-                Bc_Class *class = (Bc_Class *)const_pool_map[i];
+                Bc_Class *class = (Bc_Class *)vm->const_pool_map[i];
                 class->kind = tag;
                 fread(&tmp_data, sizeof(uint16_t), 1, file);
                 class->count = (tmp_data[0]<<0) | (tmp_data[1]<<8);
+                if (!pool_fits(vm, vm->const_pool_map[i], constant_sz(vm->const_pool_map[i]) + 8))
+                    runtime_error("Error: The constant pool is larger than %d bytes\n", CONST_POOL_SZ);
                 for (uint16_t j = 0; j < class->count; ++j) {
                     fread(&tmp_data, sizeof(uint16_t), 1, file);
                     class->members[j] = (tmp_data[0]<<0) | (tmp_data[1]<<8);
                 }
-                const_pool_map[i + 1] = align_address(const_pool_map[i] + sizeof(Bc_Class) + sizeof(uint16_t) * class->count);
+                vm->const_pool_map[i + 1] = align_address(vm->const_pool_map[i] + constant_sz(vm->const_pool_map[i]));
                 break;
             }
             default: {
-                printf("Error: Invalid kind\n");
-                fclose(file);
-                exit(1);
+                runtime_error("Error: Invalid kind\n");
             }
         }
     }
 
     // Read the globals
     fread(&tmp_data, sizeof(uint16_t), 1, file);
-    globals.count = (tmp_data[0]<<0) | (tmp_data[1]<<8);
-    globals.indexes = malloc(sizeof(uint16_t) * globals.count);
-    fread(globals.indexes, sizeof(uint16_t), globals.count, file);
-    uint8_t *tmp_i = (uint8_t *)globals.indexes;
-    for (uint16_t i = 0; i < globals.count; i += 1) {
-        globals.indexes[i] = (tmp_i[2*i]<<0) | (tmp_i[2*i + 1]<<8);
+    vm->globals.count = (tmp_data[0]<<0) | (tmp_data[1]<<8);
+    vm->globals.indexes = malloc(sizeof(uint16_t) * vm->globals.count);
+    fread(vm->globals.indexes, sizeof(uint16_t), vm->globals.count, file);
+    uint8_t *tmp_i = (uint8_t *)vm->globals.indexes;
+    for (uint16_t i = 0; i < vm->globals.count; i += 1) {
+        vm->globals.indexes[i] = (tmp_i[2*i]<<0) | (tmp_i[2*i + 1]<<8);
     }
 
     // Read the entry point
-    fread(&tmp_data, sizeof(uint16_t), 1, file);
-    entry_point = (tmp_data[0]<<0) | (tmp_data[1]<<8);
-    assert(entry_point < const_pool_count);
+    if (fread(&tmp_data, sizeof(uint16_t), 1, file) != 1)
+        runtime_error("Error: Unexpected end of the bytecode\n");
+    vm->entry_point = (tmp_data[0]<<0) | (tmp_data[1]<<8);
+    if (vm->entry_point >= vm->const_pool_count || *vm->const_pool_map[vm->entry_point] != VK_FUNCTION) {
+        runtime_error("Error: Invalid entry point\n");
+    }
+
+    bc_verify(vm);
+    prescan_formats(vm);
+    seal_const_pool(vm);
+}
 
+void deserialize(VM *vm, const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        runtime_error("Error: Cannot open file %s\n", filename);
+    }
+    bc_load(vm, file);
     // Cleanup
     fclose(file);
 }
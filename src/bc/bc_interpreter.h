@@ -9,16 +9,155 @@
 #include <stdlib.h>
 
 #include "../ast/ast_interpreter.h"
+#include "../stats.h"
+#include "../budget.h"
 
 #define CONST_POOL_SZ (1024 * 1024 * 256)
 
-extern void *const_pool;
-extern uint8_t **const_pool_map;
+//we can have max 1024 * 16 ptrs to the heap
+#define MAX_OPERANDS (1024 * 16)
+#define MAX_FRAMES (1024 * 16)
 
-void deserialize(const char* filename);
+typedef struct {
+    uint8_t *ret_addr;
+    //ptrs to the heap
+    uint8_t **locals;
+    size_t locals_sz;
+} Frame;
 
-void bc_interpret();
+//an isolate: a loaded program with the interpreter running it and its heap
+//all the runtime state lives here, so VMs running on different threads share nothing
+//the process-wide tools (profilers, trace events, heap snapshots) observe one VM at a time
+typedef struct {
+    //the program, filled by deserialize
+    //the const pool is read-only once loaded
+    void *const_pool;
+    //bytes mapped for the const pool by bc_load
+    size_t const_pool_sz;
+    uint8_t **const_pool_map;
+    //print formats split into literal runs, indexed the same way as const_pool_map
+    //NULL for constants which are never used as a print format
+    Str **const_pool_formats;
+    //number of constants in the const pool
+    uint16_t const_pool_count;
+    Bc_Globals globals;
+    uint16_t entry_point;
+    //the snapshot image the const pool lies in, NULL when the program was read by bc_load
+    void *image;
+    size_t image_sz;
 
-void bc_init();
+    //the interpreter, set up by bc_init
+    //instruction pointer
+    uint8_t *ip;
+    Frame *frames;
+    size_t frames_sz;
+    //operands stack
+    //ptrs to the heap
+    Value *operands;
+    size_t op_sz;
+    //its fuel is decremented at every safepoint (backedge or call), running out checks the limits
+    //and refills it or suspends the VM, bc_init and bc_snapshot_load start it without limits
+    Budget budget;
+    //set by bc_resume, running out of the slice suspends the VM
+    bool preemptible;
+    //safepoints left in the slice given to bc_resume
+    uint32_t slice_left;
+    //the loops run while frames_sz > stop_depth, suspending the VM sets it to SIZE_MAX
+    size_t stop_depth;
+    Heap *heap;
+    //the heap belongs to a scheduler which set it before bc_init, bc_init and bc_free leave it alone
+    bool heap_shared;
+    //max size of the heap in bytes, HEAP_DEFAULT_LIMIT when 0
+    size_t heap_limit;
+    Value global_null;
+    //value of the global `snapshot` until the program assigns it, calling it marks the snapshot point
+    //NULL when the program has no such global
+    Value snapshot_mark;
+    //BcOptions.image_file of the run
+    const char *image_file;
+    bool snapshot_taken;
+    Stats stats;
+} VM;
 
-void bc_free();
+//reads the program from `file` into the VM
+//malformed bytecode is a runtime_error, bc_unload frees what was loaded until then
+void bc_load(VM *vm, FILE *file);
+
+//bc_load from the file `filename`
+void deserialize(VM *vm, const char* filename);
+
+typedef struct {
+    //print every executed instruction and the operand stack
+    //only available when built with FML_TRACE, see meson_options.txt
+    bool trace;
+    //count executions and cycles per instruction, opcode pair and function
+    //the report goes to stderr at exit, the CSV to profile_ops_file if set
+    bool profile_ops;
+    const char *profile_ops_file;
+    //write folded stacks of the sampling profiler here, NULL when not sampling
+    const char *sample_file;
+    //print runtime statistics to stderr at exit
+    bool stats;
+    //count the execute phase with the hardware counters, see perf_counters.h
+    bool perf_counters;
+    //attribute allocations to instructions and report them at exit, see heap/alloc_sites.h
+    bool alloc_sites;
+    //write a heap snapshot here at exit, NULL when not snapshotting, see heap/heap_snapshot.h
+    const char *heap_snapshot_file;
+    //write an image here when the program calls snapshot() and end the run there
+    //NULL runs through the mark, see bc_snapshot.h
+    const char *image_file;
+} BcOptions;
+
+//runs the loaded program, the VM has to be set up by bc_init or restored by bc_snapshot_load before
+//a restored VM resumes after the snapshot() call, the heap and the stats are kept until bc_free
+void bc_interpret(VM *vm, BcOptions *opts);
+
+//sets up the interpreter and the heap for the loaded program
+void bc_init(VM *vm);
+
+//green threads: bc_start pushes the call of the entry point on a VM set up by bc_init,
+//then every bc_resume runs it until it ends (true) or until `fuel` safepoints have passed
+//the tools of BcOptions are not available this way
+void bc_start(VM *vm);
+
+bool bc_resume(VM *vm, uint32_t fuel);
+
+//frees the interpreter, the heap and the program
+void bc_free(VM *vm);
+
+//frees what deserialize allocated, called by bc_free
+void bc_unload(VM *vm);
+
+//HeapRoots of the VM, `ctx` is the VM
+void bc_roots(void *ctx, HeapVisit visit, void *visit_ctx);
+
+//checks the globals, the class members and the operands of every instruction, part of loading a program
+//a program which passes can't make the interpreter index outside of the constants, locals or its code
+void bc_verify(VM *vm);
+
+//checks that the constants of const_pool_map lie in the first `pool_sz` bytes of the pool one after
+//another, each with the size its fixed part gives, as bc_load lays them out; bc_verify relies on it
+//for a pool bc_load didn't read itself
+bool bc_pool_valid(VM *vm, size_t pool_sz);
+
+//the function `ip` is the start of an instruction of, NULL when it isn't one
+//the program has to pass bc_verify before
+Bc_Func *bc_instruction_function(VM *vm, uint8_t *ip);
+
+//splits the strings used as print formats, part of loading a program
+void prescan_formats(VM *vm);
+
+//internals, only exposed for the microbenchmarks in benchmarks/microbench.c
+
+void push_operand(VM *vm, Value value);
+
+Value pop_operand(VM *vm);
+
+void init_frame(VM *vm, uint8_t argc, bool is_method);
+
+void init_fun_call(VM *vm, uint8_t argc, bool is_method);
+
+void bc_method_call(VM *vm, Value obj, Str name, int argc);
+
+Field *get_field(VM *vm, Object *obj, Bc_String *name);
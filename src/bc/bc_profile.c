@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "bc_profile.h"
+#include "../utils.h"
+
+//how many rows of each section are printed in the text report, the CSV gets everything
+#define TEXT_REPORT_ROWS 24
+
+typedef struct {
+    char name[64];
+    uint64_t count;
+    uint64_t cycles;
+    uint64_t calls;
+} ReportRow;
+
+void profile_init(OpProfile *prof, uint16_t const_cnt) {
+    memset(prof->ops, 0, sizeof(prof->ops));
+    memset(prof->pairs, 0, sizeof(prof->pairs));
+    prof->funcs = calloc(const_cnt, sizeof(ProfileCounter));
+    prof->calls = calloc(const_cnt, sizeof(uint64_t));
+    prof->const_cnt = const_cnt;
+}
+
+void profile_free(OpProfile *prof) {
+    free(prof->funcs);
+    free(prof->calls);
+}
+
+static int row_cmp(const void *a, const void *b) {
+    const ReportRow *row1 = a;
+    const ReportRow *row2 = b;
+    if (row1->cycles != row2->cycles)
+        return row1->cycles < row2->cycles ? 1 : -1;
+    return row1->count < row2->count ? 1 : row1->count > row2->count ? -1 : 0;
+}
+
+static void report_section(const char *section, ReportRow *rows, size_t cnt, bool with_calls, uint64_t total_cycles,
+                           FILE *text, FILE *csv) {
+    qsort(rows, cnt, sizeof(ReportRow), row_cmp);
+    if (text) {
+        fprintf(text, "\n== %s ==\n", section);
+        fprintf(text, "%-32s %14s %16s %10s %7s", "name", "count", "cycles", "cyc/op", "%");
+        if (with_calls)
+            fprintf(text, " %12s", "calls");
+        fprintf(text, "\n");
+        for (size_t i = 0; i < cnt && i < TEXT_REPORT_ROWS; i++) {
+            fprintf(text, "%-32s %14" PRIu64 " %16" PRIu64 " %10.1f %6.2f%%", rows[i].name, rows[i].count, rows[i].cycles,
+                    (double)rows[i].cycles / rows[i].count, 100.0 * rows[i].cycles / total_cycles);
+            if (with_calls)
+                fprintf(text, " %12" PRIu64, rows[i].calls);
+            fprintf(text, "\n");
+        }
+    }
+    if (csv) {
+        for (size_t i = 0; i < cnt; i++) {
+            fprintf(csv, "%s,%s,%" PRIu64 ",%" PRIu64 ",", section, rows[i].name, rows[i].count, rows[i].cycles);
+            if (with_calls)
+                fprintf(csv, "%" PRIu64, rows[i].calls);
+            fprintf(csv, "\n");
+        }
+    }
+}
+
+void profile_report(OpProfile *prof, Str *func_names, FILE *text, FILE *csv) {
+    size_t max_rows = INSTRUCTION_CNT * INSTRUCTION_CNT > prof->const_cnt ? INSTRUCTION_CNT * INSTRUCTION_CNT : prof->const_cnt;
+    ReportRow *rows = calloc(max_rows, sizeof(ReportRow));
+    size_t cnt;
+    uint64_t total_cycles = 0;
+    uint64_t total_count = 0;
+    for (int i = 0; i < INSTRUCTION_CNT; i++) {
+        total_cycles += prof->ops[i].cycles;
+        total_count += prof->ops[i].count;
+    }
+    //avoid division by zero in the percentages
+    if (total_cycles == 0)
+        total_cycles = 1;
+
+    if (text)
+        fprintf(text, "\n== op profile: %" PRIu64 " instructions, %" PRIu64 " cycles ==\n", total_count, total_cycles);
+    if (csv)
+        fprintf(csv, "section,name,count,cycles,calls\n");
+
+    cnt = 0;
+    for (int i = 0; i < INSTRUCTION_CNT; i++) {
+        if (prof->ops[i].count == 0)
+            continue;
+        snprintf(rows[cnt].name, sizeof(rows[cnt].name), "%s", instruction_name(i));
+        rows[cnt].count = prof->ops[i].count;
+        rows[cnt].cycles = prof->ops[i].cycles;
+        cnt++;
+    }
+    report_section("instructions", rows, cnt, false, total_cycles, text, csv);
+
+    cnt = 0;
+    for (int i = 0; i < INSTRUCTION_CNT; i++) {
+        for (int j = 0; j < INSTRUCTION_CNT; j++) {
+            if (prof->pairs[i][j].count == 0)
+                continue;
+            snprintf(rows[cnt].name, sizeof(rows[cnt].name), "%s->%s", instruction_name(i), instruction_name(j));
+            rows[cnt].count = prof->pairs[i][j].count;
+            rows[cnt].cycles = prof->pairs[i][j].cycles;
+            cnt++;
+        }
+    }
+    report_section("pairs", rows, cnt, false, total_cycles, text, csv);
+
+    cnt = 0;
+    for (uint16_t i = 0; i < prof->const_cnt; i++) {
+        if (prof->calls[i] == 0)
+            continue;
+        if (func_names[i].len > 0)
+            snprintf(rows[cnt].name, sizeof(rows[cnt].name), "%.*s#%u", (int)func_names[i].len, func_names[i].str, (unsigned)i);
+        else
+            snprintf(rows[cnt].name, sizeof(rows[cnt].name), "fun#%u", (unsigned)i);
+        rows[cnt].count = prof->funcs[i].count;
+        rows[cnt].cycles = prof->funcs[i].cycles;
+        rows[cnt].calls = prof->calls[i];
+        cnt++;
+    }
+    report_section("functions", rows, cnt, true, total_cycles, text, csv);
+
+    free(rows);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../types.h"
+#include "../tsc.h"
+
+//per-opcode profile collected by bytecode_loop_profiled (--profile-ops)
+
+typedef struct {
+    uint64_t count;
+    uint64_t cycles;
+} ProfileCounter;
+
+typedef struct {
+    ProfileCounter ops[INSTRUCTION_CNT];
+    //indexed [previous][current], the cycles are those of both instructions
+    ProfileCounter pairs[INSTRUCTION_CNT][INSTRUCTION_CNT];
+    //instructions executed in the function itself, indexed by the const pool index of the Bc_Func
+    ProfileCounter *funcs;
+    uint64_t *calls;
+    uint16_t const_cnt;
+} OpProfile;
+
+void profile_init(OpProfile *prof, uint16_t const_cnt);
+
+void profile_free(OpProfile *prof);
+
+//writes the counters sorted by cycles, `text` gets a human readable table and `csv` the full data
+//`func_names` are indexed by the const pool index, functions with empty names are reported as fun#<index>
+void profile_report(OpProfile *prof, Str *func_names, FILE *text, FILE *csv);
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bc_snapshot.h"
+#include "../heap/heap.h"
+#include "../heap/gc_concurrent.h"
+#include "../trace_events.h"
+#include "../utils.h"
+
+// Layout of the image, all offsets in bytes from its start:
+//
+//     header        IMAGE_HEADER_WORDS words, see the IMAGE_* indexes
+//     const pool    at pool_offset, a multiple of the page size
+//     data          at data_offset, data_words words:
+//                   const_pool_count, entry_point, const_pool_count + 1 const pool offsets,
+//                   globals.count, the global indexes,
+//                   cell count, the cells,
+//                   global_null, snapshot_mark, the values of the globals,
+//                   ip, frames_sz, the frames, op_sz, the operands
+//
+// A cell is its kind followed by
+//     VK_INTEGER, VK_BOOLEAN: the value
+//     VK_NULL: nothing
+//     VK_ARRAY: size, size values
+//     VK_OBJECT: field count, parent, per field the name and its length and the value
+// and a frame is its return address, locals_sz and the locals.
+
+#define IMAGE_MAGIC 0x0a50414e534c4d46ULL // "FMLSNAP\n"
+#define IMAGE_VERSION 1
+
+enum {
+    IMAGE_MAGIC_WORD,
+    IMAGE_VERSION_WORD,
+    IMAGE_POOL_OFFSET,
+    IMAGE_POOL_SIZE,
+    IMAGE_DATA_OFFSET,
+    IMAGE_DATA_WORDS,
+    IMAGE_HEADER_WORDS,
+};
+
+//a relocatable value is an index or an offset shifted left by 2 with the tag in the low bits, NULL is 0
+#define REF_CELL 1
+#define REF_POOL 2
+#define REF_TAG_MASK 3
+
+typedef struct {
+    VM *vm;
+    FILE *f;
+    size_t words;
+    //the live cells in address order, a cell is referred to by its index here
+    Value *cells;
+    size_t cells_cnt;
+    size_t pool_size;
+} SnapshotWriter;
+
+static void write_word(SnapshotWriter *w, uint64_t word) {
+    fwrite(&word, sizeof(word), 1, w->f);
+    w->words++;
+}
+
+static void write_padding(FILE *f, size_t alignment) {
+    long pos = ftell(f);
+    while (pos % alignment != 0) {
+        fputc(0, f);
+        pos++;
+    }
+}
+
+static uint64_t pool_ref(SnapshotWriter *w, const uint8_t *ptr) {
+    size_t offset = ptr - (uint8_t *)w->vm->const_pool;
+    if (ptr < (uint8_t *)w->vm->const_pool || offset > w->pool_size)
+        runtime_error("Error: Cannot snapshot a pointer outside of the heap and the const pool\n");
+    return ((uint64_t)offset << 2) | REF_POOL;
+}
+
+static uint64_t value_ref(SnapshotWriter *w, Value val) {
+    if (val == NULL)
+        return 0;
+    if (!heap_contains(w->vm->heap, val))
+        return pool_ref(w, val);
+    //the cells are sorted by address
+    size_t lo = 0;
+    size_t hi = w->cells_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (w->cells[mid] < val)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    assert(lo < w->cells_cnt && w->cells[lo] == val);
+    return ((uint64_t)lo << 2) | REF_CELL;
+}
+
+static void write_cell(SnapshotWriter *w, Value val) {
+    write_word(w, *val);
+    switch (*val) {
+        case VK_INTEGER:
+            write_word(w, (uint32_t)((Integer *)val)->val);
+            break;
+        case VK_BOOLEAN:
+            write_word(w, ((Boolean *)val)->val);
+            break;
+        case VK_NULL:
+            break;
+        case VK_ARRAY: {
+            Array *array = (Array *)val;
+            write_word(w, array->size);
+            for (size_t i = 0; i < array->size; i++) {
+                write_word(w, value_ref(w, array->val[i]));
+            }
+            break;
+        }
+        case VK_OBJECT: {
+            Object *obj = (Object *)val;
+            write_word(w, obj->field_cnt);
+            write_word(w, value_ref(w, obj->parent));
+            for (size_t i = 0; i < obj->field_cnt; i++) {
+                write_word(w, pool_ref(w, obj->val[i].name.str));
+                write_word(w, obj->val[i].name.len);
+                write_word(w, value_ref(w, obj->val[i].val));
+            }
+            break;
+        }
+        default:
+            runtime_error("Error: Cannot snapshot a %s on the heap\n", value_kind_name(*val));
+    }
+}
+
+//collects the cells reachable from the roots of the VM in address order
+static void collect_cells(SnapshotWriter *w) {
+    Heap *heap = w->vm->heap;
+    gc_cycle_finish(heap);
+    w->cells_cnt = heap_mark(heap, bc_roots, w->vm);
+    w->cells = malloc(sizeof(Value) * (w->cells_cnt + 1));
+    size_t i = 0;
+    for (Value val = heap_first(heap); val != NULL; val = heap_next(heap, val)) {
+        if (cell_header(val)->flags & CELL_MARKED)
+            w->cells[i++] = val;
+    }
+    assert(i == w->cells_cnt);
+    heap_clear_marks(heap);
+}
+
+void bc_snapshot_write(VM *vm, const char *filename) {
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL)
+        runtime_error("Error: Cannot open file %s\n", filename);
+    SnapshotWriter w = { .vm = vm, .f = f };
+    w.pool_size = vm->const_pool_map[vm->const_pool_count] - (uint8_t *)vm->const_pool;
+    collect_cells(&w);
+
+    //the header is rewritten once the size of the data is known
+    uint64_t header[IMAGE_HEADER_WORDS] = { 0 };
+    fwrite(header, sizeof(header), 1, f);
+    size_t page = sysconf(_SC_PAGESIZE);
+    write_padding(f, page);
+    header[IMAGE_POOL_OFFSET] = ftell(f);
+    header[IMAGE_POOL_SIZE] = w.pool_size;
+    fwrite(vm->const_pool, 1, w.pool_size, f);
+    write_padding(f, sizeof(uint64_t));
+    header[IMAGE_DATA_OFFSET] = ftell(f);
+
+    write_word(&w, vm->const_pool_count);
+    write_word(&w, vm->entry_point);
+    for (int i = 0; i <= vm->const_pool_count; i++) {
+        write_word(&w, pool_ref(&w, vm->const_pool_map[i]));
+    }
+    write_word(&w, vm->globals.count);
+    for (int i = 0; i < vm->globals.count; i++) {
+        write_word(&w, vm->globals.indexes[i]);
+    }
+
+    write_word(&w, w.cells_cnt);
+    for (size_t i = 0; i < w.cells_cnt; i++) {
+        write_cell(&w, w.cells[i]);
+    }
+
+    write_word(&w, value_ref(&w, vm->global_null));
+    write_word(&w, value_ref(&w, vm->snapshot_mark));
+    for (int i = 0; i < vm->const_pool_count; i++) {
+        write_word(&w, value_ref(&w, vm->globals.values[i]));
+    }
+    write_word(&w, pool_ref(&w, vm->ip));
+    write_word(&w, vm->frames_sz);
+    for (size_t i = 0; i < vm->frames_sz; i++) {
+        Frame *frame = &vm->frames[i];
+        write_word(&w, pool_ref(&w, frame->ret_addr));
+        write_word(&w, frame->locals_sz);
+        for (size_t j = 0; j < frame->locals_sz; j++) {
+            write_word(&w, value_ref(&w, frame->locals[j]));
+        }
+    }
+    write_word(&w, vm->op_sz);
+    for (size_t i = 0; i < vm->op_sz; i++) {
+        write_word(&w, value_ref(&w, vm->operands[i]));
+    }
+
+    header[IMAGE_MAGIC_WORD] = IMAGE_MAGIC;
+    header[IMAGE_VERSION_WORD] = IMAGE_VERSION;
+    header[IMAGE_DATA_WORDS] = w.words;
+    fseek(f, 0, SEEK_SET);
+    fwrite(header, sizeof(header), 1, f);
+    free(w.cells);
+    bool failed = ferror(f);
+    if (fclose(f) != 0 || failed)
+        runtime_error("Error: Failed to write the snapshot %s\n", filename);
+}
+
+typedef struct {
+    VM *vm;
+    const uint64_t *at;
+    const uint64_t *end;
+    size_t pool_size;
+    Value *cells;
+    size_t cells_cnt;
+} SnapshotReader;
+
+static uint64_t read_word(SnapshotReader *r) {
+    if (r->at == r->end)
+        runtime_error("Error: Truncated snapshot\n");
+    return *r->at++;
+}
+
+//a count of things of at least one word each, which has to fit into the rest of the image
+static size_t read_count(SnapshotReader *r, size_t max) {
+    uint64_t cnt = read_word(r);
+    if (cnt > max || cnt > (size_t)(r->end - r->at))
+        runtime_error("Error: Invalid snapshot\n");
+    return cnt;
+}
+
+//a pointer into the const pool to `sz` bytes
+static uint8_t *read_pool_ref(SnapshotReader *r, size_t sz) {
+    uint64_t ref = read_word(r);
+    uint64_t offset = ref >> 2;
+    if ((ref & REF_TAG_MASK) != REF_POOL || offset > r->pool_size || sz > r->pool_size - offset)
+        runtime_error("Error: Invalid snapshot\n");
+    return (uint8_t *)r->vm->const_pool + offset;
+}
+
+static Value value_at(SnapshotReader *r, uint64_t ref) {
+    uint64_t n = ref >> 2;
+    switch (ref & REF_TAG_MASK) {
+        case 0:
+            if (ref == 0)
+                return NULL;
+            break;
+        case REF_CELL:
+            if (n < r->cells_cnt)
+                return r->cells[n];
+            break;
+        case REF_POOL:
+            //the smallest constant is one byte
+            if (n < r->pool_size)
+                return (uint8_t *)r->vm->const_pool + n;
+            break;
+    }
+    runtime_error("Error: Invalid snapshot\n");
+}
+
+static Value read_value(SnapshotReader *r) {
+    return value_at(r, read_word(r));
+}
+
+//allocates the cell, the values in arrays and objects are left as refs until relocate_cell
+static Value read_cell(SnapshotReader *r) {
+    Heap *heap = r->vm->heap;
+    switch (read_word(r)) {
+        case VK_INTEGER:
+            return construct_integer((i32)read_word(r), heap);
+        case VK_BOOLEAN:
+            return construct_boolean(read_word(r) != 0, heap);
+        case VK_NULL:
+            return construct_null(heap);
+        case VK_ARRAY: {
+            size_t size = read_count(r, INT32_MAX);
+            Array *array = (Array *)construct_array(size, heap);
+            for (size_t i = 0; i < size; i++) {
+                array->val[i] = (Value)(uintptr_t)read_word(r);
+            }
+            return (Value)array;
+        }
+        case VK_OBJECT: {
+            size_t field_cnt = read_count(r, INT32_MAX);
+            Object *obj = (Object *)construct_object(field_cnt, NULL, heap);
+            obj->parent = (Value)(uintptr_t)read_word(r);
+            for (size_t i = 0; i < field_cnt; i++) {
+                uint8_t *name = read_pool_ref(r, 0);
+                uint64_t len = read_word(r);
+                if (len > (size_t)((uint8_t *)r->vm->const_pool + r->pool_size - name))
+                    runtime_error("Error: Invalid snapshot\n");
+                obj->val[i].name = (Str){ name, len };
+                obj->val[i].val = (Value)(uintptr_t)read_word(r);
+            }
+            return (Value)obj;
+        }
+        default:
+            runtime_error("Error: Invalid snapshot\n");
+    }
+}
+
+static void relocate_slot(void *ctx, Value *slot) {
+    *slot = value_at(ctx, (uint64_t)(uintptr_t)*slot);
+}
+
+static void restore(VM *vm, size_t image_sz) {
+    const uint64_t *header = vm->image;
+    if (image_sz < sizeof(uint64_t) * IMAGE_HEADER_WORDS || header[IMAGE_MAGIC_WORD] != IMAGE_MAGIC)
+        runtime_error("Error: Invalid snapshot\n");
+    if (header[IMAGE_VERSION_WORD] != IMAGE_VERSION)
+        runtime_error("Error: Snapshot version %llu is not supported\n", (unsigned long long)header[IMAGE_VERSION_WORD]);
+    uint64_t pool_offset = header[IMAGE_POOL_OFFSET];
+    uint64_t pool_size = header[IMAGE_POOL_SIZE];
+    uint64_t data_offset = header[IMAGE_DATA_OFFSET];
+    uint64_t data_words = header[IMAGE_DATA_WORDS];
+    if (pool_offset % sizeof(uint64_t) != 0 || pool_offset > image_sz || pool_size > image_sz - pool_offset
+        || data_offset % sizeof(uint64_t) != 0 || data_offset > image_sz
+        || data_words > (image_sz - data_offset) / sizeof(uint64_t))
+        runtime_error("Error: Invalid snapshot\n");
+
+    //the program, what bc_load does
+    vm->const_pool = (uint8_t *)vm->image + pool_offset;
+    SnapshotReader r = {
+        .vm = vm,
+        .at = (const uint64_t *)((uint8_t *)vm->image + data_offset),
+        .pool_size = pool_size,
+    };
+    r.end = r.at + data_words;
+    vm->const_pool_count = read_count(&r, UINT16_MAX);
+    vm->entry_point = read_word(&r);
+    vm->const_pool_map = malloc(sizeof(void *) * (vm->const_pool_count + 1));
+    for (int i = 0; i <= vm->const_pool_count; i++) {
+        vm->const_pool_map[i] = read_pool_ref(&r, 0);
+    }
+    //the sizes inside the constants are checked as bc_load checks them, before anything reads them
+    if (!bc_pool_valid(vm, pool_size))
+        runtime_error("Error: Invalid snapshot\n");
+    if (vm->entry_point >= vm->const_pool_count || *vm->const_pool_map[vm->entry_point] != VK_FUNCTION)
+        runtime_error("Error: Invalid entry point\n");
+    vm->globals.count = read_count(&r, UINT16_MAX);
+    vm->globals.indexes = malloc(sizeof(uint16_t) * vm->globals.count);
+    for (int i = 0; i < vm->globals.count; i++) {
+        vm->globals.indexes[i] = read_word(&r);
+        if (vm->globals.indexes[i] >= vm->const_pool_count)
+            runtime_error("Error: Invalid snapshot\n");
+    }
+    bc_verify(vm);
+    prescan_formats(vm);
+
+    //the interpreter, what bc_init does
+    vm->frames = malloc(sizeof(Frame) * MAX_FRAMES);
+    vm->frames_sz = 0;
+    vm->operands = malloc(sizeof(void *) * MAX_OPERANDS);
+    vm->op_sz = 0;
+    budget_init(&vm->budget, 0, 0);
+    vm->heap = malloc(sizeof(Heap));
+    heap_init(vm->heap, vm->heap_limit);
+    vm->stats = (Stats){ 0 };
+    trace_events_heap(vm->heap);
+
+    //the heap has no roots yet, so nothing is collected while the cells are half restored
+    r.cells_cnt = read_count(&r, SIZE_MAX);
+    r.cells = malloc(sizeof(Value) * (r.cells_cnt + 1));
+    for (size_t i = 0; i < r.cells_cnt; i++) {
+        r.cells[i] = read_cell(&r);
+    }
+    for (size_t i = 0; i < r.cells_cnt; i++) {
+        //a ref of 0 is NULL, which is just what heap_visit_children skips
+        heap_visit_children(r.cells[i], relocate_slot, &r);
+    }
+
+    vm->global_null = read_value(&r);
+    vm->snapshot_mark = read_value(&r);
+    vm->globals.values = malloc(sizeof(void *) * vm->const_pool_count);
+    for (int i = 0; i < vm->const_pool_count; i++) {
+        vm->globals.values[i] = read_value(&r);
+    }
+    vm->ip = read_pool_ref(&r, 1);
+    size_t frames_sz = read_count(&r, MAX_FRAMES);
+    for (size_t i = 0; i < frames_sz; i++) {
+        Frame *frame = &vm->frames[i];
+        frame->ret_addr = read_pool_ref(&r, 1);
+        frame->locals_sz = read_count(&r, UINT16_MAX + UINT8_MAX);
+        frame->locals = malloc(sizeof(Value) * (frame->locals_sz + 1));
+        vm->frames_sz++;
+        for (size_t j = 0; j < frame->locals_sz; j++) {
+            frame->locals[j] = read_value(&r);
+        }
+    }
+    vm->op_sz = read_count(&r, MAX_OPERANDS);
+    for (size_t i = 0; i < vm->op_sz; i++) {
+        vm->operands[i] = read_value(&r);
+    }
+    free(r.cells);
+    if (vm->frames_sz == 0 || vm->global_null == NULL || *vm->global_null != VK_NULL)
+        runtime_error("Error: Invalid snapshot\n");
+    //the entry frame returns to the entry point, which ends the run, the others into a function
+    //every frame has the locals of the function it runs, that is the one its callee returns into
+    if (vm->frames[0].ret_addr != vm->const_pool_map[vm->entry_point])
+        runtime_error("Error: Invalid snapshot\n");
+    for (size_t i = 0; i < vm->frames_sz; i++) {
+        uint8_t *ip = i + 1 < vm->frames_sz ? vm->frames[i + 1].ret_addr : vm->ip;
+        Bc_Func *fun = bc_instruction_function(vm, ip);
+        if (fun == NULL || vm->frames[i].locals_sz != (size_t)fun->params + fun->locals)
+            runtime_error("Error: Invalid snapshot\n");
+    }
+    heap_set_roots(vm->heap, bc_roots, vm);
+}
+
+void bc_snapshot_load(VM *vm, const char *filename) {
+    //whatever is allocated is set right away, so bc_free can clean up after an error
+    *vm = (VM){ .heap_limit = vm->heap_limit };
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        runtime_error("Error: Cannot open file %s\n", filename);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        runtime_error("Error: Invalid snapshot\n");
+    }
+    //the const pool is only read, its pages stay shared with the page cache
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        runtime_error("Error: Cannot map the snapshot %s\n", filename);
+    vm->image = image;
+    vm->image_sz = st.st_size;
+    restore(vm, st.st_size);
+}
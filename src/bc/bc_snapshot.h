@@ -0,0 +1,37 @@
+#pragma once
+
+#include "bc_interpreter.h"
+
+// Post-initialization snapshots (fml snapshot, fml run --from-snapshot).
+// Programs which build the same tables on every start mark the point where
+// the warm-up is done with a call of the global function snapshot():
+//
+//     let table = init_table();
+//     snapshot();
+//     ...
+//
+// In a normal run the call does nothing and returns null. With an image
+// file set the bytecode interpreter writes the whole VM to it at the call,
+// the constant pool, the globals, the heap and the frames and operands, and
+// ends the run there. Restoring the image resumes right after the call, as
+// if it had just returned. A program which defines a function named
+// snapshot calls that one instead.
+//
+// The image is made for mapping. The const pool lies on its own pages and is
+// used in place, the rest is a sequence of 64 bit words. The heap cells
+// reachable from the roots are stored in address order and every Value is
+// relocatable: a cell index for the heap, an offset for the const pool.
+// The cells are allocated in a fresh heap when the image is restored, so it
+// doesn't depend on the heap layout or the collector. The words are in the
+// byte order of the machine, an image is read by the fml it was written by.
+// A restored image is checked like loaded bytecode, the layout of the
+// constants, the operands of the instructions and the addresses the frames
+// resume at, so a corrupted one is refused instead of crashing.
+// The output printed before the mark is not part of the image.
+
+//writes the image of the VM stopped at the mark, a runtime_error when it can't
+void bc_snapshot_write(VM *vm, const char *filename);
+
+//maps the image and sets up the VM like bc_load and bc_init, bc_interpret resumes it
+//a runtime_error when the image is invalid, bc_free frees what was restored until then
+void bc_snapshot_load(VM *vm, const char *filename);
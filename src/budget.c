@@ -0,0 +1,38 @@
+#include <time.h>
+
+#include "budget.h"
+#include "utils.h"
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void budget_init(Budget *budget, uint64_t max_instructions, uint32_t timeout_ms) {
+    *budget = (Budget){
+        .max_instructions = max_instructions,
+        .timeout_ms = timeout_ms,
+        .deadline_ns = timeout_ms > 0 ? now_ns() + (uint64_t)timeout_ms * 1000000 : 0,
+    };
+    budget_refuel(budget, UINT32_MAX);
+}
+
+void budget_refuel(Budget *budget, uint32_t max) {
+    uint64_t fuel = max;
+    //runs out at the first safepoint over the limit, budget_charge has checked used <= max_instructions
+    if (budget->max_instructions > 0 && budget->max_instructions - budget->used < fuel - 1)
+        fuel = budget->max_instructions - budget->used + 1;
+    if (budget->deadline_ns > 0 && fuel > BUDGET_CLOCK_INTERVAL)
+        fuel = BUDGET_CLOCK_INTERVAL;
+    budget->fuel = budget->chunk = fuel;
+}
+
+void budget_charge(Budget *budget) {
+    budget->used += budget->chunk;
+    if (budget->max_instructions > 0 && budget->used > budget->max_instructions)
+        limit_exceeded("Error: The instruction limit of %llu was exceeded\n",
+                       (unsigned long long)budget->max_instructions);
+    if (budget->deadline_ns > 0 && now_ns() >= budget->deadline_ns)
+        limit_exceeded("Error: The time limit of %u ms was reached\n", budget->timeout_ms);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// Instruction and wall-clock limits of a run (--max-instructions,
+// --timeout-ms). Neither interpreter counts its instructions on the fast
+// path, the limits are checked at the safepoints only: the backward jumps
+// and calls of the bytecode interpreter, the loop iterations and calls of
+// the AST interpreter. Every long running program passes them all the time.
+// A safepoint decrements `fuel` and calls budget_charge when it runs out,
+// so the instruction limit counts safepoints and the clock is read once per
+// BUDGET_CLOCK_INTERVAL of them. A program may pass exactly
+// max_instructions safepoints, the next one ends the run with
+// limit_exceeded, as does a reached deadline.
+
+//safepoints between two reads of the clock when there is a timeout
+#define BUDGET_CLOCK_INTERVAL 4096
+
+typedef struct {
+    //safepoints left until budget_charge, decremented by the interpreter
+    uint32_t fuel;
+    //what fuel was set to by the last budget_refuel
+    uint32_t chunk;
+    //safepoints passed in the earlier chunks
+    uint64_t used;
+    //0 for none
+    uint64_t max_instructions;
+    uint32_t timeout_ms;
+    //CLOCK_MONOTONIC in ns, 0 for no timeout
+    uint64_t deadline_ns;
+} Budget;
+
+//starts the timeout, no limit when it is 0
+void budget_init(Budget *budget, uint64_t max_instructions, uint32_t timeout_ms);
+
+//gives the interpreter up to `max` safepoints of fuel, fewer when a limit has to be checked sooner
+void budget_refuel(Budget *budget, uint32_t max);
+
+//accounts the chunk of fuel used up and checks the limits, call it when fuel is 0
+void budget_charge(Budget *budget);
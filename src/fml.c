@@ -0,0 +1,521 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "fml.h"
+#include "parser.h"
+#include "arena.h"
+#include "output.h"
+#include "sampler.h"
+#include "stats.h"
+#include "perf_counters.h"
+#include "trace_events.h"
+#include "utils.h"
+#include "budget.h"
+#include "ast/ast_interpreter.h"
+#include "bc/bc_interpreter.h"
+#include "bc/bc_snapshot.h"
+#include "heap/alloc_sites.h"
+#include "heap/heap_snapshot.h"
+
+typedef enum {
+    PROGRAM_NONE,
+    PROGRAM_BYTECODE,
+    PROGRAM_SOURCE,
+} ProgramKind;
+
+struct FmlVm {
+    FmlOptions opts;
+    size_t heap_limit;
+    FmlWrite write;
+    void *write_ctx;
+    ProgramKind kind;
+    //the bytecode VM was restored from an image, it is set up already
+    bool restored;
+    //added to a scheduler, it runs there instead of in fml_run
+    bool scheduled;
+    bool ran;
+    //the run was stopped by a limit
+    bool limited;
+    char error[sizeof(((ErrorTrap *)NULL)->msg)];
+    //bytecode
+    VM vm;
+    //source, the ast points into the copy of the source in the arena
+    Arena arena;
+    Ast *ast;
+    IState *state;
+};
+
+FmlVm *fml_vm_new(size_t heap_limit, const FmlOptions *opts) {
+    FmlVm *vm = calloc(1, sizeof(FmlVm));
+    if (opts != NULL)
+        vm->opts = *opts;
+    vm->heap_limit = heap_limit;
+    return vm;
+}
+
+void fml_set_output(FmlVm *vm, FmlWrite write, void *ctx) {
+    vm->write = write;
+    vm->write_ctx = ctx;
+}
+
+static void set_error(FmlVm *vm, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(vm->error, sizeof(vm->error), fmt, args);
+    va_end(args);
+}
+
+//runs `fn` with the error trap of the thread set, false when it ended with a runtime_error
+static bool trapped(FmlVm *vm, void (*fn)(FmlVm *vm, void *arg), void *arg) {
+    ErrorTrap trap;
+    ErrorTrap *outer = error_trap;
+    error_trap = &trap;
+    if (setjmp(trap.env) == 0) {
+        fn(vm, arg);
+        error_trap = outer;
+        return true;
+    }
+    error_trap = outer;
+    memcpy(vm->error, trap.msg, sizeof(vm->error));
+    vm->limited = trap.limit;
+    return false;
+}
+
+//the VM holding the tools which keep their state in globals, from its first load until fml_vm_free
+static _Atomic(FmlVm *) tools_owner = NULL;
+
+static bool uses_global_tools(const FmlOptions *opts) {
+    return opts->sample_file != NULL || opts->alloc_sites || opts->heap_snapshot_file != NULL
+        || opts->perf_counters;
+}
+
+static bool can_load(FmlVm *vm) {
+    if (vm->kind != PROGRAM_NONE) {
+        set_error(vm, "Error: A program is already loaded");
+        return false;
+    }
+    FmlVm *owner = NULL;
+    if (uses_global_tools(&vm->opts) && !atomic_compare_exchange_strong(&tools_owner, &owner, vm)
+        && owner != vm) {
+        set_error(vm, "Error: The sampler, allocation sites, heap snapshot and perf counters are used by another VM");
+        return false;
+    }
+    return true;
+}
+
+static void bc_load_trapped(FmlVm *vm, void *file) {
+    bc_load(&vm->vm, file);
+}
+
+static bool load_bytecode(FmlVm *vm, FILE *file) {
+    if (vm->opts.perf_counters)
+        perf_phase_begin("load");
+    trace_begin(STR("deserialize"), "phase");
+    vm->vm = (VM){ .heap_limit = vm->heap_limit };
+    bool loaded = trapped(vm, bc_load_trapped, file);
+    trace_end("phase");
+    if (vm->opts.perf_counters)
+        perf_phase_end();
+    if (loaded)
+        vm->kind = PROGRAM_BYTECODE;
+    else
+        bc_unload(&vm->vm);
+    return loaded;
+}
+
+bool fml_load_bytecode(FmlVm *vm, const void *buf, size_t len) {
+    if (!can_load(vm))
+        return false;
+    FILE *file = fmemopen((void *)buf, len, "rb");
+    if (file == NULL) {
+        set_error(vm, "Error: Invalid header");
+        return false;
+    }
+    bool loaded = load_bytecode(vm, file);
+    fclose(file);
+    return loaded;
+}
+
+bool fml_load_bytecode_file(FmlVm *vm, const char *filename) {
+    if (!can_load(vm))
+        return false;
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        set_error(vm, "Error: Cannot open file %s", filename);
+        return false;
+    }
+    bool loaded = load_bytecode(vm, file);
+    fclose(file);
+    return loaded;
+}
+
+static void bc_snapshot_load_trapped(FmlVm *vm, void *filename) {
+    bc_snapshot_load(&vm->vm, filename);
+}
+
+bool fml_load_image_file(FmlVm *vm, const char *filename) {
+    if (!can_load(vm))
+        return false;
+    if (vm->opts.perf_counters)
+        perf_phase_begin("load");
+    trace_begin(STR("restore"), "phase");
+    vm->vm = (VM){ .heap_limit = vm->heap_limit };
+    bool loaded = trapped(vm, bc_snapshot_load_trapped, (void *)filename);
+    trace_end("phase");
+    if (vm->opts.perf_counters)
+        perf_phase_end();
+    if (loaded) {
+        vm->kind = PROGRAM_BYTECODE;
+        vm->restored = true;
+    } else {
+        bc_free(&vm->vm);
+    }
+    return loaded;
+}
+
+//parses the source already copied to the arena
+static bool load_source(FmlVm *vm, Str src) {
+    trace_begin(STR("parse"), "phase");
+    vm->ast = parse_src(&vm->arena, src);
+    trace_end("phase");
+    if (vm->opts.perf_counters)
+        perf_phase_end();
+    if (vm->ast == NULL) {
+        set_error(vm, "Failed to parse source");
+        arena_destroy(&vm->arena);
+        return false;
+    }
+    if (vm->opts.perf_counters)
+        perf_phase_begin("load");
+    vm->state = init_interpreter(vm->heap_limit);
+    if (vm->opts.perf_counters)
+        perf_phase_end();
+    vm->kind = PROGRAM_SOURCE;
+    return true;
+}
+
+bool fml_load_source(FmlVm *vm, const char *src, size_t len) {
+    if (!can_load(vm))
+        return false;
+    if (vm->opts.perf_counters)
+        perf_phase_begin("parse");
+    arena_init(&vm->arena);
+    u8 *copy = arena_alloc(&vm->arena, len);
+    memcpy(copy, src, len);
+    return load_source(vm, (Str){ .str = copy, .len = len });
+}
+
+/*
+   FROM REFENRENCE IMPL
+*/
+static Str read_file(Arena *arena, const char *name) {
+	FILE *f = fopen(name, "rb");
+	if (!f) {
+		return (Str){ .str = NULL, .len = 0 };
+	}
+	if (fseek(f, 0, SEEK_END) != 0) {
+		printf("failed to seek in file\n");
+	}
+	long tell = ftell(f);
+	if (tell < 0) {
+		printf("failed to ftell file\n");
+		fclose(f);
+		return (Str){ .str = NULL, .len = 0 };
+	}
+	size_t fsize = (size_t) tell;
+	fseek(f, 0, SEEK_SET);
+	u8 *buf = arena_alloc(arena, fsize);
+	size_t read;
+	if ((read = fread(buf, 1, fsize, f)) != fsize) {
+		if (feof(f)) {
+			fsize = read;
+		} else {
+			printf("failed to read the file\n");
+		}
+	}
+	fclose(f);
+	return (Str) { .str = buf, .len = fsize };
+}
+
+bool fml_load_source_file(FmlVm *vm, const char *filename) {
+    if (!can_load(vm))
+        return false;
+    if (vm->opts.perf_counters)
+        perf_phase_begin("parse");
+    arena_init(&vm->arena);
+    Str src = read_file(&vm->arena, filename);
+    if (src.str == NULL) {
+        set_error(vm, "Error: Cannot open file %s", filename);
+        if (vm->opts.perf_counters)
+            perf_phase_end();
+        arena_destroy(&vm->arena);
+        return false;
+    }
+    return load_source(vm, src);
+}
+
+bool fml_load_file(FmlVm *vm, const char *filename) {
+    size_t len = strlen(filename);
+    if (len >= 3 && strcmp(filename + len - 3, ".bc") == 0)
+        return fml_load_bytecode_file(vm, filename);
+    return fml_load_source_file(vm, filename);
+}
+
+static void run_bytecode(FmlVm *vm, void *arg) {
+    (void)arg;
+    BcOptions bc_options = {
+        .trace = vm->opts.trace,
+        .profile_ops = vm->opts.profile_ops,
+        .profile_ops_file = vm->opts.profile_ops_file,
+        .sample_file = vm->opts.sample_file,
+        .stats = vm->opts.stats,
+        .perf_counters = vm->opts.perf_counters,
+        .alloc_sites = vm->opts.alloc_sites,
+        .heap_snapshot_file = vm->opts.heap_snapshot_file,
+        .image_file = vm->opts.image_file,
+    };
+    if (!vm->restored)
+        bc_init(&vm->vm);
+    budget_init(&vm->vm.budget, vm->opts.limits.max_instructions, vm->opts.limits.timeout_ms);
+    bc_interpret(&vm->vm, &bc_options);
+    if (vm->opts.image_file != NULL && !vm->vm.snapshot_taken)
+        runtime_error("Error: The program ended without calling snapshot()\n");
+}
+
+static void run_source(FmlVm *vm, void *arg) {
+    (void)arg;
+    IState *state = vm->state;
+    if (vm->opts.image_file != NULL)
+        runtime_error("Error: Only bytecode can be snapshotted\n");
+    if (vm->opts.perf_counters)
+        perf_phase_begin("execute");
+    trace_begin(STR("execute"), "phase");
+    if (vm->opts.alloc_sites) {
+        alloc_sites_start(ast_alloc_site_frame, ast_alloc_site_describe, state);
+    }
+    if (vm->opts.heap_snapshot_file != NULL) {
+        heap_snapshot_setup(vm->opts.heap_snapshot_file, state->heap, ast_roots, state);
+    }
+    if (vm->opts.sample_file != NULL) {
+        sampler_start(ast_sample_walk, state);
+    }
+    budget_init(&state->budget, vm->opts.limits.max_instructions, vm->opts.limits.timeout_ms);
+    interpret(vm->ast, state);
+    //the global environment counts as the entry call
+    state->stats.calls++;
+    trace_end("phase");
+    if (vm->opts.perf_counters)
+        perf_phase_end();
+    if (trace_events_enabled) {
+        trace_events_write(NULL, NULL);
+    }
+    if (vm->opts.heap_snapshot_file != NULL) {
+        heap_snapshot_write(vm->opts.heap_snapshot_file);
+    }
+    if (vm->opts.alloc_sites) {
+        alloc_sites_report(stderr);
+    }
+    if (vm->opts.sample_file != NULL) {
+        sampler_stop();
+        sampler_write(vm->opts.sample_file, NULL, NULL);
+    }
+    if (vm->opts.stats) {
+        print_stats(&state->stats, state->heap, "AST nodes", false, stderr);
+    }
+}
+
+int fml_run(FmlVm *vm) {
+    if (vm->kind == PROGRAM_NONE) {
+        set_error(vm, "Error: No program is loaded");
+        return FML_ERROR;
+    }
+    if (vm->ran || vm->scheduled) {
+        set_error(vm, "Error: The program already ran");
+        return FML_ERROR;
+    }
+    vm->ran = true;
+    if (vm->write != NULL) {
+        out_flush();
+        out_set_sink(vm->write, vm->write_ctx);
+    }
+    bool ok = trapped(vm, vm->kind == PROGRAM_BYTECODE ? run_bytecode : run_source, NULL);
+    if (!ok && vm->opts.sample_file != NULL) {
+        //the timer would go on walking the freed VM
+        sampler_stop();
+    }
+    out_flush();
+    if (vm->write != NULL)
+        out_set_sink(NULL, NULL);
+    if (ok)
+        return FML_OK;
+    return vm->limited ? FML_LIMIT : FML_ERROR;
+}
+
+typedef struct {
+    FmlVm *vm;
+    //bytecode which has been set up by bc_init, its roots are part of the shared heap
+    bool started;
+    bool done;
+} SchedEntry;
+
+struct FmlSched {
+    Heap heap;
+    uint32_t slice;
+    SchedEntry *entries;
+    size_t cnt;
+    size_t cap;
+};
+
+//HeapRoots of the shared heap, the roots of every started VM which isn't done yet
+static void sched_roots(void *ctx, HeapVisit visit, void *visit_ctx) {
+    FmlSched *sched = ctx;
+    for (size_t i = 0; i < sched->cnt; i++) {
+        SchedEntry *e = &sched->entries[i];
+        if (e->started && !e->done)
+            bc_roots(&e->vm->vm, visit, visit_ctx);
+    }
+}
+
+FmlSched *fml_sched_new(size_t heap_limit, uint32_t slice) {
+    FmlSched *sched = calloc(1, sizeof(FmlSched));
+    heap_init(&sched->heap, heap_limit);
+    heap_set_roots(&sched->heap, sched_roots, sched);
+    sched->slice = slice > 0 ? slice : 1;
+    return sched;
+}
+
+bool fml_sched_add(FmlSched *sched, FmlVm *vm) {
+    if (vm->kind == PROGRAM_NONE) {
+        set_error(vm, "Error: No program is loaded");
+        return false;
+    }
+    if (vm->ran || vm->scheduled || vm->restored) {
+        //a restored VM has a heap of its own
+        set_error(vm, "Error: Only a program which has not run yet can be scheduled");
+        return false;
+    }
+    if (sched->cnt == sched->cap) {
+        sched->cap = sched->cap == 0 ? 64 : sched->cap * 2;
+        sched->entries = realloc(sched->entries, sizeof(SchedEntry) * sched->cap);
+    }
+    sched->entries[sched->cnt++] = (SchedEntry){ .vm = vm };
+    vm->scheduled = true;
+    return true;
+}
+
+static void start_bytecode(FmlVm *vm, void *arg) {
+    (void)arg;
+    bc_init(&vm->vm);
+    budget_init(&vm->vm.budget, vm->opts.limits.max_instructions, vm->opts.limits.timeout_ms);
+    bc_start(&vm->vm);
+}
+
+typedef struct {
+    uint32_t fuel;
+    bool finished;
+} Turn;
+
+static void resume_bytecode(FmlVm *vm, void *arg) {
+    Turn *turn = arg;
+    turn->finished = bc_resume(&vm->vm, turn->fuel);
+}
+
+//one turn of the VM, true when it is done afterwards
+static bool sched_turn(FmlSched *sched, SchedEntry *e) {
+    FmlVm *vm = e->vm;
+    vm->ran = true;
+    if (vm->kind == PROGRAM_SOURCE) {
+        FmlOptions opts = vm->opts;
+        vm->opts = (FmlOptions){ .limits = opts.limits };
+        trapped(vm, run_source, NULL);
+        vm->opts = opts;
+        return true;
+    }
+    if (!e->started) {
+        vm->vm.heap = &sched->heap;
+        vm->vm.heap_shared = true;
+        //from now on the collector sees the roots, bc_init keeps them complete
+        e->started = true;
+        if (!trapped(vm, start_bytecode, NULL))
+            return true;
+    }
+    Turn turn = { .fuel = sched->slice };
+    return !trapped(vm, resume_bytecode, &turn) || turn.finished;
+}
+
+void fml_sched_run(FmlSched *sched) {
+    size_t left = sched->cnt;
+    while (left > 0) {
+        for (size_t i = 0; i < sched->cnt; i++) {
+            SchedEntry *e = &sched->entries[i];
+            if (e->done)
+                continue;
+            if (e->vm->write != NULL)
+                out_set_sink(e->vm->write, e->vm->write_ctx);
+            bool done = sched_turn(sched, e);
+            out_flush();
+            if (e->vm->write != NULL)
+                out_set_sink(NULL, NULL);
+            if (done) {
+                e->done = true;
+                left--;
+            }
+        }
+    }
+}
+
+void fml_sched_free(FmlSched *sched) {
+    heap_destroy(&sched->heap);
+    free(sched->entries);
+    free(sched);
+}
+
+const char *fml_error(FmlVm *vm) {
+    return vm->error;
+}
+
+void fml_stats(FmlVm *vm, FmlStats *stats) {
+    *stats = (FmlStats){ 0 };
+    Stats *s;
+    Heap *heap;
+    if (vm->kind == PROGRAM_BYTECODE && vm->ran) {
+        s = &vm->vm.stats;
+        heap = vm->vm.heap;
+    } else if (vm->kind == PROGRAM_SOURCE && vm->ran) {
+        s = &vm->state->stats;
+        heap = vm->state->heap;
+    } else {
+        return;
+    }
+    stats->instructions = s->instructions;
+    stats->calls = s->calls;
+    stats->field_lookups = s->field_lookups;
+    stats->max_frames = s->max_frames;
+    for (int i = 0; i < VALUE_KIND_CNT; i++) {
+        stats->allocations += heap->alloc_cnt[i];
+        stats->allocated_bytes += heap->alloc_bytes[i];
+    }
+    stats->heap_peak = heap->heap_peak;
+    stats->collections = heap->collections;
+    stats->freed_bytes = heap->freed_bytes;
+    stats->gc_pause_ns = heap->gc_pause_ns;
+    stats->gc_max_pause_ns = heap->gc_max_pause_ns;
+}
+
+void fml_vm_free(FmlVm *vm) {
+    if (vm->kind == PROGRAM_BYTECODE) {
+        if (vm->ran || vm->restored)
+            bc_free(&vm->vm);
+        else
+            bc_unload(&vm->vm);
+    } else if (vm->kind == PROGRAM_SOURCE) {
+        free_interpreter(vm->state);
+        arena_destroy(&vm->arena);
+    }
+    FmlVm *owner = vm;
+    atomic_compare_exchange_strong(&tools_owner, &owner, NULL);
+    free(vm);
+}
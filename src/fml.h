@@ -0,0 +1,184 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// libfml, the interpreter as a library. A FmlVm is one isolate: a program,
+// the interpreter running it and a heap of its own, so different threads can
+// run different VMs at the same time. A VM runs the program it was loaded
+// with once:
+//
+//     FmlVm *vm = fml_vm_new(64 * 1024 * 1024, NULL);
+//     if (!fml_load_bytecode_file(vm, "program.bc") || fml_run(vm) != FML_OK)
+//         fprintf(stderr, "%s\n", fml_error(vm));
+//     FmlStats stats;
+//     fml_stats(vm, &stats);
+//     fml_vm_free(vm);
+//
+// Bytecode is run by the bytecode interpreter, source by the AST interpreter.
+// A program that can't be loaded or fails while running (an unknown field, a
+// full heap, ...) is abandoned, the error is kept in the VM and the process
+// goes on. The program prints through the buffer of the calling thread, to
+// stdout or to the function set by fml_set_output. fml_run flushes it before
+// it returns.
+//
+// The process-wide tools (the collector mode, the heap log, the hardware
+// counters and trace events) are not part of this API, main.c shows how the
+// fml executable sets them up around the VM. Trace events record every VM of
+// the process, start them only when the VMs run on one thread. The sampler,
+// the allocation sites, the heap snapshot and the perf counters of
+// FmlOptions keep their state in globals as well: only one VM at a time can
+// use them, from its first load until fml_vm_free. Loading another VM
+// which asks for any of them fails meanwhile.
+
+// libfml is built with hidden symbols, only what is marked FML_API is exported.
+#if defined(__GNUC__)
+#define FML_API __attribute__((visibility("default")))
+#else
+#define FML_API
+#endif
+
+typedef struct FmlVm FmlVm;
+
+typedef struct FmlSched FmlSched;
+
+// Results of fml_run, the exit status of the fml executable.
+#define FML_OK 0
+#define FML_ERROR 1
+//the program was stopped by a limit of FmlLimits
+#define FML_LIMIT 2
+
+typedef void (*FmlWrite)(void *ctx, const uint8_t *data, size_t len);
+
+// Limits for running untrusted programs, none when zeroed. They are checked
+// only at the safepoints, the backward jumps (loop iterations of source) and
+// the calls, so a program is stopped at the first safepoint after it got
+// over a limit. fml_run returns FML_LIMIT then.
+typedef struct {
+    //safepoints the program may pass, the next one is over the limit; the straight-line code between them is not counted
+    uint64_t max_instructions;
+    //wall-clock time of fml_run, checked every few thousand safepoints
+    uint32_t timeout_ms;
+} FmlLimits;
+
+// What the fml executable exposes as command line flags, all off when zeroed.
+typedef struct {
+    //print every executed instruction, bytecode only and only when built with FML_TRACE
+    bool trace;
+    //report the executions and cycles per instruction to stderr, bytecode only
+    bool profile_ops;
+    //also write the report as CSV here when not NULL
+    const char *profile_ops_file;
+    //write folded stacks of the sampling profiler here when not NULL
+    const char *sample_file;
+    //print the runtime statistics to stderr after the run
+    bool stats;
+    //count the phases with the hardware counters, perf_open has to be called first
+    bool perf_counters;
+    //report the allocations per allocation site to stderr after the run
+    bool alloc_sites;
+    //write a heap snapshot here after the run when not NULL
+    const char *heap_snapshot_file;
+    //write a VM image here when the program calls snapshot() and end the run there,
+    //bytecode only, see fml_load_image
+    const char *image_file;
+    FmlLimits limits;
+} FmlOptions;
+
+typedef struct {
+    //bytecode instructions or AST nodes, the bytecode interpreter counts
+    //them only with the `stats` or `alloc_sites` option
+    uint64_t instructions;
+    //function calls, including the entry point
+    uint64_t calls;
+    uint64_t field_lookups;
+    //max depth of the call stack
+    size_t max_frames;
+    //heap allocations and their bytes, including the headers
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    //max bytes of the heap in use
+    size_t heap_peak;
+    uint64_t collections;
+    uint64_t freed_bytes;
+    //time the program was stopped by the collector
+    uint64_t gc_pause_ns;
+    uint64_t gc_max_pause_ns;
+} FmlStats;
+
+// `heap_limit` in bytes, 0 for the default of 1 GiB. The heap memory is
+// only reserved, it is committed as the program allocates.
+// `opts` is copied, NULL runs without any of the tools.
+FML_API FmlVm *fml_vm_new(size_t heap_limit, const FmlOptions *opts);
+
+// Sends the output of the program to `write` instead of stdout. It is
+// called on the thread running the program whenever the buffer is flushed.
+FML_API void fml_set_output(FmlVm *vm, FmlWrite write, void *ctx);
+
+// Loads a program, a VM takes exactly one. `buf` is copied, it can be
+// freed as soon as the call returns. False when the program can't be loaded,
+// see fml_error.
+FML_API bool fml_load_bytecode(FmlVm *vm, const void *buf, size_t len);
+
+FML_API bool fml_load_bytecode_file(FmlVm *vm, const char *filename);
+
+FML_API bool fml_load_source(FmlVm *vm, const char *src, size_t len);
+
+FML_API bool fml_load_source_file(FmlVm *vm, const char *filename);
+
+// Loads bytecode when `filename` ends in .bc, source otherwise.
+FML_API bool fml_load_file(FmlVm *vm, const char *filename);
+
+// Loads an image written by a run with FmlOptions.image_file. The program
+// with its heap is restored as it was at the call of snapshot(), fml_run
+// resumes it after the call. The image is mapped, it has to stay unchanged
+// until fml_vm_free.
+FML_API bool fml_load_image_file(FmlVm *vm, const char *filename);
+
+// Runs the loaded program. FML_ERROR when it failed, when there is none or
+// it already ran, FML_LIMIT when it was stopped by FmlOptions.limits, see
+// fml_error. The tools of FmlOptions don't report an
+// abandoned program.
+FML_API int fml_run(FmlVm *vm);
+
+// Message of the error that made a load or fml_run fail, "" if none did.
+FML_API const char *fml_error(FmlVm *vm);
+
+// Statistics of the run, zeroed before it.
+FML_API void fml_stats(FmlVm *vm, FmlStats *stats);
+
+FML_API void fml_vm_free(FmlVm *vm);
+
+// Green threads: a scheduler runs many VMs interleaved on the calling
+// thread. Bytecode is suspended at a safepoint, a backward jump or a call,
+// after `slice` of them and the next VM takes its turn, round robin. The
+// scheduled bytecode VMs share one heap of `heap_limit` bytes (0 for the
+// default), so their memory is counted and collected together and
+// fml_stats of such a VM reports the heap statistics of all of them.
+// Source can't be suspended, it runs to completion in its first turn.
+//
+//     FmlSched *sched = fml_sched_new(0, 1000);
+//     for (...) {
+//         FmlVm *vm = fml_vm_new(0, NULL);
+//         if (fml_load_bytecode_file(vm, name))
+//             fml_sched_add(sched, vm);
+//     }
+//     fml_sched_run(sched);
+//     //fml_error and fml_stats of every VM, then fml_vm_free
+//     fml_sched_free(sched);
+//
+// The tools of FmlOptions are not used, the limits are, the timeout counts
+// from the first turn of the VM, including the turns of the others. The output of every VM goes to its
+// fml_set_output function or stdout, it is flushed at the end of each turn.
+FML_API FmlSched *fml_sched_new(size_t heap_limit, uint32_t slice);
+
+// Adds a loaded VM which has not run yet, false when it can't be added,
+// see fml_error. The VM stays owned by the caller.
+FML_API bool fml_sched_add(FmlSched *sched, FmlVm *vm);
+
+// Runs the added VMs until all of them are done, like fml_run each of them.
+FML_API void fml_sched_run(FmlSched *sched);
+
+// The scheduled VMs have to be freed before.
+FML_API void fml_sched_free(FmlSched *sched);
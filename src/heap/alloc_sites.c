@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc_sites.h"
+#include "../stats.h"
+
+typedef struct {
+    const void *site;
+    Str frame;
+    size_t count;
+    size_t bytes;
+    //bit per ValueKind allocated at the site
+    uint16_t kinds;
+} AllocSite;
+
+const void *alloc_site = NULL;
+bool alloc_sites_enabled = false;
+
+static AllocSite *sites;
+//power of two
+static size_t site_cap;
+static size_t site_cnt;
+static AllocSiteFrame site_frame;
+static AllocSiteDescribe site_describe;
+static void *site_ctx;
+
+static size_t site_hash(const void *site) {
+    //the sites are at least 1 byte apart, fibonacci hashing spreads them
+    return (size_t)(((uintptr_t)site * 0x9E3779B97F4A7C15ull) >> 17) & (site_cap - 1);
+}
+
+void alloc_sites_start(AllocSiteFrame frame, AllocSiteDescribe describe, void *ctx) {
+    site_cap = 1024;
+    site_cnt = 0;
+    sites = calloc(site_cap, sizeof(AllocSite));
+    site_frame = frame;
+    site_describe = describe;
+    site_ctx = ctx;
+    alloc_site = NULL;
+    alloc_sites_enabled = true;
+}
+
+static AllocSite *find_site(const void *site) {
+    size_t i = site_hash(site);
+    while (sites[i].count != 0 && sites[i].site != site) {
+        i = (i + 1) & (site_cap - 1);
+    }
+    return &sites[i];
+}
+
+static void grow_sites() {
+    AllocSite *old = sites;
+    size_t old_cap = site_cap;
+    site_cap *= 2;
+    sites = calloc(site_cap, sizeof(AllocSite));
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].count != 0)
+            *find_site(old[i].site) = old[i];
+    }
+    free(old);
+}
+
+void alloc_sites_record(size_t sz, ValueKind kind) {
+    AllocSite *entry = find_site(alloc_site);
+    if (entry->count == 0) {
+        entry->site = alloc_site;
+        entry->frame = site_frame != NULL && alloc_site != NULL ? site_frame(site_ctx, alloc_site) : (Str){ 0 };
+        site_cnt++;
+    }
+    entry->count++;
+    entry->bytes += sz;
+    entry->kinds |= 1 << kind;
+    //keep the table at most half full
+    if (site_cnt * 2 > site_cap)
+        grow_sites();
+}
+
+static int site_cmp(const void *a, const void *b) {
+    const AllocSite *site1 = a;
+    const AllocSite *site2 = b;
+    if (site1->bytes != site2->bytes)
+        return site1->bytes < site2->bytes ? 1 : -1;
+    return site1->count < site2->count ? 1 : site1->count > site2->count ? -1 : 0;
+}
+
+void alloc_sites_report(FILE *f) {
+    alloc_sites_enabled = false;
+    //compact the table and sort it
+    size_t cnt = 0;
+    size_t total_count = 0;
+    size_t total_bytes = 0;
+    for (size_t i = 0; i < site_cap; i++) {
+        if (sites[i].count == 0)
+            continue;
+        total_count += sites[i].count;
+        total_bytes += sites[i].bytes;
+        sites[cnt++] = sites[i];
+    }
+    qsort(sites, cnt, sizeof(AllocSite), site_cmp);
+
+    fprintf(f, "\n== allocation sites: %zu sites, %zu allocations, %zu bytes ==\n", cnt, total_count, total_bytes);
+    fprintf(f, "%-48s %12s %14s %7s  %s\n", "site", "count", "bytes", "%", "kinds");
+    for (size_t i = 0; i < cnt && i < ALLOC_SITES_REPORT_ROWS; i++) {
+        AllocSite *site = &sites[i];
+        char desc[128];
+        if (site->site == NULL)
+            snprintf(desc, sizeof(desc), "<runtime>");
+        else
+            site_describe(site_ctx, site->site, site->frame, desc, sizeof(desc));
+        char kinds[64] = "";
+        for (int k = 0; k < VALUE_KIND_CNT; k++) {
+            if (!(site->kinds & (1 << k)))
+                continue;
+            if (kinds[0] != '\0')
+                strncat(kinds, ",", sizeof(kinds) - strlen(kinds) - 1);
+            strncat(kinds, value_kind_name(k), sizeof(kinds) - strlen(kinds) - 1);
+        }
+        fprintf(f, "%-48s %12zu %14zu %6.2f%%  %s\n", desc, site->count, site->bytes, total_bytes ? 100.0 * site->bytes / total_bytes : 0.0, kinds);
+    }
+    if (cnt > ALLOC_SITES_REPORT_ROWS)
+        fprintf(f, "... %zu more sites\n", cnt - ALLOC_SITES_REPORT_ROWS);
+    free(sites);
+    sites = NULL;
+}
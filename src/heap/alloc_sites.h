@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../parser.h"
+#include "../types.h"
+
+// Allocation-site profiling (--alloc-sites). The interpreter keeps
+// `alloc_site` pointing at what it is executing, the bytecode instruction or
+// the AST node, and every heap_alloc is attributed to it. Counts and bytes
+// per site are kept in a hash table keyed by the site pointer and reported
+// at exit sorted by bytes, or when the heap gets full.
+
+//max sites printed in the report
+#define ALLOC_SITES_REPORT_ROWS 32
+
+//site of the next allocation, NULL for allocations of the runtime itself
+extern const void *alloc_site;
+extern bool alloc_sites_enabled;
+
+//called when a site is seen for the first time, returns the name of the function it is in
+typedef Str (*AllocSiteFrame)(void *ctx, const void *site);
+
+//writes a description of the site to buf, `frame` is what AllocSiteFrame returned for it
+typedef void (*AllocSiteDescribe)(void *ctx, const void *site, Str frame, char *buf, size_t buf_sz);
+
+//`frame` can be NULL when the describe callback can find the function from the site itself
+void alloc_sites_start(AllocSiteFrame frame, AllocSiteDescribe describe, void *ctx);
+
+void alloc_sites_record(size_t sz, ValueKind kind);
+
+//prints the report and stops the profiling
+void alloc_sites_report(FILE *f);
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "gc_concurrent.h"
+#include "../trace_events.h"
+
+typedef enum {
+    CYCLE_MARKING,
+    //the marker ran out of work, waiting for the remark
+    CYCLE_MARKED,
+    CYCLE_SWEEPING,
+    //the free lists are ready to be taken over
+    CYCLE_SWEPT,
+} CyclePhase;
+
+typedef struct SatbChunk {
+    struct SatbChunk *next;
+    size_t cnt;
+    Value vals[SATB_CHUNK_SZ];
+} SatbChunk;
+
+struct GcCycle {
+    Heap *heap;
+    //heap_free at the snapshot, cells from here on are not collected by this cycle
+    uint8_t *limit;
+    _Atomic int phase;
+    pthread_t thread;
+    //grey cells, used by the marker and after it is joined by the remark
+    Value *stack;
+    size_t stack_sz;
+    size_t stack_cap;
+    size_t marked;
+    //chunk the interpreter is filling and the full ones waiting for the marker
+    SatbChunk *local;
+    SatbChunk *full;
+    pthread_mutex_t lock;
+    //result of the sweep
+    Value free_lists[HEAP_SIZE_CLASSES];
+    Value large_free;
+    size_t free_bytes;
+    size_t freed;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void account_pause(Heap *heap, uint64_t start) {
+    uint64_t pause_ns = now_ns() - start;
+    heap->gc_pause_ns += pause_ns;
+    if (pause_ns > heap->gc_max_pause_ns)
+        heap->gc_max_pause_ns = pause_ns;
+}
+
+//the marker and the interpreter both touch the flags of old cells, only the marker sets them
+static void shade(GcCycle *cycle, Value val) {
+    if (val < cycle->heap->heap_start || val >= cycle->limit)
+        return;
+    CellHeader *header = cell_header(val);
+    uint8_t flags = __atomic_load_n(&header->flags, __ATOMIC_RELAXED);
+    if (flags & CELL_MARKED)
+        return;
+    __atomic_store_n(&header->flags, flags | CELL_MARKED, __ATOMIC_RELAXED);
+    cycle->marked++;
+    if (cycle->stack_sz == cycle->stack_cap) {
+        cycle->stack_cap *= 2;
+        cycle->stack = realloc(cycle->stack, sizeof(Value) * cycle->stack_cap);
+    }
+    cycle->stack[cycle->stack_sz++] = val;
+}
+
+//the interpreter may be storing to the slot at the same time
+static void shade_slot(void *ctx, Value *slot) {
+    shade(ctx, __atomic_load_n(slot, __ATOMIC_RELAXED));
+}
+
+static void drain(GcCycle *cycle) {
+    while (cycle->stack_sz > 0) {
+        heap_visit_children(cycle->stack[--cycle->stack_sz], shade_slot, cycle);
+    }
+}
+
+static void shade_chunks(GcCycle *cycle, SatbChunk *chunk) {
+    while (chunk != NULL) {
+        for (size_t i = 0; i < chunk->cnt; i++) {
+            shade(cycle, chunk->vals[i]);
+        }
+        SatbChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+static SatbChunk *chunk_new(void) {
+    SatbChunk *chunk = malloc(sizeof(SatbChunk));
+    chunk->next = NULL;
+    chunk->cnt = 0;
+    return chunk;
+}
+
+void satb_record(Heap *heap, Value old) {
+    GcCycle *cycle = heap->cycle;
+    //new cells and the ones already marked are kept anyway
+    if (old < heap->heap_start || old >= cycle->limit)
+        return;
+    if (__atomic_load_n(&cell_header(old)->flags, __ATOMIC_RELAXED) & CELL_MARKED)
+        return;
+    SatbChunk *chunk = cycle->local;
+    if (chunk->cnt == SATB_CHUNK_SZ) {
+        pthread_mutex_lock(&cycle->lock);
+        chunk->next = cycle->full;
+        cycle->full = chunk;
+        pthread_mutex_unlock(&cycle->lock);
+        chunk = cycle->local = chunk_new();
+    }
+    chunk->vals[chunk->cnt++] = old;
+}
+
+static void *mark_thread(void *arg) {
+    GcCycle *cycle = arg;
+    for (;;) {
+        drain(cycle);
+        pthread_mutex_lock(&cycle->lock);
+        SatbChunk *chunks = cycle->full;
+        cycle->full = NULL;
+        pthread_mutex_unlock(&cycle->lock);
+        if (chunks == NULL)
+            break;
+        shade_chunks(cycle, chunks);
+    }
+    atomic_store_explicit(&cycle->phase, CYCLE_MARKED, memory_order_release);
+    return NULL;
+}
+
+static void *sweep_thread(void *arg) {
+    GcCycle *cycle = arg;
+    cycle->freed = heap_sweep_range(cycle->heap, cycle->limit, cycle->free_lists, &cycle->large_free, &cycle->free_bytes);
+    atomic_store_explicit(&cycle->phase, CYCLE_SWEPT, memory_order_release);
+    return NULL;
+}
+
+static void cycle_start(Heap *heap) {
+    uint64_t start = now_ns();
+    heap_log_event(heap, 'B');
+    trace_begin(STR("gc snapshot"), "gc");
+    GcCycle *cycle = calloc(1, sizeof(GcCycle));
+    cycle->heap = heap;
+    cycle->limit = heap->heap_free;
+    atomic_init(&cycle->phase, CYCLE_MARKING);
+    cycle->stack_cap = 1024;
+    cycle->stack = malloc(sizeof(Value) * cycle->stack_cap);
+    cycle->local = chunk_new();
+    pthread_mutex_init(&cycle->lock, NULL);
+    //the free cells stay CELL_FREE and unmarked, the sweep threads them to the new lists again
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        heap->free_lists[i] = NULL;
+    }
+    heap->large_free = NULL;
+    heap->free_bytes = 0;
+    heap->roots(heap->roots_ctx, shade_slot, cycle);
+    heap->cycle = cycle;
+    heap->satb_active = true;
+    pthread_create(&cycle->thread, NULL, mark_thread, cycle);
+    trace_end("gc");
+    account_pause(heap, start);
+}
+
+static void remark(Heap *heap) {
+    GcCycle *cycle = heap->cycle;
+    uint64_t start = now_ns();
+    trace_begin(STR("gc remark"), "gc");
+    pthread_join(cycle->thread, NULL);
+    heap->satb_active = false;
+    cycle->local->next = cycle->full;
+    shade_chunks(cycle, cycle->local);
+    cycle->local = NULL;
+    cycle->full = NULL;
+    drain(cycle);
+    free(cycle->stack);
+    cycle->stack = NULL;
+    atomic_store_explicit(&cycle->phase, CYCLE_SWEEPING, memory_order_relaxed);
+    pthread_create(&cycle->thread, NULL, sweep_thread, cycle);
+    trace_end("gc");
+    account_pause(heap, start);
+}
+
+static void install(Heap *heap) {
+    GcCycle *cycle = heap->cycle;
+    pthread_join(cycle->thread, NULL);
+    memcpy(heap->free_lists, cycle->free_lists, sizeof(heap->free_lists));
+    heap->large_free = cycle->large_free;
+    heap->free_bytes = cycle->free_bytes;
+    heap->freed_bytes += cycle->freed;
+    heap->collections++;
+    //the next cycle starts when half of what is left now is used up
+    size_t occupied = heap->heap_size - heap->free_bytes;
+    heap->gc_trigger = occupied + (heap->heap_limit - occupied) / 2;
+    pthread_mutex_destroy(&cycle->lock);
+    free(cycle);
+    heap->cycle = NULL;
+    heap_log_event(heap, 'A');
+}
+
+void gc_cycle_step(Heap *heap) {
+    GcCycle *cycle = heap->cycle;
+    if (cycle == NULL) {
+        if (heap->heap_size - heap->free_bytes >= heap->gc_trigger)
+            cycle_start(heap);
+        return;
+    }
+    int phase = atomic_load_explicit(&cycle->phase, memory_order_acquire);
+    if (phase == CYCLE_MARKED)
+        remark(heap);
+    else if (phase == CYCLE_SWEPT)
+        install(heap);
+}
+
+void gc_cycle_finish(Heap *heap) {
+    GcCycle *cycle = heap->cycle;
+    if (cycle == NULL)
+        return;
+    int phase = atomic_load_explicit(&cycle->phase, memory_order_acquire);
+    if (phase == CYCLE_MARKING || phase == CYCLE_MARKED)
+        remark(heap);
+    install(heap);
+}
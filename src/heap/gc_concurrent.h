@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "heap.h"
+
+// Concurrent collection (--gc concurrent). When the occupied part of the heap
+// crosses gc_trigger a cycle starts:
+//
+//  1. snapshot: the interpreter is stopped, the roots are shaded and
+//     everything allocated from now on lies above the snapshot limit, which
+//     makes it live for this cycle. The free lists are left alone until the
+//     cycle ends, new cells are bumped.
+//  2. concurrent mark: a background thread traces from the shaded roots
+//     while the interpreter runs. Every store to a Value slot in a heap cell
+//     goes through heap_write_barrier first, which records the overwritten
+//     value (snapshot-at-the-beginning). So everything reachable at the
+//     snapshot gets marked even when the interpreter unlinks it meanwhile.
+//     Root slots (operands, locals, globals) need no barrier, all of them
+//     were shaded at the snapshot.
+//  3. remark: the interpreter is stopped again to trace the last recorded
+//     values. That is the only other pause and it is proportional to the
+//     stores made since the marker last drained the records.
+//  4. concurrent sweep: a background thread sweeps the cells below the
+//     limit into fresh free lists, which the interpreter takes over at its
+//     next allocation.
+//
+// The interpreter polls the cycle in heap_alloc. If the heap gets full
+// during a cycle the interpreter waits for it and falls back to a
+// stop-the-world collection when that did not free enough.
+
+//records in a chunk of the overwritten values, a full chunk is handed to the marker
+#define SATB_CHUNK_SZ 256
+
+typedef struct GcCycle GcCycle;
+
+void satb_record(Heap *heap, Value old);
+
+//has to precede every store to a Value slot of a cell on the heap that is not freshly allocated
+static inline void heap_write_barrier(Heap *heap, Value *slot) {
+    if (heap->satb_active)
+        satb_record(heap, *slot);
+}
+
+//called on every allocation, starts a cycle or moves the running one on without waiting
+void gc_cycle_step(Heap *heap);
+
+//waits until the running cycle, if any, has completed
+void gc_cycle_finish(Heap *heap);
@@ -3,88 +3,450 @@
 //
 
 #include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include "heap.h"
 #include "../ast/ast_interpreter.h"
+#include "../output.h"
+#include "../utils.h"
+#include "../trace_events.h"
+#include "alloc_sites.h"
+#include "mark_parallel.h"
+#include "gc_concurrent.h"
 
 
-void *heap_alloc(size_t sz, Heap *heap) {
-    //printf("allocating %lld bytes\n", sz);
-    if (heap->heap_size + sz > MEM_SZ) {
-        printf("Heap is full, exiting.\n");
-        printf("Max heap size is: %ld, and current heap size is: %ld\n", MEM_SZ, heap->heap_size);
+bool heap_huge_pages = false;
+HeapGcMode heap_gc_mode = GC_SWEEP;
+static FILE *heap_log = NULL;
+
+void heap_init(Heap *heap, size_t limit) {
+    memset(heap, 0, sizeof(Heap));
+    heap->heap_limit = limit != 0 ? limit : (size_t)HEAP_DEFAULT_LIMIT;
+    //only address space is reserved, heap_commit makes it usable as the heap grows
+    heap->reserved_size = heap->heap_limit + (heap_huge_pages ? HUGE_PAGE_SZ : 0);
+    heap->reserved_start = mmap(NULL, heap->reserved_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (heap->reserved_start == MAP_FAILED) {
+        printf("Failed to reserve %zu bytes for the heap\n", heap->heap_limit);
         exit(1);
     }
-    else {
-        void *ptr = heap->heap_free;
+    heap->heap_start = heap->reserved_start;
+    if (heap_huge_pages) {
+        //huge pages have to be aligned to their size
+        uintptr_t start = ((uintptr_t)heap->reserved_start + HUGE_PAGE_SZ - 1) & ~(uintptr_t)(HUGE_PAGE_SZ - 1);
+        heap->heap_start = (uint8_t *)start;
+        madvise(heap->heap_start, heap->heap_limit, MADV_HUGEPAGE);
+    }
+    heap->heap_free = heap->heap_start;
+    heap->gc_trigger = heap->heap_limit / 2;
+    heap_log_event(heap, 'S');
+}
 
-        heap->heap_free += sz;
-        heap->heap_size += sz;
+void heap_destroy(Heap *heap) {
+    //the background threads may still be using the heap
+    gc_cycle_finish(heap);
+    heap_log_event(heap, 'E');
+    munmap(heap->reserved_start, heap->reserved_size);
+}
+
+void heap_set_roots(Heap *heap, HeapRoots roots, void *roots_ctx) {
+    heap->roots = roots;
+    heap->roots_ctx = roots_ctx;
+}
 
-        //align to 8 bytes
-        size_t diff = 8 - (heap->heap_size % 8);
-        if (diff != 8) {
-            heap->heap_free += diff;
-            heap->heap_size += diff;
+void heap_log_open(const char *filename) {
+    heap_log = fopen(filename, "w");
+    if (heap_log == NULL) {
+        fprintf(stderr, "failed to open the heap log %s\n", filename);
+        return;
+    }
+    fprintf(heap_log, "timestamp,event,heap\n");
+}
+
+void heap_log_event(Heap *heap, char event) {
+    if (heap_log == NULL)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    fprintf(heap_log, "%lld%09ld,%c,%zu\n", (long long)ts.tv_sec, ts.tv_nsec, event, heap->heap_size - heap->free_bytes);
+    if (event == 'E')
+        fflush(heap_log);
+}
+
+//commits the chunks up to `size` bytes of the heap
+static void heap_commit(Heap *heap, size_t size) {
+    size_t committed = (size + HEAP_COMMIT_CHUNK - 1) / HEAP_COMMIT_CHUNK * HEAP_COMMIT_CHUNK;
+    if (committed > heap->heap_limit)
+        committed = heap->heap_limit;
+    if (mprotect(heap->heap_start + heap->heap_committed, committed - heap->heap_committed, PROT_READ | PROT_WRITE) != 0) {
+        runtime_error("Failed to commit the heap memory, heap size is: %zu\n", heap->heap_size);
+    }
+    heap->heap_committed = committed;
+}
+
+static inline size_t size_class(size_t cap) {
+    return cap / 8 - 1;
+}
+
+//first fit from the cells too large for the size classes, the rest of the cell is wasted until the next sweep
+static Value large_free_alloc(Heap *heap, size_t cap) {
+    Value *link = &heap->large_free;
+    while (*link != NULL) {
+        Value cell = *link;
+        if (cell_header(cell)->size >= cap) {
+            *link = *(Value *)cell;
+            return cell;
         }
+        link = (Value *)cell;
+    }
+    return NULL;
+}
 
-        //printf("heap size is: %ld\n", heap->heap_size);
-        return ptr;
+static _Noreturn void heap_full(Heap *heap) {
+    if (alloc_sites_enabled) {
+        //the sites that filled the heap
+        alloc_sites_report(stderr);
     }
+    runtime_error("Heap is full, exiting.\nMax heap size is: %zu, and current heap size is: %zu\n", heap->heap_limit, heap->heap_size);
 }
 
-//TODO add printing of all types
-void print_heap(Heap *heap) {
-    printf("heap(:\n");
-    uint8_t *ptr = heap->heap_start;
-    int cnt = 0;
-    while (ptr < heap->heap_free) {
-        printf("element %d: ", cnt++);
-        print_val(ptr);
-        printf("\n");
-        switch (*(Value)ptr) {
-            case VK_INTEGER: {
-                ptr += sizeof(Integer);
-                break;
+static Value bump_alloc(Heap *heap, size_t cap) {
+    if (heap->heap_size + sizeof(CellHeader) + cap > heap->heap_limit)
+        return NULL;
+    //the header and the value have to be writable
+    if (heap->heap_size + sizeof(CellHeader) + cap > heap->heap_committed) {
+        heap_commit(heap, heap->heap_size + sizeof(CellHeader) + cap);
+    }
+    CellHeader *header = (CellHeader *)heap->heap_free;
+    header->size = cap;
+    header->flags = 0;
+    heap->heap_free += sizeof(CellHeader) + cap;
+    heap->heap_size += sizeof(CellHeader) + cap;
+    if (heap->heap_size > heap->heap_peak) {
+        heap->heap_peak = heap->heap_size;
+    }
+    return (Value)(header + 1);
+}
+
+//free lists first, then the untouched rest of the heap
+static Value try_alloc(Heap *heap, size_t cap) {
+    Value ptr = NULL;
+    //free lists are only populated by a collection, until then this is a single test
+    if (heap->free_bytes > 0) {
+        if (cap <= HEAP_SMALL_MAX) {
+            Value *list = &heap->free_lists[size_class(cap)];
+            if (*list != NULL) {
+                ptr = *list;
+                *list = *(Value *)ptr;
             }
-            case VK_BOOLEAN: {
-                ptr += sizeof(Boolean);
-                break;
+        } else {
+            ptr = large_free_alloc(heap, cap);
+        }
+        if (ptr != NULL) {
+            cell_header(ptr)->flags = 0;
+            heap->free_bytes -= sizeof(CellHeader) + cell_header(ptr)->size;
+            return ptr;
+        }
+    }
+    return bump_alloc(heap, cap);
+}
+
+void *heap_alloc(size_t sz, ValueKind kind, Heap *heap) {
+    //printf("allocating %lld bytes\n", sz);
+    assert(sz <= UINT32_MAX);
+    //cells are kept aligned to 8 bytes, the capacity in the header includes the padding
+    size_t cap = (sz + 7) & ~(size_t)7;
+    if (heap_gc_mode == GC_CONCURRENT && heap->roots != NULL) {
+        gc_cycle_step(heap);
+    }
+    Value ptr = try_alloc(heap, cap);
+    if (ptr == NULL && heap->cycle != NULL) {
+        //the running cycle has to end before its free lists can be used
+        gc_cycle_finish(heap);
+        ptr = try_alloc(heap, cap);
+    }
+    if (ptr == NULL && heap->roots != NULL) {
+        heap_collect(heap);
+        //a heap that stays almost full after a collection would only be collected over and over again
+        if (heap->free_bytes + (heap->heap_limit - heap->heap_size) < heap->heap_limit / HEAP_MIN_FREE_FRACTION) {
+            heap_full(heap);
+        }
+        ptr = try_alloc(heap, cap);
+    }
+    if (ptr == NULL) {
+        heap_full(heap);
+    }
+    heap->alloc_cnt[kind]++;
+    heap->alloc_bytes[kind] += sz;
+    if (alloc_sites_enabled) {
+        alloc_sites_record(sz, kind);
+    }
+    return ptr;
+}
+
+//walks all the cells, including the free ones
+static inline Value cell_next(Heap *heap, Value val) {
+    Value next = val + cell_header(val)->size + sizeof(CellHeader);
+    return next < heap->heap_free ? next : NULL;
+}
+
+static inline Value cell_first(Heap *heap) {
+    return heap->heap_free == heap->heap_start ? NULL : heap->heap_start + sizeof(CellHeader);
+}
+
+Value heap_first(Heap *heap) {
+    Value val = cell_first(heap);
+    while (val != NULL && (cell_header(val)->flags & CELL_FREE))
+        val = cell_next(heap, val);
+    return val;
+}
+
+Value heap_next(Heap *heap, Value val) {
+    do {
+        val = cell_next(heap, val);
+    } while (val != NULL && (cell_header(val)->flags & CELL_FREE));
+    return val;
+}
+
+void heap_visit_children(Value val, HeapVisit visit, void *visit_ctx) {
+    switch (*val) {
+        case VK_ARRAY: {
+            Array *array = (Array *)val;
+            for (size_t i = 0; i < array->size; i++) {
+                if (array->val[i] != NULL)
+                    visit(visit_ctx, &array->val[i]);
             }
-            case VK_NULL: {
-                ptr += sizeof(Null);
-                break;
+            break;
+        }
+        case VK_OBJECT: {
+            Object *obj = (Object *)val;
+            if (obj->parent != NULL)
+                visit(visit_ctx, &obj->parent);
+            for (size_t i = 0; i < obj->field_cnt; i++) {
+                if (obj->val[i].val != NULL)
+                    visit(visit_ctx, &obj->val[i].val);
             }
-            case VK_STRING: {
-                Bc_String *str = (Bc_String *) ptr;
-                ptr += sizeof(Bc_String) + str->len;
+            break;
+        }
+        //the other values don't refer to other values on the heap
+        default:
+            break;
+    }
+}
+
+typedef struct {
+    Heap *heap;
+    Value *stack;
+    size_t stack_sz;
+    size_t stack_cap;
+    size_t marked;
+} MarkState;
+
+static void mark_slot(void *ctx, Value *slot) {
+    MarkState *ms = ctx;
+    Value val = *slot;
+    if (!heap_contains(ms->heap, val) || (cell_header(val)->flags & CELL_MARKED))
+        return;
+    cell_header(val)->flags |= CELL_MARKED;
+    ms->marked++;
+    if (ms->stack_sz == ms->stack_cap) {
+        ms->stack_cap *= 2;
+        ms->stack = realloc(ms->stack, sizeof(Value) * ms->stack_cap);
+    }
+    ms->stack[ms->stack_sz++] = val;
+}
+
+size_t heap_mark(Heap *heap, HeapRoots roots, void *roots_ctx) {
+    MarkState ms = { .heap = heap, .stack_cap = 1024 };
+    ms.stack = malloc(sizeof(Value) * ms.stack_cap);
+    roots(roots_ctx, mark_slot, &ms);
+    //explicit stack, deep lists would overflow the C stack
+    while (ms.stack_sz > 0) {
+        heap_visit_children(ms.stack[--ms.stack_sz], mark_slot, &ms);
+    }
+    free(ms.stack);
+    return ms.marked;
+}
+
+void heap_clear_marks(Heap *heap) {
+    for (Value val = heap_first(heap); val != NULL; val = heap_next(heap, val)) {
+        cell_header(val)->flags &= ~CELL_MARKED;
+    }
+}
+
+size_t heap_sweep_range(Heap *heap, uint8_t *end, Value *free_lists, Value *large_free, size_t *free_bytes) {
+    //the lists are rebuilt from scratch, in address order
+    Value *tails[HEAP_SIZE_CLASSES];
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        free_lists[i] = NULL;
+        tails[i] = &free_lists[i];
+    }
+    *large_free = NULL;
+    Value *large_tail = large_free;
+    size_t freed = 0;
+    *free_bytes = 0;
+    for (uint8_t *cell = heap->heap_start; cell < end; cell += sizeof(CellHeader) + ((CellHeader *)cell)->size) {
+        CellHeader *header = (CellHeader *)cell;
+        Value val = cell + sizeof(CellHeader);
+        if (header->flags & CELL_MARKED) {
+            header->flags &= ~CELL_MARKED;
+            continue;
+        }
+        if (!(header->flags & CELL_FREE))
+            freed += sizeof(CellHeader) + header->size;
+        header->flags = CELL_FREE;
+        *free_bytes += sizeof(CellHeader) + header->size;
+        //the link to the next free cell is stored in the cell itself
+        Value **tail = header->size <= HEAP_SMALL_MAX ? &tails[size_class(header->size)] : &large_tail;
+        **tail = val;
+        *tail = (Value *)val;
+    }
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        *tails[i] = NULL;
+    }
+    *large_tail = NULL;
+    return freed;
+}
+
+size_t heap_sweep(Heap *heap) {
+    return heap_sweep_range(heap, heap->heap_free, heap->free_lists, &heap->large_free, &heap->free_bytes);
+}
+
+//old and new addresses of the live cells, both sorted as the cells keep their order
+typedef struct {
+    Heap *heap;
+    Value *from;
+    Value *to;
+    size_t cnt;
+} Forwarding;
+
+static void forward_slot(void *ctx, Value *slot) {
+    Forwarding *fwd = ctx;
+    Value val = *slot;
+    if (!heap_contains(fwd->heap, val))
+        return;
+    size_t lo = 0;
+    size_t hi = fwd->cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (fwd->from[mid] < val)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    assert(lo < fwd->cnt && fwd->from[lo] == val);
+    *slot = fwd->to[lo];
+}
+
+size_t heap_compact(Heap *heap, size_t marked, HeapRoots roots, void *roots_ctx) {
+    //the table is kept off the heap, the header has no room for a forwarding pointer
+    Forwarding fwd = { .heap = heap, .cnt = 0 };
+    fwd.from = malloc(sizeof(Value) * (marked + 1));
+    fwd.to = malloc(sizeof(Value) * (marked + 1));
+    size_t freed = 0;
+    uint8_t *dest = heap->heap_start;
+    for (Value val = cell_first(heap); val != NULL; val = cell_next(heap, val)) {
+        CellHeader *header = cell_header(val);
+        size_t cell_sz = sizeof(CellHeader) + header->size;
+        if (!(header->flags & CELL_MARKED)) {
+            if (!(header->flags & CELL_FREE))
+                freed += cell_sz;
+            continue;
+        }
+        fwd.from[fwd.cnt] = val;
+        fwd.to[fwd.cnt] = dest + sizeof(CellHeader);
+        fwd.cnt++;
+        dest += cell_sz;
+    }
+    assert(fwd.cnt == marked);
+
+    //the references are updated in place before anything moves
+    roots(roots_ctx, forward_slot, &fwd);
+    for (size_t i = 0; i < fwd.cnt; i++) {
+        heap_visit_children(fwd.from[i], forward_slot, &fwd);
+    }
+    //a cell never moves up, so sliding in address order doesn't overwrite a cell not yet moved
+    for (size_t i = 0; i < fwd.cnt; i++) {
+        CellHeader *header = cell_header(fwd.from[i]);
+        header->flags &= ~CELL_MARKED;
+        memmove(cell_header(fwd.to[i]), header, sizeof(CellHeader) + header->size);
+    }
+    free(fwd.from);
+    free(fwd.to);
+
+    heap->heap_free = dest;
+    heap->heap_size = dest - heap->heap_start;
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        heap->free_lists[i] = NULL;
+    }
+    heap->large_free = NULL;
+    heap->free_bytes = 0;
+    //give the pages of the emptied chunks back, they stay committed and are zero filled when touched again
+    size_t keep = (heap->heap_size + HEAP_COMMIT_CHUNK - 1) / HEAP_COMMIT_CHUNK * HEAP_COMMIT_CHUNK;
+    if (keep < heap->heap_committed) {
+        madvise(heap->heap_start + keep, heap->heap_committed - keep, MADV_DONTNEED);
+    }
+    return freed;
+}
+
+void heap_collect(Heap *heap) {
+    heap_log_event(heap, 'B');
+    trace_begin(STR("gc"), "gc");
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t marked = heap_gc_threads > 1 ? heap_mark_parallel(heap, heap->roots, heap->roots_ctx, heap_gc_threads)
+                                        : heap_mark(heap, heap->roots, heap->roots_ctx);
+    if (heap_gc_mode == GC_COMPACT)
+        heap->freed_bytes += heap_compact(heap, marked, heap->roots, heap->roots_ctx);
+    else
+        heap->freed_bytes += heap_sweep(heap);
+    heap->collections++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t pause_ns = (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+    heap->gc_pause_ns += pause_ns;
+    if (pause_ns > heap->gc_max_pause_ns)
+        heap->gc_max_pause_ns = pause_ns;
+    trace_end("gc");
+    heap_log_event(heap, 'A');
+}
+
+void print_heap(Heap *heap) {
+    out_cstr("heap(:\n");
+    int cnt = 0;
+    for (Value val = heap_first(heap); val != NULL; val = heap_next(heap, val)) {
+        out_cstr("element ");
+        out_int(cnt++);
+        out_cstr(": ");
+        //arrays and objects are printed shallowly, their elements are cells of their own
+        switch (*val) {
+            case VK_ARRAY:
+                out_cstr("array of ");
+                out_int(((Array *)val)->size);
                 break;
-            }
-            case VK_OBJECT: {
-                Object *obj = (Object *) ptr;
-                ptr += sizeof(Object) + sizeof(Field) * obj->field_cnt;
+            case VK_OBJECT:
+                out_cstr("object with ");
+                out_int(((Object *)val)->field_cnt);
+                out_cstr(" fields");
                 break;
-            }
-            case VK_FUNCTION: {
-                Bc_Func *func = (Bc_Func *) ptr;
-                ptr += sizeof(Bc_Func) + func->len;
+            case VK_STRING:
+                out_cstr("string ");
+                out_write(((Bc_String *)val)->value, ((Bc_String *)val)->len);
+                break;
+            default:
+                print_val(val);
                 break;
-            }
-        }
-        //align to 8 bytes
-        size_t diff = 8 - ((uintptr_t)ptr % 8);
-        if (diff != 8) {
-            ptr += diff;
         }
+        out_cstr("\n");
     }
-    printf("\n)\n");
+    out_cstr("\n)\n");
 }
 
 Array *array_alloc(int size, Heap *heap) {
     //array is stored as folows:
     // ValueKind | size_t | Value[size]
     // ValueKind == VK_ARRAY | size_t == numOfElems(array) | Value[size] == array of values (aka pointers to the actual valuesa)
-    return heap_alloc(sizeof(Array) + sizeof(Value) * size, heap);
+    return heap_alloc(sizeof(Array) + sizeof(Value) * size, VK_ARRAY, heap);
 }
 
 //TODO not constistent with other allocs
@@ -93,6 +455,8 @@ Value construct_array(int size, Heap *heap) {
     Array *array = array_alloc(size, heap);
     array->kind = VK_ARRAY;
     array->size = size;
+    //the heap walkers skip NULL slots of arrays which are not initialized yet
+    memset(array->val, 0, sizeof(Value) * size);
     return array;
 }
 
@@ -100,7 +464,7 @@ Object *object_alloc(int size, Heap *heap) {
     //object is stored as follows:
     // ValueKind | parent | size_t | Value[size]
     // ValueKind == VK_OBJECT | parent == VK_OBJECT | size_t == numOfFields(object) | Value[size] == array of Values (aka pointers members of the object)
-    return heap_alloc(sizeof(Object) + sizeof(Field) * size, heap);
+    return heap_alloc(sizeof(Object) + sizeof(Field) * size, VK_OBJECT, heap);
 }
 
 Value construct_object(int size, Value parent, Heap *heap) {
@@ -108,11 +472,12 @@ Value construct_object(int size, Value parent, Heap *heap) {
     object->kind = VK_OBJECT;
     object->field_cnt = size;
     object->parent = parent;
+    memset(object->val, 0, sizeof(Field) * size);
     return object;
 }
 
 Function *ast_function_alloc(Heap *heap) {
-    return heap_alloc(sizeof(Function), heap);
+    return heap_alloc(sizeof(Function), VK_FUNCTION, heap);
 }
 
 Value construct_ast_function(AstFunction *ast_func, Heap *heap) {
@@ -123,7 +488,7 @@ Value construct_ast_function(AstFunction *ast_func, Heap *heap) {
 }
 
 Integer *integer_alloc(Heap *heap) {
-    return heap_alloc(sizeof(Integer), heap);
+    return heap_alloc(sizeof(Integer), VK_INTEGER, heap);
 }
 
 Value construct_integer(i32 val, Heap *heap) {
@@ -134,7 +499,7 @@ Value construct_integer(i32 val, Heap *heap) {
 }
 
 Boolean *boolean_alloc(Heap *heap) {
-    return heap_alloc(sizeof(Boolean), heap);
+    return heap_alloc(sizeof(Boolean), VK_BOOLEAN, heap);
 }
 
 Value construct_boolean(bool val, Heap *heap) {
@@ -145,7 +510,7 @@ Value construct_boolean(bool val, Heap *heap) {
 }
 
 Null *null_alloc(Heap *heap) {
-    return heap_alloc(sizeof(Null), heap);
+    return heap_alloc(sizeof(Null), VK_NULL, heap);
 }
 
 //TODO don't construct null, just set the Value ptr to NULL
@@ -157,7 +522,7 @@ Value construct_null(Heap *heap) {
 }
 
 Bc_String *bc_string_alloc(uint32_t size, Heap *heap) {
-    return heap_alloc(sizeof(Bc_String) + sizeof(uint8_t) * size, heap);
+    return heap_alloc(sizeof(Bc_String) + sizeof(uint8_t) * size, VK_STRING, heap);
 }
 
 //we don't need to copy the string string, we can just refer to it's value in cp
@@ -171,7 +536,9 @@ Value construct_bc_string(Bc_String *str, Heap *heap) {
 }
 
 Bc_Func *bc_function_alloc(uint32_t size, Heap *heap) {
-    return heap_alloc(sizeof(Bc_Func) + sizeof(uint8_t) * size, heap);
+    Bc_Func *func = heap_alloc(sizeof(Bc_Func) + sizeof(uint8_t) * size, VK_FUNCTION, heap);
+    cell_header((Value)func)->flags |= CELL_BC_FUNCTION;
+    return func;
 }
 
 
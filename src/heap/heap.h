@@ -11,29 +11,164 @@
 //#include "../ast/ast_interpreter.h"
 //#include "../bc/bc_interpreter.h"
 
-extern const long long int MEM_SZ;
+//max size of a heap unless its interpreter asks for another one
+#define HEAP_DEFAULT_LIMIT (1024L * 1024 * 1024)
+
+//the heap reserves its limit of address space up front and commits it in chunks of this size
+#define HEAP_COMMIT_CHUNK (1024 * 1024 * 2)
+#define HUGE_PAGE_SZ (1024 * 1024 * 2)
+
+//back the heap with transparent huge pages (--huge-pages), must be set before heap_init
+extern bool heap_huge_pages;
+typedef enum {
+    //dead cells are threaded to the free lists
+    GC_SWEEP,
+    //live cells slide together, the free space stays one bump region
+    GC_COMPACT,
+    //marked by a background thread while the interpreter runs, see gc_concurrent.h
+    GC_CONCURRENT,
+} HeapGcMode;
+
+//how a full heap is collected (--gc), must be set before heap_init
+extern HeapGcMode heap_gc_mode;
+
+//called for every slot holding a Value, the slot can be updated
+typedef void (*HeapVisit)(void *ctx, Value *slot);
+
+//enumerates the roots of an interpreter by calling visit on each of them
+typedef void (*HeapRoots)(void *ctx, HeapVisit visit, void *visit_ctx);
+
+//every cell on the heap is preceded by this header, so the heap can be walked
+//cell by cell without knowing the layouts of the values
+typedef struct {
+    //capacity of the cell in bytes without the header, a multiple of 8
+    //can be more than the value needs when a larger free cell was reused
+    uint32_t size;
+    //CELL_* flags
+    uint8_t flags;
+    uint8_t reserved[3];
+} CellHeader;
+
+//the VK_FUNCTION cell is a Bc_Func, otherwise it is an AST Function
+#define CELL_BC_FUNCTION 0x01
+//reachable from the roots, only set during heap_mark
+#define CELL_MARKED 0x02
+//on a free list, the first word of the cell links to the next free cell
+#define CELL_FREE 0x04
+
+//cells up to this capacity are reused through exact size classes, one per 8 bytes
+//that covers Integer, Boolean, Null, Function and arrays and objects of up to 15 elements
+#define HEAP_SMALL_MAX 256
+#define HEAP_SIZE_CLASSES (HEAP_SMALL_MAX / 8)
+//the heap is full when less than 1/HEAP_MIN_FREE_FRACTION of it is free after a collection
+#define HEAP_MIN_FREE_FRACTION 64
 
 
 typedef struct {
     uint8_t *heap_start;
     uint8_t *heap_free;
     size_t heap_size;
+    //bytes from heap_start which are readable and writable, the rest is PROT_NONE
+    size_t heap_committed;
+    //max heap_size
+    size_t heap_limit;
+    //the whole mapping, larger than heap_limit when aligned for huge pages
+    uint8_t *reserved_start;
+    size_t reserved_size;
+    //segregated free lists filled by heap_sweep, indexed by capacity / 8 - 1
+    //a heap belongs to one interpreter, so these act as its thread-local allocation cache
+    Value free_lists[HEAP_SIZE_CLASSES];
+    //larger free cells, reused first fit
+    Value large_free;
+    //bytes of the cells on the free lists, headers included
+    size_t free_bytes;
+    //the heap is collected when full if the interpreter registered its roots
+    HeapRoots roots;
+    void *roots_ctx;
+    size_t collections;
+    size_t freed_bytes;
+    //GC_CONCURRENT: a cycle starts when heap_size - free_bytes reaches the trigger
+    size_t gc_trigger;
+    //the running cycle, NULL between cycles
+    struct GcCycle *cycle;
+    //heap_write_barrier records the overwritten values while the cycle is marking
+    bool satb_active;
+    //stop-the-world time spent in heap_collect and in the pauses of concurrent cycles
+    uint64_t gc_pause_ns;
+    uint64_t gc_max_pause_ns;
+    //high-water mark of heap_size
+    size_t heap_peak;
+    //allocation statistics for --stats, indexed by ValueKind
+    size_t alloc_cnt[VALUE_KIND_CNT];
+    size_t alloc_bytes[VALUE_KIND_CNT];
 } Heap;
 
+//`limit` is the max size in bytes, HEAP_DEFAULT_LIMIT when 0
+void heap_init(Heap *heap, size_t limit);
+
+void heap_destroy(Heap *heap);
+
 void print_heap(Heap *heap);
 
-void *heap_alloc(size_t sz, Heap *heap);
+void *heap_alloc(size_t sz, ValueKind kind, Heap *heap);
+
+static inline CellHeader *cell_header(Value val) {
+    return (CellHeader *)(val - sizeof(CellHeader));
+}
+
+//false for values outside of the heap, e.g. functions and strings in the bytecode const pool
+static inline bool heap_contains(Heap *heap, Value val) {
+    return val >= heap->heap_start && val < heap->heap_free;
+}
+
+//iteration over all the allocated cells, free ones are skipped: for (Value v = heap_first(h); v != NULL; v = heap_next(h, v))
+Value heap_first(Heap *heap);
+
+Value heap_next(Heap *heap, Value val);
+
+//calls visit on every Value slot of the cell, uninitialized (NULL) slots are skipped
+void heap_visit_children(Value val, HeapVisit visit, void *visit_ctx);
+
+//sets CELL_MARKED on the cells reachable from the roots, returns their count
+size_t heap_mark(Heap *heap, HeapRoots roots, void *roots_ctx);
+
+void heap_clear_marks(Heap *heap);
+
+//without roots the heap is never collected, a full heap ends the program
+//every live value has to be reachable from the roots whenever heap_alloc can be called
+void heap_set_roots(Heap *heap, HeapRoots roots, void *roots_ctx);
+
+//threads the cells without CELL_MARKED to the free lists and clears the marks, returns the freed bytes
+size_t heap_sweep(Heap *heap);
+
+//heap_sweep of the cells below `end` into the given lists instead of the heap's
+size_t heap_sweep_range(Heap *heap, uint8_t *end, Value *free_lists, Value *large_free, size_t *free_bytes);
+
+//slides the cells with CELL_MARKED towards heap_start in address order and updates every slot
+//referring to them, the cells found from the roots and the children of the moved cells
+//afterwards the free space is one bump region and the free lists are empty, returns the freed bytes
+size_t heap_compact(Heap *heap, size_t marked, HeapRoots roots, void *roots_ctx);
+
+//marks from the registered roots and sweeps or compacts
+void heap_collect(Heap *heap);
+
+//CSV log of the heap size over time (--heap-log): S start, B before and A after a collection, E end
+void heap_log_open(const char *filename);
+
+void heap_log_event(Heap *heap, char event);
 
 
 Array *array_alloc(int size, Heap *heap);
 
 
+//the elements are NULL until the caller initializes them
 Value construct_array(int size, Heap *heap);
 
 
 Object *object_alloc(int size, Heap *heap);
 
 
+//the fields are zeroed until the caller initializes them
 Value construct_object(int size, Value parent, Heap *heap);
 
 Function *ast_function_alloc(Heap *heap);
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "heap_snapshot.h"
+#include "gc_concurrent.h"
+#include "../stats.h"
+
+volatile sig_atomic_t heap_snapshot_requested = 0;
+
+static const char *snapshot_file;
+static Heap *snapshot_heap;
+static HeapRoots snapshot_roots;
+static void *snapshot_roots_ctx;
+static int signalled_cnt = 0;
+
+static void snapshot_handler(int sig) {
+    (void)sig;
+    heap_snapshot_requested = 1;
+}
+
+void heap_snapshot_setup(const char *filename, Heap *heap, HeapRoots roots, void *roots_ctx) {
+    snapshot_file = filename;
+    snapshot_heap = heap;
+    snapshot_roots = roots;
+    snapshot_roots_ctx = roots_ctx;
+
+    struct sigaction sa = { 0 };
+    sa.sa_handler = snapshot_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+//cells are identified by their offset in the heap, stable within one snapshot
+static size_t cell_id(Value val) {
+    return val - snapshot_heap->heap_start;
+}
+
+static const char *cell_kind_name(Value val) {
+    if (*val == VK_FUNCTION && (cell_header(val)->flags & CELL_BC_FUNCTION))
+        return "bc_function";
+    return value_kind_name(*val);
+}
+
+static void write_str(FILE *f, Str str) {
+    fputc('"', f);
+    for (size_t i = 0; i < str.len; i++) {
+        if (str.str[i] == '"' || str.str[i] == '\\')
+            fputc('\\', f);
+        if (str.str[i] < 0x20)
+            fprintf(f, "\\u%04x", str.str[i]);
+        else
+            fputc(str.str[i], f);
+    }
+    fputc('"', f);
+}
+
+typedef struct {
+    FILE *f;
+    size_t cnt;
+} EdgeWriter;
+
+static void write_edge(void *ctx, Value *slot) {
+    EdgeWriter *ew = ctx;
+    //values in the const pool are not part of the graph
+    if (!heap_contains(snapshot_heap, *slot))
+        return;
+    fprintf(ew->f, "%s%zu", ew->cnt++ ? "," : "", cell_id(*slot));
+}
+
+static void write_root(void *ctx, Value *slot) {
+    write_edge(ctx, slot);
+}
+
+void heap_snapshot_write(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open the heap snapshot file %s\n", filename);
+        return;
+    }
+    Heap *heap = snapshot_heap;
+    //the walk and the marks would race with a running cycle
+    gc_cycle_finish(heap);
+    size_t reachable = heap_mark(heap, snapshot_roots, snapshot_roots_ctx);
+
+    size_t cnt[VALUE_KIND_CNT] = { 0 };
+    size_t bytes[VALUE_KIND_CNT] = { 0 };
+    size_t live_cnt[VALUE_KIND_CNT] = { 0 };
+    size_t live_bytes[VALUE_KIND_CNT] = { 0 };
+    size_t cells = 0;
+    for (Value val = heap_first(heap); val != NULL; val = heap_next(heap, val)) {
+        size_t size = sizeof(CellHeader) + cell_header(val)->size;
+        cnt[*val]++;
+        bytes[*val] += size;
+        if (cell_header(val)->flags & CELL_MARKED) {
+            live_cnt[*val]++;
+            live_bytes[*val] += size;
+        }
+        cells++;
+    }
+
+    fprintf(f, "{\n\"heap_size\": %zu,\n\"cells\": %zu,\n\"reachable\": %zu,\n", heap->heap_size, cells, reachable);
+    fprintf(f, "\"histogram\": [");
+    bool first = true;
+    for (int i = 0; i < VALUE_KIND_CNT; i++) {
+        if (cnt[i] == 0)
+            continue;
+        fprintf(f, "%s\n  {\"kind\": \"%s\", \"count\": %zu, \"bytes\": %zu, \"reachable_count\": %zu, "
+                   "\"reachable_bytes\": %zu}",
+                first ? "" : ",", value_kind_name(i), cnt[i], bytes[i], live_cnt[i], live_bytes[i]);
+        first = false;
+    }
+    fprintf(f, "\n],\n\"roots\": [");
+    EdgeWriter ew = { .f = f };
+    snapshot_roots(snapshot_roots_ctx, write_root, &ew);
+    fprintf(f, "],\n\"nodes\": [");
+    first = true;
+    for (Value val = heap_first(heap); val != NULL; val = heap_next(heap, val)) {
+        fprintf(f, "%s\n  {\"id\": %zu, \"kind\": \"%s\", \"size\": %zu, \"reachable\": %s, \"edges\": [",
+                first ? "" : ",", cell_id(val), cell_kind_name(val), sizeof(CellHeader) + cell_header(val)->size,
+                cell_header(val)->flags & CELL_MARKED ? "true" : "false");
+        first = false;
+        ew.cnt = 0;
+        heap_visit_children(val, write_edge, &ew);
+        fprintf(f, "]");
+        if (*val == VK_OBJECT) {
+            Object *obj = (Object *)val;
+            fprintf(f, ", \"fields\": [");
+            for (size_t i = 0; i < obj->field_cnt; i++) {
+                if (i > 0)
+                    fputc(',', f);
+                write_str(f, obj->val[i].name);
+            }
+            fprintf(f, "]");
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]\n}\n");
+    heap_clear_marks(heap);
+    fclose(f);
+}
+
+void heap_snapshot_signalled(void) {
+    heap_snapshot_requested = 0;
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s.%d", snapshot_file, ++signalled_cnt);
+    heap_snapshot_write(filename);
+    fprintf(stderr, "heap snapshot written to %s\n", filename);
+}
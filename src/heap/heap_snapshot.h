@@ -0,0 +1,31 @@
+#pragma once
+
+#include <signal.h>
+
+#include "heap.h"
+
+// Heap snapshots (--heap-snapshot <file>). A snapshot is a JSON document with
+// a histogram of the cells per ValueKind, both of all cells and of those
+// reachable from the roots, and the object graph: every cell with its kind,
+// size and the cells it refers to. Object nodes also carry the field names,
+// which tools/heap_diff.py uses to group objects by shape when comparing
+// two snapshots.
+//
+// The snapshot is written at exit. SIGUSR2 requests another one while the
+// program runs, it is written to <file>.<n> at the next function call, where
+// the interpreter is in a consistent state.
+
+extern volatile sig_atomic_t heap_snapshot_requested;
+
+//remembers where and what to snapshot and installs the SIGUSR2 handler
+void heap_snapshot_setup(const char *filename, Heap *heap, HeapRoots roots, void *roots_ctx);
+
+void heap_snapshot_write(const char *filename);
+
+//writes the snapshot requested by the signal
+void heap_snapshot_signalled(void);
+
+static inline void heap_snapshot_poll(void) {
+    if (heap_snapshot_requested)
+        heap_snapshot_signalled();
+}
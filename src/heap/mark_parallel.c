@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "mark_parallel.h"
+
+int heap_gc_threads = 1;
+
+#define DEQUE_INITIAL_CAP 1024
+
+typedef struct DequeBuf {
+    int64_t cap;
+    //replaced buffers are freed only after the marking, a thief may still be reading them
+    struct DequeBuf *prev;
+    _Atomic(Value) slots[];
+} DequeBuf;
+
+//Chase-Lev deque, the owner works at the bottom, thieves take from the top
+typedef struct {
+    _Atomic int64_t top;
+    //keep the owner's and the thieves' ends on separate cache lines
+    char pad[64 - sizeof(int64_t)];
+    _Atomic int64_t bottom;
+    _Atomic(DequeBuf *) buf;
+} Deque;
+
+typedef struct MarkShared MarkShared;
+
+typedef struct {
+    MarkShared *shared;
+    int id;
+    unsigned seed;
+    size_t marked;
+    pthread_t thread;
+    Deque deque;
+} Worker;
+
+struct MarkShared {
+    Heap *heap;
+    _Atomic uint64_t *bitmap;
+    Value **root_slots;
+    size_t root_cnt;
+    size_t root_cap;
+    int threads;
+    Worker *workers;
+    atomic_int idle;
+};
+
+static void deque_init(Deque *q) {
+    DequeBuf *buf = malloc(sizeof(DequeBuf) + sizeof(_Atomic(Value)) * DEQUE_INITIAL_CAP);
+    buf->cap = DEQUE_INITIAL_CAP;
+    buf->prev = NULL;
+    atomic_init(&q->top, 0);
+    atomic_init(&q->bottom, 0);
+    atomic_init(&q->buf, buf);
+}
+
+static void deque_free(Deque *q) {
+    DequeBuf *buf = atomic_load_explicit(&q->buf, memory_order_relaxed);
+    while (buf != NULL) {
+        DequeBuf *prev = buf->prev;
+        free(buf);
+        buf = prev;
+    }
+}
+
+static DequeBuf *deque_grow(Deque *q, DequeBuf *old, int64_t top, int64_t bottom) {
+    DequeBuf *buf = malloc(sizeof(DequeBuf) + sizeof(_Atomic(Value)) * old->cap * 2);
+    buf->cap = old->cap * 2;
+    buf->prev = old;
+    for (int64_t i = top; i < bottom; i++) {
+        Value val = atomic_load_explicit(&old->slots[i % old->cap], memory_order_relaxed);
+        atomic_store_explicit(&buf->slots[i % buf->cap], val, memory_order_relaxed);
+    }
+    atomic_store_explicit(&q->buf, buf, memory_order_release);
+    return buf;
+}
+
+static void deque_push(Deque *q, Value val) {
+    int64_t bottom = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&q->top, memory_order_acquire);
+    DequeBuf *buf = atomic_load_explicit(&q->buf, memory_order_relaxed);
+    if (bottom - top > buf->cap - 1)
+        buf = deque_grow(q, buf, top, bottom);
+    atomic_store_explicit(&buf->slots[bottom % buf->cap], val, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->bottom, bottom + 1, memory_order_relaxed);
+}
+
+//owner only, NULL when empty
+static Value deque_take(Deque *q) {
+    int64_t bottom = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    DequeBuf *buf = atomic_load_explicit(&q->buf, memory_order_relaxed);
+    atomic_store_explicit(&q->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&q->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&q->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    Value val = atomic_load_explicit(&buf->slots[bottom % buf->cap], memory_order_relaxed);
+    if (top == bottom) {
+        //the last one, race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&q->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+            val = NULL;
+        atomic_store_explicit(&q->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return val;
+}
+
+//NULL when empty or when another thief won the race
+static Value deque_steal(Deque *q) {
+    int64_t top = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&q->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return NULL;
+    DequeBuf *buf = atomic_load_explicit(&q->buf, memory_order_acquire);
+    Value val = atomic_load_explicit(&buf->slots[top % buf->cap], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return val;
+}
+
+static bool deque_empty(Deque *q) {
+    return atomic_load_explicit(&q->top, memory_order_acquire) >= atomic_load_explicit(&q->bottom, memory_order_acquire);
+}
+
+static void mark_slot(void *ctx, Value *slot) {
+    Worker *w = ctx;
+    Heap *heap = w->shared->heap;
+    Value val = *slot;
+    if (!heap_contains(heap, val))
+        return;
+    //cells are 8 byte aligned, so every cell has a bit of its own
+    size_t bit = (size_t)(val - heap->heap_start) / 8;
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    if (atomic_fetch_or_explicit(&w->shared->bitmap[bit / 64], mask, memory_order_relaxed) & mask)
+        return;
+    cell_header(val)->flags |= CELL_MARKED;
+    w->marked++;
+    deque_push(&w->deque, val);
+}
+
+static void collect_root(void *ctx, Value *slot) {
+    MarkShared *shared = ctx;
+    if (shared->root_cnt == shared->root_cap) {
+        shared->root_cap *= 2;
+        shared->root_slots = realloc(shared->root_slots, sizeof(Value *) * shared->root_cap);
+    }
+    shared->root_slots[shared->root_cnt++] = slot;
+}
+
+static Value steal_any(Worker *w) {
+    MarkShared *shared = w->shared;
+    int start = rand_r(&w->seed) % shared->threads;
+    for (int i = 0; i < shared->threads; i++) {
+        int victim = (start + i) % shared->threads;
+        if (victim == w->id)
+            continue;
+        Value val = deque_steal(&shared->workers[victim].deque);
+        if (val != NULL)
+            return val;
+    }
+    return NULL;
+}
+
+static bool any_work(MarkShared *shared) {
+    for (int i = 0; i < shared->threads; i++) {
+        if (!deque_empty(&shared->workers[i].deque))
+            return true;
+    }
+    return false;
+}
+
+static void *mark_worker(void *arg) {
+    Worker *w = arg;
+    MarkShared *shared = w->shared;
+    size_t from = shared->root_cnt * w->id / shared->threads;
+    size_t to = shared->root_cnt * (w->id + 1) / shared->threads;
+    for (size_t i = from; i < to; i++) {
+        mark_slot(w, shared->root_slots[i]);
+    }
+    for (;;) {
+        Value val;
+        while ((val = deque_take(&w->deque)) != NULL) {
+            heap_visit_children(val, mark_slot, w);
+        }
+        if ((val = steal_any(w)) != NULL) {
+            heap_visit_children(val, mark_slot, w);
+            continue;
+        }
+        //only a worker holding a cell can push, so once all are idle nothing is left
+        atomic_fetch_add(&shared->idle, 1);
+        while (!any_work(shared)) {
+            if (atomic_load(&shared->idle) == shared->threads)
+                return NULL;
+            sched_yield();
+        }
+        atomic_fetch_sub(&shared->idle, 1);
+    }
+}
+
+size_t heap_mark_parallel(Heap *heap, HeapRoots roots, void *roots_ctx, int threads) {
+    MarkShared shared = { .heap = heap, .threads = threads, .root_cap = 1024 };
+    shared.bitmap = calloc((heap->heap_size / 8 + 63) / 64 + 1, sizeof(uint64_t));
+    shared.root_slots = malloc(sizeof(Value *) * shared.root_cap);
+    shared.workers = calloc(threads, sizeof(Worker));
+    atomic_init(&shared.idle, 0);
+    roots(roots_ctx, collect_root, &shared);
+
+    for (int i = 0; i < threads; i++) {
+        shared.workers[i].shared = &shared;
+        shared.workers[i].id = i;
+        shared.workers[i].seed = i + 1;
+        deque_init(&shared.workers[i].deque);
+    }
+    //the calling thread is worker 0
+    for (int i = 1; i < threads; i++) {
+        pthread_create(&shared.workers[i].thread, NULL, mark_worker, &shared.workers[i]);
+    }
+    mark_worker(&shared.workers[0]);
+    size_t marked = shared.workers[0].marked;
+    for (int i = 1; i < threads; i++) {
+        pthread_join(shared.workers[i].thread, NULL);
+        marked += shared.workers[i].marked;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        deque_free(&shared.workers[i].deque);
+    }
+    free(shared.workers);
+    free(shared.root_slots);
+    free(shared.bitmap);
+    return marked;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "heap.h"
+
+// Parallel marking (--gc-threads). The root slots are collected first and
+// split evenly among the workers, then every worker traces the graph from
+// its share. Each worker owns a Chase-Lev work-stealing deque: it pushes and
+// takes the grey cells at the bottom, idle workers steal from the top of the
+// others. A cell is claimed by atomically setting its bit in a side bitmap
+// (one bit per 8 bytes of the heap), only the winner sets CELL_MARKED and
+// scans it, so the result is the same as from heap_mark.
+
+#define MARK_MAX_THREADS 64
+
+//number of marking threads, 1 marks on the calling thread with heap_mark
+extern int heap_gc_threads;
+
+//same contract as heap_mark, returns the count of marked cells
+size_t heap_mark_parallel(Heap *heap, HeapRoots roots, void *roots_ctx, int threads);
@@ -3,62 +3,78 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
+#include <unistd.h>
 
-#include "parser.h"
-#include "ast/ast_interpreter.h"
-#include "bc/bc_interpreter.h"
-#include "arena.h"
+#include "fml.h"
+#include "serve.h"
+#include "batch.h"
+#include "output.h"
+#include "perf_counters.h"
+#include "trace_events.h"
+#include "heap/heap.h"
+#include "heap/mark_parallel.h"
 
-#define DEFAULT_HEAP_SIZE 4096
-#define DEFAULT_HEAP_LOG_FILE "heap_log.csv"
+//in MiB
+#define DEFAULT_HEAP_SIZE 1024
 
-enum { ACTION_AST_INTERPRET, ACTION_BC_INTERPRET, ACTION_RUN } action = ACTION_AST_INTERPRET;
+enum { ACTION_AST_INTERPRET, ACTION_BC_INTERPRET, ACTION_RUN, ACTION_SNAPSHOT, ACTION_SERVE, ACTION_BATCH } action = ACTION_AST_INTERPRET;
 char *source_file = NULL;
 long long int heap_size = DEFAULT_HEAP_SIZE;
-char *heap_log_file = DEFAULT_HEAP_LOG_FILE;
-
-
-/*
-   FROM REFENRENCE IMPL
-*/
-static Str read_file(Arena *arena, const char *name) {
-	FILE *f = fopen(name, "rb");
-	if (!f) {
-		printf("failed to open file\n");
-	}
-	if (fseek(f, 0, SEEK_END) != 0) {
-		printf("failed to seek in file\n");
-	}
-	long tell = ftell(f);
-	if (tell < 0) {
-		printf("failed to ftell file\n");
-	}
-	size_t fsize = (size_t) tell;
-	assert(fseek(f, 0, SEEK_SET) == 0);
-	u8 *buf = arena_alloc(arena, fsize);
-	size_t read;
-	if ((read = fread(buf, 1, fsize, f)) != fsize) {
-		if (feof(f)) {
-			fsize = read;
-		} else {
-			printf("failed to read the file\n");
-		}
-	}
-	assert(fclose(f) == 0);
-	return (Str) { .str = buf, .len = fsize };
-}
-
+char *heap_log_file = NULL;
+bool async_output = false;
+FmlOptions options = { 0 };
+char *trace_events_file = NULL;
+char *socket_path = NULL;
+char *from_snapshot = NULL;
+char *prefork_file = NULL;
+//0 for one per CPU
+int workers = 0;
+bool green = false;
+long long int slice = BATCH_DEFAULT_SLICE;
 
 
 void usage(const char *progname) {
     fprintf(stderr, "Usage: %s [options] <file>\n", progname);
+    fprintf(stderr, "       %s run --from-snapshot <image> [options]\n", progname);
+    fprintf(stderr, "       %s snapshot [options] <file> <image>\n", progname);
+    fprintf(stderr, "       %s serve --socket <path> [options]\n", progname);
+    fprintf(stderr, "       %s serve --socket <path> (--prefork <file> | --from-snapshot <image>) [options]\n", progname);
+    fprintf(stderr, "       %s batch [options] <manifest>\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  ast_interpret          Interpret the source file as an abstract syntax tree\n");
     fprintf(stderr, "  bc_interpret           Interpret the source file as bytecode\n");
-    fprintf(stderr, "  run                    Run the source file as a program\n");
-    fprintf(stderr, "  --heap-size <size>     Set the heap size in bytes (default: %d)\n", DEFAULT_HEAP_SIZE);
-    fprintf(stderr, "  --heap-log <filename>  Set the heap log file (default: %s)\n", DEFAULT_HEAP_LOG_FILE);
+    fprintf(stderr, "  run                    Run the source file as a program, bytecode if it ends in .bc\n");
+    fprintf(stderr, "  snapshot               Run the bytecode up to its call of snapshot() and write the VM to the image, see src/bc/bc_snapshot.h\n");
+    fprintf(stderr, "  serve                  Run the scripts sent to a Unix domain socket, see src/serve.h\n");
+    fprintf(stderr, "  batch                  Run the scripts listed in the manifest on all cores, see src/batch.h\n");
+    fprintf(stderr, "  --heap-size <size>     Set the heap size in MiB (default: %d), bc_interpret collects garbage when it is full\n", DEFAULT_HEAP_SIZE);
+    fprintf(stderr, "  --heap-log <filename>  Log the heap size at start, end and around every collection as CSV\n");
+    fprintf(stderr, "  --huge-pages           Back the heap with transparent huge pages\n");
+    fprintf(stderr, "  --gc <mode>            sweep: reuse the freed cells through free lists (default)\n");
+    fprintf(stderr, "                         compact: slide the live cells together\n");
+    fprintf(stderr, "                         concurrent: mark and sweep in the background while the program runs\n");
+    fprintf(stderr, "  --gc-threads <n>       Mark the heap with n threads (default: 1, max: %d)\n", MARK_MAX_THREADS);
+    fprintf(stderr, "  --async-output         Write the program output from a separate thread\n");
+    fprintf(stderr, "  --trace                Print every executed bytecode instruction and the operand stack\n");
+    fprintf(stderr, "  --profile-ops          Report executions and cycles per instruction, opcode pair and function to stderr\n");
+    fprintf(stderr, "  --profile-ops-csv <filename>  Same as --profile-ops, also write the full report as CSV\n");
+    fprintf(stderr, "  --sample-profile <filename>   Sample the FML call stack and write folded stacks for flamegraphs\n");
+    fprintf(stderr, "  --stats                Print instruction, call, lookup, allocation and stack depth statistics to stderr\n");
+    fprintf(stderr, "  --perf-counters        Report hardware performance counters for the parse, load and execute phases\n");
+    fprintf(stderr, "  --trace-events <filename>     Write Chrome trace events of calls and run phases for chrome://tracing or Perfetto\n");
+    fprintf(stderr, "  --alloc-sites          Report heap allocations per allocation site to stderr\n");
+    fprintf(stderr, "  --heap-snapshot <filename>    Write a JSON heap snapshot at exit, and to <filename>.<n> on SIGUSR2\n");
+    fprintf(stderr, "                         The options from --async-output to here are not available for serve and batch\n");
+    fprintf(stderr, "  --max-instructions <n>       Stop the program after n loop iterations and calls, with exit status %d\n", FML_LIMIT);
+    fprintf(stderr, "  --timeout-ms <ms>      Stop the program after ms milliseconds, with exit status %d\n", FML_LIMIT);
+    fprintf(stderr, "  --from-snapshot <image>       run: Resume the image written by snapshot instead of running a file\n");
+    fprintf(stderr, "                                serve: Run the image in forked workers like --prefork\n");
+    fprintf(stderr, "  --prefork <file>       serve: Load the program once and run it for every connection in a forked worker\n");
+    fprintf(stderr, "  --socket <path>        serve: Listen on the Unix domain socket at path\n");
+    fprintf(stderr, "  --workers <n>          serve, batch: Run up to n scripts at once (default: one per CPU)\n");
+    fprintf(stderr, "  --green                batch: Interleave all the scripts on one thread, sharing one heap\n");
+    fprintf(stderr, "                         only bytecode is interleaved, source runs to completion in its first turn\n");
+    fprintf(stderr, "  --slice <n>            batch --green: Switch scripts after n backward jumps and calls (default: %d)\n", BATCH_DEFAULT_SLICE);
     exit(EXIT_FAILURE);
 }
 
@@ -78,6 +94,15 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(argv[optind], "run") == 0) {
         action = ACTION_RUN;
         optind++;
+    } else if (strcmp(argv[optind], "snapshot") == 0) {
+        action = ACTION_SNAPSHOT;
+        optind++;
+    } else if (strcmp(argv[optind], "serve") == 0) {
+        action = ACTION_SERVE;
+        optind++;
+    } else if (strcmp(argv[optind], "batch") == 0) {
+        action = ACTION_BATCH;
+        optind++;
     } else {
         usage(argv[0]);
     }
@@ -86,7 +111,10 @@ int main(int argc, char *argv[]) {
             if (optind + 1 >= argc) {
                 usage(argv[0]);
             }
-            heap_size = atoi(argv[optind + 1]);
+            heap_size = atoll(argv[optind + 1]);
+            if (heap_size <= 0) {
+                usage(argv[0]);
+            }
             optind++;
         } else if (strcmp(argv[optind], "--heap-log") == 0) {
             if (optind + 1 >= argc) {
@@ -94,53 +122,221 @@ int main(int argc, char *argv[]) {
             }
             heap_log_file = argv[optind + 1];
             optind++;
+        } else if (strcmp(argv[optind], "--huge-pages") == 0) {
+            heap_huge_pages = true;
+        } else if (strcmp(argv[optind], "--gc") == 0) {
+            if (optind + 1 >= argc) {
+                usage(argv[0]);
+            }
+            if (strcmp(argv[optind + 1], "compact") == 0) {
+                heap_gc_mode = GC_COMPACT;
+            } else if (strcmp(argv[optind + 1], "concurrent") == 0) {
+                heap_gc_mode = GC_CONCURRENT;
+            } else if (strcmp(argv[optind + 1], "sweep") != 0) {
+                usage(argv[0]);
+            }
+            optind++;
+        } else if (strcmp(argv[optind], "--gc-threads") == 0) {
+            if (optind + 1 >= argc) {
+                usage(argv[0]);
+            }
+            heap_gc_threads = atoi(argv[optind + 1]);
+            if (heap_gc_threads < 1 || heap_gc_threads > MARK_MAX_THREADS) {
+                usage(argv[0]);
+            }
+            optind++;
+        } else if (strcmp(argv[optind], "--async-output") == 0) {
+            async_output = true;
+        } else if (strcmp(argv[optind], "--trace") == 0) {
+#if !FML_TRACE
+            fprintf(stderr, "--trace is not available, fml was built without tracing support\n");
+            exit(EXIT_FAILURE);
+#endif
+            options.trace = true;
+        } else if (strcmp(argv[optind], "--profile-ops") == 0) {
+            options.profile_ops = true;
+        } else if (strcmp(argv[optind], "--profile-ops-csv") == 0) {
+            if (optind + 1 >= argc) {
+                usage(argv[0]);
+            }
+            options.profile_ops = true;
+            options.profile_ops_file = argv[optind + 1];
+            optind++;
+        } else if (strcmp(argv[optind], "--sample-profile") == 0) {
+            if (optind + 1 >= argc) {
+                usage(argv[0]);
+            }
+            options.sample_file = argv[optind + 1];
+            optind++;
+        } else if (strcmp(argv[optind], "--stats") == 0) {
+            options.stats = true;
+        } else if (strcmp(argv[optind], "--perf-counters") == 0) {
+            options.perf_counters = true;
+        } else if (strcmp(argv[optind], "--trace-events") == 0) {
+            if (optind + 1 >= argc) {
+                usage(argv[0]);
+            }
+            trace_events_file = argv[optind + 1];
+            optind++;
+        } else if (strcmp(argv[optind], "--alloc-sites") == 0) {
+            options.alloc_sites = true;
+        } else if (strcmp(argv[optind], "--heap-snapshot") == 0) {
+            if (optind + 1 >= argc) {
+                usage(argv[0]);
+            }
+            options.heap_snapshot_file = argv[optind + 1];
+            optind++;
+        } else if (strcmp(argv[optind], "--max-instructions") == 0) {
+            if (optind + 1 >= argc) {
+                usage(argv[0]);
+            }
+            long long int max = atoll(argv[optind + 1]);
+            if (max <= 0) {
+                usage(argv[0]);
+            }
+            options.limits.max_instructions = max;
+            optind++;
+        } else if (strcmp(argv[optind], "--timeout-ms") == 0) {
+            if (optind + 1 >= argc) {
+                usage(argv[0]);
+            }
+            long long int timeout = atoll(argv[optind + 1]);
+            if (timeout <= 0 || timeout > UINT32_MAX) {
+                usage(argv[0]);
+            }
+            options.limits.timeout_ms = timeout;
+            optind++;
+        } else if (strcmp(argv[optind], "--from-snapshot") == 0) {
+            if (optind + 1 >= argc || (action != ACTION_RUN && action != ACTION_SERVE)) {
+                usage(argv[0]);
+            }
+            from_snapshot = argv[optind + 1];
+            optind++;
+        } else if (strcmp(argv[optind], "--prefork") == 0) {
+            if (optind + 1 >= argc || action != ACTION_SERVE) {
+                usage(argv[0]);
+            }
+            prefork_file = argv[optind + 1];
+            optind++;
+        } else if (strcmp(argv[optind], "--socket") == 0) {
+            if (optind + 1 >= argc) {
+                usage(argv[0]);
+            }
+            socket_path = argv[optind + 1];
+            optind++;
+        } else if (strcmp(argv[optind], "--workers") == 0) {
+            if (optind + 1 >= argc) {
+                usage(argv[0]);
+            }
+            workers = atoi(argv[optind + 1]);
+            if (workers < 1) {
+                usage(argv[0]);
+            }
+            optind++;
+        } else if (strcmp(argv[optind], "--green") == 0 && action == ACTION_BATCH) {
+            green = true;
+        } else if (strcmp(argv[optind], "--slice") == 0) {
+            if (optind + 1 >= argc || action != ACTION_BATCH) {
+                usage(argv[0]);
+            }
+            slice = atoll(argv[optind + 1]);
+            if (slice < 1 || slice > UINT32_MAX) {
+                usage(argv[0]);
+            }
+            optind++;
         } else {
             usage(argv[0]);
         }
     }
-    if (optind + 1 != argc) {
+    //the scripts of serve and batch run without the tools, which observe one VM at a time
+    bool tools = options.trace || options.profile_ops || options.sample_file != NULL || options.stats
+        || options.perf_counters || options.alloc_sites || options.heap_snapshot_file != NULL
+        || trace_events_file != NULL || async_output;
+    if ((action == ACTION_SERVE || action == ACTION_BATCH) && tools) {
         usage(argv[0]);
     }
-    source_file = argv[optind];
-
-    switch (action) {
-        case ACTION_AST_INTERPRET: {
-            Arena arena;
-	        arena_init(&arena);
-
-	        Str src = read_file(&arena, source_file);
-
-	        if (src.str == NULL) {
-		        arena_destroy(&arena);
-		        return 1;
-	        }
-
-	        Ast *ast = parse_src(&arena, src);
-
-	        if (ast == NULL) {
-		        fprintf(stderr, "Failed to parse source\n");
-		        arena_destroy(&arena);
-                return 1;
-	        }
+    if (action == ACTION_SERVE) {
+        if (optind != argc || socket_path == NULL || (prefork_file != NULL && from_snapshot != NULL)) {
+            usage(argv[0]);
+        }
+    } else if (from_snapshot != NULL) {
+        if (optind != argc) {
+            usage(argv[0]);
+        }
+    } else if (action == ACTION_SNAPSHOT) {
+        if (optind + 2 != argc) {
+            usage(argv[0]);
+        }
+        source_file = argv[optind];
+        options.image_file = argv[optind + 1];
+    } else if (optind + 1 != argc) {
+        usage(argv[0]);
+    } else {
+        source_file = argv[optind];
+    }
+    if (workers == 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
 
-            IState *state = init_interpreter();
-	        interpret(ast, state);
+    if (action == ACTION_SERVE || action == ACTION_BATCH) {
+        if (heap_log_file != NULL) {
+            heap_log_open(heap_log_file);
+        }
+        if (action == ACTION_SERVE && (prefork_file != NULL || from_snapshot != NULL)) {
+            //loaded once here, the workers get it by fork
+            FmlVm *vm = fml_vm_new((size_t)heap_size * 1024 * 1024, &(FmlOptions){ .limits = options.limits });
+            bool loaded = prefork_file != NULL ? fml_load_file(vm, prefork_file) : fml_load_image_file(vm, from_snapshot);
+            if (!loaded) {
+                printf("%s\n", fml_error(vm));
+                fml_vm_free(vm);
+                return FML_ERROR;
+            }
+            return serve_prefork(socket_path, vm, workers);
+        }
+        if (action == ACTION_SERVE)
+            return serve(socket_path, workers, (size_t)heap_size * 1024 * 1024, options.limits);
+        return batch(source_file, workers, (size_t)heap_size * 1024 * 1024, options.limits, green ? (uint32_t)slice : 0);
+    }
 
-	        free_interpreter(state);
+    out_init(async_output);
+    if (heap_log_file != NULL) {
+        heap_log_open(heap_log_file);
+    }
+    if (options.perf_counters) {
+        //a failure is reported with the counters, the run goes on with the wall time only
+        perf_open();
+    }
+    if (trace_events_file != NULL) {
+        trace_events_start(trace_events_file);
+    }
 
-	        arena_destroy(&arena);
+    FmlVm *vm = fml_vm_new((size_t)heap_size * 1024 * 1024, &options);
+    bool loaded;
+    switch (action) {
+        case ACTION_AST_INTERPRET:
+            loaded = fml_load_source_file(vm, source_file);
             break;
-        }
-        case ACTION_BC_INTERPRET: {
-            //printf("Running the bc_interpreter on source file %s\n", source_file);
-            deserialize(source_file);
-            bc_interpret();
+        case ACTION_BC_INTERPRET:
+        case ACTION_SNAPSHOT:
+            loaded = fml_load_bytecode_file(vm, source_file);
+            break;
+        case ACTION_RUN:
+            loaded = from_snapshot != NULL ? fml_load_image_file(vm, from_snapshot) : fml_load_file(vm, source_file);
             break;
-        }
         default:
             fprintf(stderr, "Invalid action %d\n", action);
             exit(EXIT_FAILURE);
     }
+    int status = loaded ? fml_run(vm) : FML_ERROR;
+    if (status != FML_OK) {
+        printf("%s\n", fml_error(vm));
+    }
+    fml_vm_free(vm);
+
+    if (options.perf_counters) {
+        perf_report(stderr);
+        perf_close();
+    }
 
-    return EXIT_SUCCESS;
+    return status;
 }
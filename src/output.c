@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "output.h"
+
+//every thread has a buffer of its own, so VMs on different threads can print at the same time
+static _Thread_local u8 out_buf[OUT_BUF_SZ];
+static _Thread_local size_t out_pos = 0;
+//where the buffer of this thread goes instead of stdout, see out_set_sink
+static _Thread_local OutSink out_sink = NULL;
+static _Thread_local void *out_sink_ctx = NULL;
+//flush on every newline, set when stdout is a terminal
+static bool out_line_mode = false;
+//flushes go to the ring and are written by the writer thread
+static bool out_async = false;
+
+//single-producer single-consumer ring, the interpreter thread produces and the writer thread consumes
+//head and tail only grow, the position in the ring is taken modulo OUT_RING_SZ
+static u8 *ring;
+static _Atomic size_t ring_head = 0;
+static _Atomic size_t ring_tail = 0;
+//set at exit, the writer drains the ring and terminates
+static atomic_bool ring_done = false;
+static pthread_t writer;
+//the mutex and conditions are only used to park a side that has nothing to do
+//the data itself is passed without locking
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ring_not_full = PTHREAD_COND_INITIALIZER;
+static atomic_bool writer_waiting = false;
+static atomic_bool producer_waiting = false;
+
+static void write_all(const u8 *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            //nowhere to report the error to, the output is lost either way
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+//called right after publishing ring_head or ring_tail with a release store
+static void wake(atomic_bool *waiting, pthread_cond_t *cond) {
+    //a release store followed by a load may be reordered, the other side could then
+    //announce that it waits, recheck the old index and sleep while we read waiting as false
+    //the fence pairs with the seq_cst store of the waiting flag and the recheck after it
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(waiting)) {
+        pthread_mutex_lock(&ring_mutex);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&ring_mutex);
+    }
+}
+
+static void *writer_loop(void *arg) {
+    (void)arg;
+    size_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    while (true) {
+        size_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+        if (head == tail) {
+            if (atomic_load(&ring_done))
+                return NULL;
+            pthread_mutex_lock(&ring_mutex);
+            atomic_store(&writer_waiting, true);
+            //recheck after announcing that we wait, otherwise we could miss the wake up
+            while (atomic_load(&ring_head) == tail && !atomic_load(&ring_done)) {
+                pthread_cond_wait(&ring_not_empty, &ring_mutex);
+            }
+            atomic_store(&writer_waiting, false);
+            pthread_mutex_unlock(&ring_mutex);
+            continue;
+        }
+        size_t pos = tail % OUT_RING_SZ;
+        size_t len = head - tail;
+        //don't write across the end of the ring, the rest is written in the next iteration
+        if (len > OUT_RING_SZ - pos)
+            len = OUT_RING_SZ - pos;
+        write_all(ring + pos, len);
+        tail += len;
+        atomic_store_explicit(&ring_tail, tail, memory_order_release);
+        wake(&producer_waiting, &ring_not_full);
+    }
+}
+
+static void ring_push(const u8 *data, size_t len) {
+    size_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    while (len > 0) {
+        size_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+        size_t free_sz = OUT_RING_SZ - (head - tail);
+        if (free_sz == 0) {
+            pthread_mutex_lock(&ring_mutex);
+            atomic_store(&producer_waiting, true);
+            while (atomic_load(&ring_tail) == tail) {
+                pthread_cond_wait(&ring_not_full, &ring_mutex);
+            }
+            atomic_store(&producer_waiting, false);
+            pthread_mutex_unlock(&ring_mutex);
+            continue;
+        }
+        size_t pos = head % OUT_RING_SZ;
+        size_t chunk = len < free_sz ? len : free_sz;
+        if (chunk > OUT_RING_SZ - pos)
+            chunk = OUT_RING_SZ - pos;
+        memcpy(ring + pos, data, chunk);
+        data += chunk;
+        len -= chunk;
+        head += chunk;
+        atomic_store_explicit(&ring_head, head, memory_order_release);
+        wake(&writer_waiting, &ring_not_empty);
+    }
+}
+
+//registered with atexit in async mode, runs before out_flush
+static void out_async_finish(void) {
+    out_flush();
+    atomic_store(&ring_done, true);
+    pthread_mutex_lock(&ring_mutex);
+    pthread_cond_signal(&ring_not_empty);
+    pthread_mutex_unlock(&ring_mutex);
+    pthread_join(writer, NULL);
+    free(ring);
+    out_async = false;
+}
+
+void out_init(bool async) {
+    out_line_mode = isatty(STDOUT_FILENO);
+    atexit(out_flush);
+    if (async) {
+        ring = malloc(OUT_RING_SZ);
+        if (ring == NULL || pthread_create(&writer, NULL, writer_loop, NULL) != 0) {
+            //fall back to writing from the interpreter thread
+            free(ring);
+            return;
+        }
+        out_async = true;
+        atexit(out_async_finish);
+    }
+}
+
+static void out_emit(const u8 *data, size_t len) {
+    if (out_sink != NULL)
+        out_sink(out_sink_ctx, data, len);
+    else if (out_async)
+        ring_push(data, len);
+    else
+        write_all(data, len);
+}
+
+void out_set_sink(OutSink sink, void *ctx) {
+    out_sink = sink;
+    out_sink_ctx = ctx;
+}
+
+void out_flush(void) {
+    if (out_pos > 0)
+        out_emit(out_buf, out_pos);
+    out_pos = 0;
+}
+
+void out_write(const u8 *str, size_t len) {
+    if (out_pos + len > OUT_BUF_SZ) {
+        out_flush();
+        //doesn't fit even into the empty buffer, don't bother copying it
+        if (len > OUT_BUF_SZ) {
+            out_emit(str, len);
+            return;
+        }
+    }
+    memcpy(out_buf + out_pos, str, len);
+    out_pos += len;
+    if (out_line_mode && out_sink == NULL && memchr(str, '\n', len) != NULL) {
+        out_flush();
+    }
+}
+
+void out_str(Str str) {
+    out_write(str.str, str.len);
+}
+
+void out_cstr(const char *str) {
+    out_write((const u8 *)str, strlen(str));
+}
+
+void out_int(i64 val) {
+    //enough for INT64_MIN
+    u8 digits[20];
+    size_t pos = sizeof(digits);
+    //negate in unsigned arithmetic so INT64_MIN doesn't overflow
+    u64 abs = val < 0 ? -(u64)val : (u64)val;
+    do {
+        digits[--pos] = '0' + abs % 10;
+        abs /= 10;
+    } while (abs > 0);
+    if (val < 0) {
+        digits[--pos] = '-';
+    }
+    out_write(digits + pos, sizeof(digits) - pos);
+}
+
+void format_split(Str fmt, size_t holes, Str *literals, u8 *buf) {
+    size_t hole = 0;
+    size_t len = 0;
+    literals[0].str = buf;
+    for (size_t i = 0; i < fmt.len; i++) {
+        u8 c = fmt.str[i];
+        if (c == '~' && hole < holes) {
+            literals[hole].len = len;
+            buf += len;
+            len = 0;
+            literals[++hole].str = buf;
+            continue;
+        }
+        //a trailing backslash is printed as is
+        if (c == '\\' && i + 1 < fmt.len) {
+            c = fmt.str[++i];
+            if (c == 'n')
+                c = '\n';
+            else if (c == 't')
+                c = '\t';
+            else if (c == 'r')
+                c = '\r';
+        }
+        buf[len++] = c;
+    }
+    literals[hole].len = len;
+    //fewer holes in the format than expected, the remaining runs are empty
+    while (hole < holes) {
+        literals[++hole] = (Str) { .str = buf + len, .len = 0 };
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "parser.h"
+
+// Buffered program output. Everything the interpreted program prints goes
+// through this buffer instead of stdio, so we don't pay for stdio locking and
+// format parsing on every character. The buffer is written out when it is
+// full, on `out_flush` and at exit. If stdout is a terminal it is also
+// flushed on every newline, so interactive output behaves like with stdio.
+//
+// The buffer is per thread, a thread that doesn't end the process has to
+// call `out_flush` itself when it is done printing.
+//
+// In the async mode the flushed buffer is not written directly but copied
+// into a lock-free single-producer ring which is drained by a dedicated writer
+// thread. The interpreter then doesn't block in `write` when stdout is a slow
+// pipe. The order of the output is preserved and the ring is drained at exit.
+// The ring has a single producer, only one thread may print in this mode.
+//
+// A thread can redirect its buffer to a sink, e.g. to send the output of a
+// program to a client instead of stdout. The sink gets the buffer on every
+// flush, regardless of the async mode and the line buffering.
+
+#define OUT_BUF_SZ (1024 * 64)
+#define OUT_RING_SZ (1024 * 1024 * 4)
+
+// Registers the flush at exit, must be called before anything is printed.
+// If `async` is set, starts the writer thread.
+void out_init(bool async);
+
+void out_flush(void);
+
+typedef void (*OutSink)(void *ctx, const u8 *data, size_t len);
+
+// Sends the output of the calling thread to `sink`, NULL goes back to
+// stdout. Flush before switching, the buffered output goes to the new sink.
+void out_set_sink(OutSink sink, void *ctx);
+
+void out_write(const u8 *str, size_t len);
+
+void out_str(Str str);
+
+void out_cstr(const char *str);
+
+// Formats the integer by hand, no printf involved.
+void out_int(i64 val);
+
+// Splits the print format `fmt` containing `holes` `~` placeholders into
+// `holes + 1` literal runs with the escape sequences already resolved. The
+// i-th run is printed before the i-th argument, the last one after all of
+// them. `literals` must have room for `holes + 1` entries and `buf` for
+// `fmt.len` bytes, the runs point into `buf`.
+void format_split(Str fmt, size_t holes, Str *literals, u8 *buf);
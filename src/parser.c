@@ -4,6 +4,7 @@
 #include <stdio.h>
 
 #include "parser.h"
+#include "output.h"
 
 #define UNREACHABLE() unreachable(__FILE__, __LINE__)
 _Noreturn void
@@ -596,6 +597,9 @@ print(Parser *parser)
 	if (formats != print->argument_cnt) {
 		parser_error(parser, fmt_tok, false, "Invalid number of print arguments: %zu expected, got %zu", formats, print->argument_cnt);
 	}
+	print->literals = arena_alloc(parser->arena, sizeof(*print->literals) * (formats + 1));
+	u8 *buf = arena_alloc(parser->arena, print->format.len);
+	format_split(print->format, formats, print->literals, buf);
 	return &print->base;
 }
 
@@ -184,6 +184,9 @@ typedef struct {
 typedef struct {
 	Ast base;
 	Str format;
+	// `format` pre-split into `argument_cnt + 1` literal runs around the `~`
+	// placeholders, with escape sequences resolved (see `format_split`).
+	Str *literals;
 	Ast **arguments;
 	size_t argument_cnt;
 } AstPrint;
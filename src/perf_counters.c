@@ -0,0 +1,148 @@
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf_counters.h"
+
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} CounterDesc;
+
+#define HW_CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const CounterDesc counter_descs[PC_CNT] = {
+    [PC_CYCLES] = { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PC_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PC_BRANCH_MISSES] = { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    [PC_L1D_MISSES] = { "L1-dcache-load-misses", PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    [PC_LLC_MISSES] = { "LLC-load-misses", PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+    [PC_DTLB_MISSES] = { "dTLB-load-misses", PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+};
+
+static int counter_fds[PC_CNT] = { -1, -1, -1, -1, -1, -1 };
+static int open_errno = 0;
+static PerfPhase phases[PERF_MAX_PHASES];
+static size_t phase_cnt = 0;
+static struct timespec phase_start;
+
+bool perf_open(void) {
+    bool any = false;
+    for (int i = 0; i < PC_CNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_descs[i].type;
+        attr.config = counter_descs[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counter_fds[i] < 0) {
+            open_errno = errno;
+            counter_fds[i] = -1;
+            continue;
+        }
+        any = true;
+    }
+    return any;
+}
+
+void perf_close(void) {
+    for (int i = 0; i < PC_CNT; i++) {
+        if (counter_fds[i] >= 0)
+            close(counter_fds[i]);
+        counter_fds[i] = -1;
+    }
+}
+
+void perf_phase_begin(const char *name) {
+    if (phase_cnt == PERF_MAX_PHASES)
+        return;
+    phases[phase_cnt].name = name;
+    for (int i = 0; i < PC_CNT; i++) {
+        if (counter_fds[i] < 0)
+            continue;
+        ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
+}
+
+void perf_phase_end(void) {
+    if (phase_cnt == PERF_MAX_PHASES)
+        return;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    PerfPhase *phase = &phases[phase_cnt++];
+    for (int i = 0; i < PC_CNT; i++) {
+        phase->valid[i] = false;
+        if (counter_fds[i] < 0)
+            continue;
+        ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        //value, time enabled, time running
+        uint64_t buf[3];
+        if (read(counter_fds[i], buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0)
+            continue;
+        //the counter was multiplexed with others, extrapolate to the whole phase
+        phase->values[i] = buf[2] < buf[1] ? (uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+        phase->valid[i] = true;
+    }
+    phase->wall_ms = (end.tv_sec - phase_start.tv_sec) * 1e3 + (end.tv_nsec - phase_start.tv_nsec) / 1e6;
+}
+
+void perf_report(FILE *f) {
+    fprintf(f, "\n== perf counters ==\n");
+    bool any = false;
+    for (int i = 0; i < PC_CNT; i++) {
+        if (counter_fds[i] >= 0)
+            any = true;
+    }
+    if (!any) {
+        fprintf(f, "hardware counters unavailable: %s (see /proc/sys/kernel/perf_event_paranoid)\n",
+                strerror(open_errno));
+    }
+    fprintf(f, "%-24s", "");
+    for (size_t p = 0; p < phase_cnt; p++)
+        fprintf(f, " %16s", phases[p].name);
+    fprintf(f, "\n%-24s", "wall ms");
+    for (size_t p = 0; p < phase_cnt; p++)
+        fprintf(f, " %16.3f", phases[p].wall_ms);
+    fprintf(f, "\n");
+    if (!any)
+        return;
+    for (int i = 0; i < PC_CNT; i++) {
+        fprintf(f, "%-24s", counter_descs[i].name);
+        for (size_t p = 0; p < phase_cnt; p++) {
+            if (phases[p].valid[i])
+                fprintf(f, " %16" PRIu64, phases[p].values[i]);
+            else
+                fprintf(f, " %16s", "n/a");
+        }
+        fprintf(f, "\n");
+    }
+    //derived metrics, only where both counters are there
+    fprintf(f, "%-24s", "IPC");
+    for (size_t p = 0; p < phase_cnt; p++) {
+        if (phases[p].valid[PC_CYCLES] && phases[p].valid[PC_INSTRUCTIONS] && phases[p].values[PC_CYCLES] > 0)
+            fprintf(f, " %16.2f", (double)phases[p].values[PC_INSTRUCTIONS] / phases[p].values[PC_CYCLES]);
+        else
+            fprintf(f, " %16s", "n/a");
+    }
+    fprintf(f, "\n%-24s", "branch-misses/kinstr");
+    for (size_t p = 0; p < phase_cnt; p++) {
+        if (phases[p].valid[PC_BRANCH_MISSES] && phases[p].valid[PC_INSTRUCTIONS] && phases[p].values[PC_INSTRUCTIONS] > 0)
+            fprintf(f, " %16.2f", 1e3 * phases[p].values[PC_BRANCH_MISSES] / phases[p].values[PC_INSTRUCTIONS]);
+        else
+            fprintf(f, " %16s", "n/a");
+    }
+    fprintf(f, "\n");
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Hardware performance counters for --perf-counters, read with
+// perf_event_open(2) around the phases of a run (parse, load, execute). Only
+// user space is counted, which is allowed with the default
+// perf_event_paranoid setting. Counters the kernel or the CPU refuse are
+// reported as unavailable, if none can be opened only the wall time is
+// reported. The counts are scaled when the kernel had to multiplex them.
+
+typedef enum {
+    PC_CYCLES,
+    PC_INSTRUCTIONS,
+    PC_BRANCH_MISSES,
+    PC_L1D_MISSES,
+    PC_LLC_MISSES,
+    PC_DTLB_MISSES,
+    PC_CNT,
+} PerfCounter;
+
+#define PERF_MAX_PHASES 8
+
+typedef struct {
+    const char *name;
+    double wall_ms;
+    uint64_t values[PC_CNT];
+    bool valid[PC_CNT];
+} PerfPhase;
+
+//opens the counters, returns false if none of them is available
+bool perf_open(void);
+
+void perf_close(void);
+
+//starts counting a new phase, phases can't nest
+void perf_phase_begin(const char *name);
+
+void perf_phase_end(void);
+
+void perf_report(FILE *f);
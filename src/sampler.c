@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "sampler.h"
+
+//samples are stored one after another, each starts with a header frame whose len is the depth
+static Str *sample_buf = NULL;
+static size_t sample_pos = 0;
+static size_t samples_dropped = 0;
+static SampleWalk sample_walk;
+static void *sample_ctx;
+
+static void sample_handler(int sig) {
+    (void)sig;
+    if (sample_pos + 1 + SAMPLE_MAX_DEPTH > SAMPLE_BUF_SZ) {
+        samples_dropped++;
+        return;
+    }
+    size_t depth = sample_walk(sample_ctx, sample_buf + sample_pos + 1, SAMPLE_MAX_DEPTH);
+    sample_buf[sample_pos] = (Str) { .str = NULL, .len = depth };
+    sample_pos += 1 + depth;
+}
+
+void sampler_start(SampleWalk walk, void *ctx) {
+    sample_buf = malloc(sizeof(Str) * SAMPLE_BUF_SZ);
+    sample_pos = 0;
+    samples_dropped = 0;
+    sample_walk = walk;
+    sample_ctx = ctx;
+
+    struct sigaction sa = { 0 };
+    sa.sa_handler = sample_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct itimerval timer = { 0 };
+    timer.it_interval.tv_usec = SAMPLE_INTERVAL_US;
+    timer.it_value.tv_usec = SAMPLE_INTERVAL_US;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void sampler_stop(void) {
+    struct itimerval timer = { 0 };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+}
+
+static int sample_cmp(const void *a, const void *b) {
+    const Str *sample1 = sample_buf + *(const size_t *)a;
+    const Str *sample2 = sample_buf + *(const size_t *)b;
+    size_t depth1 = sample1->len;
+    size_t depth2 = sample2->len;
+    for (size_t i = 1; i <= depth1 && i <= depth2; i++) {
+        int cmp = str_cmp(sample1[i], sample2[i]);
+        if (cmp != 0)
+            return cmp;
+    }
+    return depth1 < depth2 ? -1 : depth1 > depth2;
+}
+
+void sampler_write(const char *filename, SampleResolve resolve, void *ctx) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open the sample profile file %s\n", filename);
+        free(sample_buf);
+        return;
+    }
+    //resolve the names first, stacks of the same functions can have different keys
+    size_t sample_cnt = 0;
+    for (size_t pos = 0; pos < sample_pos; pos += 1 + sample_buf[pos].len) {
+        for (size_t i = 1; i <= sample_buf[pos].len; i++) {
+            if (resolve != NULL)
+                sample_buf[pos + i] = resolve(ctx, sample_buf[pos + i]);
+            if (sample_buf[pos + i].len == 0)
+                sample_buf[pos + i] = STR("<anonymous>");
+        }
+        sample_cnt++;
+    }
+    size_t *samples = malloc(sizeof(size_t) * sample_cnt);
+    for (size_t pos = 0, i = 0; pos < sample_pos; pos += 1 + sample_buf[pos].len) {
+        samples[i++] = pos;
+    }
+    //identical stacks end up next to each other
+    qsort(samples, sample_cnt, sizeof(size_t), sample_cmp);
+    for (size_t i = 0; i < sample_cnt;) {
+        size_t count = 1;
+        while (i + count < sample_cnt && sample_cmp(&samples[i], &samples[i + count]) == 0) {
+            count++;
+        }
+        Str *sample = sample_buf + samples[i];
+        i += count;
+        //stack sampled before the interpreter entered the program
+        if (sample->len == 0)
+            continue;
+        for (size_t j = 1; j <= sample->len; j++) {
+            if (j > 1)
+                fputc(';', f);
+            fprintf(f, "%.*s", (int)sample[j].len, sample[j].str);
+        }
+        fprintf(f, " %zu\n", count);
+    }
+    if (samples_dropped > 0) {
+        fprintf(stderr, "sample buffer full, %zu samples dropped\n", samples_dropped);
+    }
+    free(samples);
+    free(sample_buf);
+    sample_buf = NULL;
+    fclose(f);
+}
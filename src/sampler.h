@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "parser.h"
+
+// Sampling profiler for FML call stacks (--sample-profile). A SIGPROF timer
+// interrupts the interpreter and the signal handler asks the interpreter to
+// walk its call stack into a preallocated buffer. Nothing is allocated or
+// printed in the handler. At exit identical stacks are merged and written in
+// the folded format ("outer;inner;leaf count" per line) used by flamegraph.pl
+// and speedscope.
+//
+// A stack frame is recorded as a `Str`. The walker may store the name of the
+// function directly (it must stay valid until the profile is written) or an
+// arbitrary key which is translated to the name by the `resolve` callback
+// when writing the profile.
+
+#define SAMPLE_INTERVAL_US 1000
+// Only the innermost frames of deeper stacks are recorded.
+#define SAMPLE_MAX_DEPTH 256
+// Size of the sample buffer in frames, samples not fitting are dropped.
+#define SAMPLE_BUF_SZ (1024 * 1024 * 4)
+
+// Called from the signal handler. Stores at most `max` innermost frames of the
+// current stack to `frames`, outermost first, and returns their count.
+typedef size_t (*SampleWalk)(void *ctx, Str *frames, size_t max);
+
+typedef Str (*SampleResolve)(void *ctx, Str frame);
+
+void sampler_start(SampleWalk walk, void *ctx);
+
+void sampler_stop(void);
+
+// Writes the folded stacks to `filename`, `resolve` can be NULL.
+void sampler_write(const char *filename, SampleResolve resolve, void *ctx);
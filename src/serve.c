@@ -0,0 +1,494 @@
+//accept4
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "serve.h"
+#include "fml.h"
+
+//the longest request line, `path` with the file name
+#define REQUEST_LINE_MAX 4096
+#define MAX_EVENTS 64
+#define PREFORK_RETRY_MS 1000
+
+typedef enum {
+    REQUEST_PATH,
+    REQUEST_BYTECODE,
+    REQUEST_SOURCE,
+} RequestKind;
+
+typedef struct Conn {
+    int fd;
+    //the request line and the script as they arrive
+    char *buf;
+    size_t len;
+    size_t cap;
+    //length of the request line including the newline, 0 until it is complete
+    size_t header_len;
+    RequestKind kind;
+    //bytes of the script after the request line
+    size_t script_len;
+    //a write failed, the client is gone
+    bool broken;
+    struct Conn *next;
+} Conn;
+
+//complete requests waiting for a worker
+static Conn *queue_head;
+static Conn *queue_tail;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+static size_t serve_heap_limit;
+static FmlLimits serve_limits;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void conn_free(Conn *conn) {
+    close(conn->fd);
+    free(conn->buf);
+    free(conn);
+}
+
+static void send_all(Conn *conn, const void *data, size_t len) {
+    const uint8_t *ptr = data;
+    while (len > 0 && !conn->broken) {
+        ssize_t written = write(conn->fd, ptr, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            conn->broken = true;
+            return;
+        }
+        ptr += written;
+        len -= written;
+    }
+}
+
+static void send_frame(Conn *conn, const char *tag, const void *data, size_t len) {
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "%s %zu\n", tag, len);
+    send_all(conn, header, header_len);
+    send_all(conn, data, len);
+}
+
+//FmlWrite, called from out_flush on the worker
+static void send_output(void *ctx, const uint8_t *data, size_t len) {
+    send_frame(ctx, "output", data, len);
+}
+
+static void send_stats(Conn *conn, FmlVm *vm, int status, uint64_t time_ns) {
+    FmlStats s;
+    fml_stats(vm, &s);
+    char buf[1024];
+    int len = snprintf(buf, sizeof(buf),
+        "status %d\n"
+        "time_ns %llu\n"
+        "instructions %llu\n"
+        "calls %llu\n"
+        "field_lookups %llu\n"
+        "max_frames %zu\n"
+        "allocations %llu\n"
+        "allocated_bytes %llu\n"
+        "heap_peak %zu\n"
+        "collections %llu\n"
+        "freed_bytes %llu\n"
+        "gc_pause_ns %llu\n",
+        status, (unsigned long long)time_ns,
+        (unsigned long long)s.instructions, (unsigned long long)s.calls,
+        (unsigned long long)s.field_lookups, s.max_frames,
+        (unsigned long long)s.allocations, (unsigned long long)s.allocated_bytes,
+        s.heap_peak, (unsigned long long)s.collections,
+        (unsigned long long)s.freed_bytes, (unsigned long long)s.gc_pause_ns);
+    send_frame(conn, "stats", buf, len);
+}
+
+static void run_request(Conn *conn) {
+    uint64_t start = now_ns();
+    FmlVm *vm = fml_vm_new(serve_heap_limit, &(FmlOptions){ .limits = serve_limits });
+    fml_set_output(vm, send_output, conn);
+    const char *script = conn->buf + conn->header_len;
+    bool loaded;
+    switch (conn->kind) {
+        case REQUEST_PATH: {
+            //the request line without the newline and the `path ` prefix
+            conn->buf[conn->header_len - 1] = '\0';
+            loaded = fml_load_file(vm, conn->buf + strlen("path "));
+            break;
+        }
+        case REQUEST_BYTECODE:
+            loaded = fml_load_bytecode(vm, script, conn->script_len);
+            break;
+        default:
+            loaded = fml_load_source(vm, script, conn->script_len);
+            break;
+    }
+    int status = loaded ? fml_run(vm) : FML_ERROR;
+    if (status != FML_OK) {
+        const char *error = fml_error(vm);
+        send_frame(conn, "error", error, strlen(error));
+    }
+    send_stats(conn, vm, status, now_ns() - start);
+    fml_vm_free(vm);
+    conn_free(conn);
+}
+
+static void *worker_loop(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL)
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        Conn *conn = queue_head;
+        queue_head = conn->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&queue_lock);
+        run_request(conn);
+    }
+    return NULL;
+}
+
+static void enqueue(Conn *conn) {
+    conn->next = NULL;
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail == NULL)
+        queue_head = conn;
+    else
+        queue_tail->next = conn;
+    queue_tail = conn;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void reject(Conn *conn, const char *msg) {
+    send_frame(conn, "error", msg, strlen(msg));
+    conn_free(conn);
+}
+
+//parses the request line once it has arrived, false when it is invalid
+static bool parse_header(Conn *conn, char *newline) {
+    conn->header_len = newline - conn->buf + 1;
+    *newline = '\0';
+    char *line = conn->buf;
+    bool ok = true;
+    if (strncmp(line, "path ", strlen("path ")) == 0 && line[strlen("path ")] != '\0') {
+        conn->kind = REQUEST_PATH;
+        conn->script_len = 0;
+    } else {
+        char kind[16];
+        unsigned long long len;
+        char end;
+        if (sscanf(line, "%15s %llu%c", kind, &len, &end) != 2 || len > SERVE_MAX_SCRIPT)
+            ok = false;
+        else if (strcmp(kind, "bytecode") == 0)
+            conn->kind = REQUEST_BYTECODE;
+        else if (strcmp(kind, "source") == 0)
+            conn->kind = REQUEST_SOURCE;
+        else
+            ok = false;
+        conn->script_len = ok ? len : 0;
+    }
+    *newline = '\n';
+    return ok;
+}
+
+static void conn_drop(int epoll_fd, Conn *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+}
+
+//reads what is available, once the request is complete it leaves the loop for a worker
+static void conn_read(int epoll_fd, Conn *conn) {
+    for (;;) {
+        size_t want = conn->header_len == 0 ? REQUEST_LINE_MAX : conn->header_len + conn->script_len;
+        if (conn->cap < want) {
+            conn->cap = want;
+            conn->buf = realloc(conn->buf, conn->cap);
+        }
+        if (conn->header_len != 0 && conn->len == want) {
+            //the worker writes with blocking calls
+            conn_drop(epoll_fd, conn);
+            fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) & ~O_NONBLOCK);
+            enqueue(conn);
+            return;
+        }
+        ssize_t got = read(conn->fd, conn->buf + conn->len, want - conn->len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (got <= 0) {
+            //the client went away before sending the whole request
+            conn_drop(epoll_fd, conn);
+            conn_free(conn);
+            return;
+        }
+        size_t scanned = conn->len;
+        conn->len += got;
+        if (conn->header_len == 0) {
+            char *newline = memchr(conn->buf + scanned, '\n', conn->len - scanned);
+            if (newline == NULL) {
+                if (conn->len == REQUEST_LINE_MAX) {
+                    conn_drop(epoll_fd, conn);
+                    reject(conn, "Error: The request line is too long");
+                    return;
+                }
+                continue;
+            }
+            if (!parse_header(conn, newline)) {
+                conn_drop(epoll_fd, conn);
+                reject(conn, "Error: Invalid request");
+                return;
+            }
+            if (conn->len > conn->header_len + conn->script_len) {
+                conn_drop(epoll_fd, conn);
+                reject(conn, "Error: The request is longer than announced");
+                return;
+            }
+        }
+    }
+}
+
+static int listen_on(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "The socket path %s is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    //a socket left behind by a previous server
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void accept_all(int epoll_fd, int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            //EAGAIN when all are accepted, otherwise out of descriptors, retried on the next event
+            return;
+        }
+        Conn *conn = calloc(1, sizeof(Conn));
+        conn->fd = fd;
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+int serve(const char *socket_path, int workers, size_t heap_limit, FmlLimits limits) {
+    serve_heap_limit = heap_limit;
+    serve_limits = limits;
+    //a client closing early must not kill the server on the next write
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    //blocked before the workers start, so they inherit the mask
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    int signal_fd = signalfd(-1, &stop, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    int listen_fd = listen_on(socket_path);
+    if (listen_fd < 0)
+        return EXIT_FAILURE;
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, worker_loop, NULL);
+        pthread_detach(thread);
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    //the listening socket and the signals are told apart from the connections by a NULL ptr
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = &signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+    fprintf(stderr, "fml: serving on %s with %d workers\n", socket_path, workers);
+
+    bool running = true;
+    while (running) {
+        struct epoll_event events[MAX_EVENTS];
+        int cnt = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (cnt < 0 && errno == EINTR)
+            continue;
+        for (int i = 0; i < cnt; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                accept_all(epoll_fd, listen_fd);
+            } else if (ptr == &signal_fd) {
+                running = false;
+            } else {
+                conn_read(epoll_fd, ptr);
+            }
+        }
+    }
+
+    //the scripts still running are cut off with the process
+    unlink(socket_path);
+    close(listen_fd);
+    close(epoll_fd);
+    close(signal_fd);
+    return EXIT_SUCCESS;
+}
+
+//reads the request line of a prefork connection, true when it is `run`
+static bool read_run_request(int fd) {
+    char line[REQUEST_LINE_MAX];
+    size_t len = 0;
+    while (len < sizeof(line)) {
+        ssize_t got = read(fd, line + len, sizeof(line) - len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        char *newline = memchr(line + len, '\n', got);
+        len += got;
+        if (newline != NULL) {
+            *newline = '\0';
+            return strcmp(line, "run") == 0 && newline + 1 == line + len;
+        }
+    }
+    return false;
+}
+
+//a forked worker, it runs the program for one connection and exits
+static _Noreturn void prefork_worker(int listen_fd, FmlVm *vm) {
+    //the signals the server waits for are the default ones again, SIGTERM ends the worker
+    sigset_t all;
+    sigfillset(&all);
+    sigprocmask(SIG_UNBLOCK, &all, NULL);
+    int fd;
+    do {
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while (fd < 0 && (errno == EINTR || errno == ECONNABORTED));
+    if (fd < 0)
+        _exit(EXIT_FAILURE);
+    close(listen_fd);
+    uint64_t start = now_ns();
+    Conn conn = { .fd = fd };
+    int status = FML_ERROR;
+    if (!read_run_request(fd)) {
+        const char *msg = "Error: Invalid request";
+        send_frame(&conn, "error", msg, strlen(msg));
+    } else {
+        fml_set_output(vm, send_output, &conn);
+        status = fml_run(vm);
+        if (status != FML_OK) {
+            const char *error = fml_error(vm);
+            send_frame(&conn, "error", error, strlen(error));
+        }
+    }
+    send_stats(&conn, vm, status, now_ns() - start);
+    close(fd);
+    //the VM and the rest of the process go away with it
+    _exit(status);
+}
+
+//-1 when the fork failed, the slot is retried by prefork_respawn
+static pid_t prefork_spawn(int listen_fd, FmlVm *vm) {
+    pid_t pid = fork();
+    if (pid == 0)
+        prefork_worker(listen_fd, vm);
+    if (pid < 0)
+        fprintf(stderr, "fml: cannot fork a worker, retrying in %d ms: %s\n", PREFORK_RETRY_MS, strerror(errno));
+    return pid;
+}
+
+//forks the workers of the empty slots, returns how many are still empty
+static int prefork_respawn(pid_t *pids, int workers, int listen_fd, FmlVm *vm) {
+    int empty = 0;
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] < 0)
+            pids[i] = prefork_spawn(listen_fd, vm);
+        if (pids[i] < 0)
+            empty++;
+    }
+    return empty;
+}
+
+int serve_prefork(const char *socket_path, FmlVm *vm, int workers) {
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t wait_for;
+    sigemptyset(&wait_for);
+    sigaddset(&wait_for, SIGINT);
+    sigaddset(&wait_for, SIGTERM);
+    sigaddset(&wait_for, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &wait_for, NULL);
+
+    int listen_fd = listen_on(socket_path);
+    if (listen_fd < 0) {
+        fml_vm_free(vm);
+        return EXIT_FAILURE;
+    }
+    //the workers wait in accept, the server itself never takes a connection
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) & ~O_NONBLOCK);
+    pid_t *pids = malloc(sizeof(pid_t) * workers);
+    for (int i = 0; i < workers; i++) {
+        pids[i] = -1;
+    }
+    int empty = prefork_respawn(pids, workers, listen_fd, vm);
+    fprintf(stderr, "fml: serving the preloaded program on %s with %d workers\n", socket_path, workers);
+
+    //a failed fork (out of memory or processes) leaves its slot empty until a later try succeeds
+    struct timespec retry = { .tv_sec = PREFORK_RETRY_MS / 1000, .tv_nsec = PREFORK_RETRY_MS % 1000 * 1000000 };
+    for (;;) {
+        int sig = empty > 0 ? sigtimedwait(&wait_for, NULL, &retry) : sigwaitinfo(&wait_for, NULL);
+        if (sig == SIGINT || sig == SIGTERM)
+            break;
+        if (sig == SIGCHLD) {
+            //a worker is done with its connection, a fresh one takes its place
+            pid_t pid;
+            while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+                for (int i = 0; i < workers; i++) {
+                    if (pids[i] == pid)
+                        pids[i] = -1;
+                }
+            }
+        }
+        empty = prefork_respawn(pids, workers, listen_fd, vm);
+    }
+
+    //the runs still going are cut off like in serve
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    }
+    while (wait(NULL) > 0)
+        ;
+    free(pids);
+    unlink(socket_path);
+    close(listen_fd);
+    fml_vm_free(vm);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "fml.h"
+
+// Server mode (fml serve --socket <path>). One warm process listens on a
+// Unix domain socket and runs every script it gets in a fresh FmlVm, so the
+// clients don't pay for starting a process per script. An epoll loop accepts
+// the connections and reads the requests, complete requests are queued for a
+// pool of worker threads which run the scripts.
+//
+// A connection carries one script. The request is a line naming it,
+// followed by the script for the last two forms:
+//
+//     path <file>\n            a file on the server, bytecode when it ends in .bc
+//     bytecode <len>\n<bytes>  bytecode
+//     source <len>\n<bytes>    FML source
+//
+// The response is a sequence of frames `<tag> <len>\n` followed by `len`
+// bytes. `output` frames stream the output of the program as it is flushed,
+// an `error` frame has the message when the script couldn't be loaded or
+// failed. The last one is the `stats` frame, lines of `<name> <value>`
+// starting with the `status` of the run (0, 1 or 2 for a limit like the
+// exit status of fml). The server closes the connection after it. tools/fml_client.py is a
+// client to try it out.
+//
+// The profilers and the other tools of the fml executable are not available,
+// the heap and collector settings and the limits (--max-instructions,
+// --timeout-ms) apply to all the scripts.
+//
+// Prefork mode (fml serve --socket <path> --prefork <file>, or
+// --from-snapshot <image>) serves one program many times. The server loads
+// and checks it once, then forks the workers as processes which already have
+// it loaded. The const pool is read-only after loading, so its pages stay
+// shared copy-on-write by all the workers, and so does the heap of a
+// restored image until a run writes to it. Every connection sends the
+// request line `run\n` and gets the frames above for one run of the program.
+// A worker takes one connection and exits after it, the server forks its
+// replacement right away, so a request costs the execution and a fork that
+// happened before it arrived.
+
+//upper bound of the script size in a request
+#define SERVE_MAX_SCRIPT (64 * 1024 * 1024)
+
+//runs the server until SIGINT or SIGTERM, `heap_limit` in bytes, 0 for the default
+//every script runs with `limits`, returns the exit status for fml
+int serve(const char *socket_path, int workers, size_t heap_limit, FmlLimits limits);
+
+//prefork mode with the program loaded in `vm`, which it frees
+//runs until SIGINT or SIGTERM, returns the exit status for fml
+int serve_prefork(const char *socket_path, FmlVm *vm, int workers);
@@ -0,0 +1,56 @@
+#include <inttypes.h>
+
+#include "stats.h"
+
+const char *value_kind_name(ValueKind kind) {
+    switch (kind) {
+        case VK_INTEGER: return "integer";
+        case VK_NULL: return "null";
+        case VK_STRING: return "string";
+        case VK_FUNCTION: return "function";
+        case VK_BOOLEAN: return "boolean";
+        case VK_CLASS: return "class";
+        case VK_ARRAY: return "array";
+        case VK_OBJECT: return "object";
+    }
+    return "unknown";
+}
+
+void print_stats(Stats *s, Heap *heap, const char *unit, bool with_operands, FILE *f) {
+    fprintf(f, "\n== stats ==\n");
+    fprintf(f, "%-24s %14" PRIu64 "\n", unit, s->instructions);
+    fprintf(f, "%-24s %14" PRIu64 "\n", "calls", s->calls);
+    uint64_t method_calls = 0;
+    for (int i = 0; i < VALUE_KIND_CNT; i++)
+        method_calls += s->method_calls[i];
+    fprintf(f, "%-24s %14" PRIu64 "\n", "method calls", method_calls);
+    for (int i = 0; i < VALUE_KIND_CNT; i++) {
+        if (s->method_calls[i] == 0)
+            continue;
+        fprintf(f, "  %-22s %14" PRIu64 "\n", value_kind_name(i), s->method_calls[i]);
+    }
+    fprintf(f, "%-24s %14" PRIu64 "\n", "field lookups", s->field_lookups);
+    fprintf(f, "%-24s %14" PRIu64 "\n", "parent hops", s->parent_hops);
+    fprintf(f, "%-24s %14zu\n", "max frame depth", s->max_frames);
+    if (with_operands)
+        fprintf(f, "%-24s %14zu\n", "max operand depth", s->max_operands);
+
+    size_t alloc_cnt = 0;
+    size_t alloc_bytes = 0;
+    for (int i = 0; i < VALUE_KIND_CNT; i++) {
+        alloc_cnt += heap->alloc_cnt[i];
+        alloc_bytes += heap->alloc_bytes[i];
+    }
+    fprintf(f, "%-24s %14zu %14s\n", "allocations", alloc_cnt, "bytes");
+    for (int i = 0; i < VALUE_KIND_CNT; i++) {
+        if (heap->alloc_cnt[i] == 0)
+            continue;
+        fprintf(f, "  %-22s %14zu %14zu\n", value_kind_name(i), heap->alloc_cnt[i], heap->alloc_bytes[i]);
+    }
+    fprintf(f, "  %-22s %14zu %14zu\n", "total", alloc_cnt, alloc_bytes);
+    fprintf(f, "%-24s %14zu\n", "heap high-water mark", heap->heap_peak);
+    fprintf(f, "%-24s %14zu\n", "collections", heap->collections);
+    fprintf(f, "%-24s %14zu\n", "freed bytes", heap->freed_bytes);
+    fprintf(f, "%-24s %14.3f\n", "gc pause total (ms)", heap->gc_pause_ns / 1e6);
+    fprintf(f, "%-24s %14.3f\n", "gc pause max (ms)", heap->gc_max_pause_ns / 1e6);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "heap/heap.h"
+
+// Runtime statistics for --stats. Every interpreter instance (the VM, the
+// IState) keeps its own counters. They are cheap enough to be updated
+// unconditionally, only counting the executed instructions needs a separate
+// loop in the bytecode interpreter. The report is printed to stderr at exit,
+// the allocations are taken from the heap.
+
+typedef struct {
+    //bytecode instructions or evaluated AST nodes
+    uint64_t instructions;
+    //function calls, including the entry point
+    uint64_t calls;
+    //method calls by the kind of the receiver
+    uint64_t method_calls[VALUE_KIND_CNT];
+    uint64_t field_lookups;
+    //parents visited while looking up a field or a method
+    uint64_t parent_hops;
+    //max depth of the call stack (frames or environments)
+    size_t max_frames;
+    //max depth of the operand stack, the AST interpreter has none
+    size_t max_operands;
+} Stats;
+
+static inline void stats_frame_depth(Stats *s, size_t depth) {
+    if (depth > s->max_frames)
+        s->max_frames = depth;
+}
+
+const char *value_kind_name(ValueKind kind);
+
+//`unit` names what `instructions` counts, `with_operands` is false for the AST interpreter
+void print_stats(Stats *s, Heap *heap, const char *unit, bool with_operands, FILE *f);
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace_events.h"
+
+bool trace_events_enabled = false;
+
+static const char *trace_file;
+static TraceEvent *events;
+static size_t event_cnt;
+static size_t event_cap;
+static size_t events_dropped;
+//begin events without their end, to close them when the buffer fills up
+static size_t open_events;
+static Heap *trace_heap;
+//the TSC is converted to wall time using these two points
+static uint64_t start_tsc;
+static struct timespec start_time;
+
+void trace_events_start(const char *filename) {
+    trace_file = filename;
+    event_cap = 1024 * 64;
+    events = malloc(sizeof(TraceEvent) * event_cap);
+    event_cnt = 0;
+    events_dropped = 0;
+    open_events = 0;
+    trace_heap = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    start_tsc = read_tsc();
+    trace_events_enabled = true;
+}
+
+void trace_events_heap(Heap *heap) {
+    //only the traced VM sets it, the others may run on other threads
+    if (trace_events_enabled)
+        trace_heap = heap;
+}
+
+void trace_event(char ph, Str name, const char *cat) {
+    if (event_cnt == event_cap) {
+        if (event_cap == TRACE_MAX_EVENTS) {
+            events_dropped++;
+            return;
+        }
+        event_cap *= 2;
+        events = realloc(events, sizeof(TraceEvent) * event_cap);
+    }
+    TraceEvent *ev = &events[event_cnt++];
+    ev->name = name;
+    ev->cat = cat;
+    ev->ts = read_tsc();
+    ev->heap = trace_heap != NULL ? trace_heap->heap_size : 0;
+    ev->ph = ph;
+    if (ph == 'B')
+        open_events++;
+    else
+        open_events--;
+}
+
+static void write_name(FILE *f, Str name) {
+    fputc('"', f);
+    for (size_t i = 0; i < name.len; i++) {
+        u8 c = name.str[i];
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+void trace_events_write(TraceResolve resolve, void *ctx) {
+    trace_events_enabled = false;
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    uint64_t end_tsc = read_tsc();
+    double elapsed_us = (end_time.tv_sec - start_time.tv_sec) * 1e6 + (end_time.tv_nsec - start_time.tv_nsec) / 1e3;
+    double us_per_tick = end_tsc > start_tsc ? elapsed_us / (end_tsc - start_tsc) : 0;
+
+    FILE *f = fopen(trace_file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open the trace file %s\n", trace_file);
+        free(events);
+        return;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"fml\"}}");
+    size_t last_heap = SIZE_MAX;
+    double ts = 0;
+    for (size_t i = 0; i < event_cnt; i++) {
+        TraceEvent *ev = &events[i];
+        ts = (ev->ts - start_tsc) * us_per_tick;
+        if (ev->ph == 'B') {
+            Str name = resolve != NULL ? resolve(ctx, ev->name) : ev->name;
+            if (name.len == 0)
+                name = STR("<anonymous>");
+            fprintf(f, ",\n{\"name\":");
+            write_name(f, name);
+            fprintf(f, ",\"cat\":\"%s\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":1}", ev->cat, ts);
+        } else {
+            fprintf(f, ",\n{\"cat\":\"%s\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":1}", ev->cat, ts);
+        }
+        if (ev->heap != last_heap) {
+            fprintf(f, ",\n{\"name\":\"heap\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":1,\"args\":{\"bytes\":%zu}}",
+                    ts, ev->heap);
+            last_heap = ev->heap;
+        }
+    }
+    //the buffer was full or the program exited from inside a call
+    for (; open_events > 0; open_events--) {
+        fprintf(f, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":1}", ts);
+    }
+    fprintf(f, "\n]}\n");
+    if (events_dropped > 0) {
+        fprintf(stderr, "trace event buffer full, %zu events dropped\n", events_dropped);
+    }
+    free(events);
+    events = NULL;
+    fclose(f);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parser.h"
+#include "heap/heap.h"
+#include "tsc.h"
+
+// Chrome trace-event output (--trace-events), viewable in chrome://tracing,
+// Perfetto or speedscope. Entries and exits of FML functions and methods and
+// the phases of the run (parse, deserialize, execute) are recorded as begin
+// and end events into an in-memory buffer, only a TSC read and a store per
+// event. The size of the heap is recorded with every event and written as a
+// counter track. The JSON is written at exit.
+//
+// Like in the sampling profiler the name of an event can be an arbitrary key
+// translated to the name by the `resolve` callback when writing the trace.
+
+// Events past this many are dropped, the open ones are closed at the end.
+#define TRACE_MAX_EVENTS (1024 * 1024 * 16)
+
+typedef struct {
+    Str name;
+    const char *cat;
+    uint64_t ts;
+    size_t heap;
+    char ph;
+} TraceEvent;
+
+typedef Str (*TraceResolve)(void *ctx, Str name);
+
+extern bool trace_events_enabled;
+
+void trace_events_start(const char *filename);
+
+//the heap whose size is recorded with the events, can be changed or NULL
+void trace_events_heap(Heap *heap);
+
+void trace_event(char ph, Str name, const char *cat);
+
+//writes the trace, `resolve` can be NULL
+void trace_events_write(TraceResolve resolve, void *ctx);
+
+static inline void trace_begin(Str name, const char *cat) {
+    if (trace_events_enabled)
+        trace_event('B', name, cat);
+}
+
+static inline void trace_end(const char *cat) {
+    if (trace_events_enabled)
+        trace_event('E', (Str){ 0 }, cat);
+}
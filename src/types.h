@@ -22,6 +22,9 @@ typedef enum {
     VK_OBJECT,
 } ValueKind;
 
+//number of value kinds, they are numbered densely from 0
+#define VALUE_KIND_CNT (VK_OBJECT + 1)
+
 typedef enum {
     DROP = 0x00,
     CONSTANT = 0x01,
@@ -41,6 +44,9 @@ typedef enum {
     RETURN = 0x0F,
 } Instruction;
 
+//number of opcodes, they are numbered densely from 0
+#define INSTRUCTION_CNT (RETURN + 1)
+
 typedef uint8_t *Value;
 
 /*typedef struct Array Array;
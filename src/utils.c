@@ -3,16 +3,40 @@
 //
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "utils.h"
+#include "output.h"
+#include "fml.h"
 
-#define DEBUG 0
-#if DEBUG
-    #define PRINT_IF_DEBUG_ON
-#else
-    #define PRINT_IF_DEBUG_ON return
-#endif
+_Thread_local ErrorTrap *error_trap = NULL;
 
+_Noreturn static void fail(int status, const char *fmt, va_list args) {
+    if (error_trap == NULL) {
+        vprintf(fmt, args);
+        exit(status);
+    }
+    vsnprintf(error_trap->msg, sizeof(error_trap->msg), fmt, args);
+    size_t len = strlen(error_trap->msg);
+    if (len > 0 && error_trap->msg[len - 1] == '\n')
+        error_trap->msg[len - 1] = '\0';
+    error_trap->limit = status == FML_LIMIT;
+    longjmp(error_trap->env, 1);
+}
+
+void runtime_error(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fail(FML_ERROR, fmt, args);
+}
+
+void limit_exceeded(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fail(FML_LIMIT, fmt, args);
+}
 
 uint16_t deserialize_u16(const uint8_t *data) {
     return (data[0]<<0) | (data[1]<<8);
@@ -54,40 +78,40 @@ int field_cmp(const void *a, const void *b) {
 void print_val(Value val) {
     switch(*val) {
         case VK_INTEGER: {
-            printf("%d", ((Integer *)val)->val);
+            out_int(((Integer *)val)->val);
             break;
         }
         case VK_BOOLEAN: {
-            printf("%s", ((Boolean *)val)->val ? "true" : "false");
+            out_cstr(((Boolean *)val)->val ? "true" : "false");
             break;
         }
         case VK_NULL: {
-            printf("null");
+            out_cstr("null");
             break;
         }
         case VK_FUNCTION: {
-            printf("function");
+            out_cstr("function");
             break;
         }
         case VK_ARRAY: {
-            printf("[");
+            out_cstr("[");
             for (size_t i = 0; i < ((Array *)val)->size; i++) {
                 print_val(((Array *)val)->val[i]);
                 if (i != ((Array *)val)->size - 1) {
-                    printf(", ");
+                    out_cstr(", ");
                 }
             }
-            printf("]");
+            out_cstr("]");
             break;
         }
         case VK_OBJECT: {
             Object *obj = (Object *)val;
-            printf("object(");
+            out_cstr("object(");
             if (*(ValueKind *)obj->parent != VK_NULL) {
-                printf("..=");
+                out_cstr("..=");
                 print_val(obj->parent);
                 if (obj->field_cnt > 0) {
-                    printf(", ");
+                    out_cstr(", ");
                 }
             }
             // Allocate a new array of Field pointers and copy the original Field pointers
@@ -98,100 +122,123 @@ void print_val(Value val) {
             // Sort the new array of Field pointers
             qsort(fields, obj->field_cnt, sizeof(Field *), field_cmp);
             for (size_t i = 0; i < obj->field_cnt; i++) {
-                //print_my_str(obj->val[i].name);
-                //printf("%.*s", (int)obj->val[i].name.len, obj->val[i].name.str);
-                printf("%.*s", (int)fields[i]->name.len, fields[i]->name.str);
-                printf("=");
-                //print_val(obj->val[i].val);
+                out_str(fields[i]->name);
+                out_cstr("=");
                 print_val(fields[i]->val);
                 if (i != obj->field_cnt - 1) {
-                    printf(", ");
+                    out_cstr(", ");
                 }
             }
-            printf(")");
+            out_cstr(")");
             free(fields);
             break;
         }
         default: {
-            printf("unknown value kind");
+            out_cstr("unknown value kind");
             break;
         }
     }
 }
 
+void print_format(const Str *literals, size_t holes, Value *args) {
+    for (size_t i = 0; i < holes; i++) {
+        out_str(literals[i]);
+        print_val(args[i]);
+    }
+    out_str(literals[holes]);
+}
+
 void print_op_stack(Value *stack, size_t size) {
-    PRINT_IF_DEBUG_ON;
-    printf("op_stack(:\n");
+    out_cstr("op_stack(:\n");
     for (size_t i = 0; i < size; ++i) {
-        printf("\top %d: ", i);
+        out_cstr("\top ");
+        out_int(i);
+        out_cstr(": ");
         print_val(stack[i]);
         if (i != size - 1) {
-            printf(",\n");
+            out_cstr(",\n");
         }
         else{
-            printf("  <-- TOP\n");
+            out_cstr("  <-- TOP\n");
         }
     }
-    printf(")\n");
+    out_cstr(")\n");
 }
 
-void print_instruction_type(Instruction ins) {
-    PRINT_IF_DEBUG_ON;
+const char *instruction_name(Instruction ins) {
     switch (ins) {
         case DROP:
-            printf("DROP\n");
-            break;
+            return "DROP";
         case CONSTANT:
-            printf("CONSTANT\n");
-            break;
+            return "CONSTANT";
         case PRINT:
-            printf("PRINT\n");
-            break;
+            return "PRINT";
         case ARRAY:
-            printf("ARRAY\n");
-            break;
+            return "ARRAY";
         case OBJECT:
-            printf("OBJECT\n");
-            break;
+            return "OBJECT";
         case GET_FIELD:
-            printf("GET_FIELD\n");
-            break;
+            return "GET_FIELD";
         case SET_FIELD:
-            printf("SET_FIELD\n");
-            break;
+            return "SET_FIELD";
         case CALL_METHOD:
-            printf("CALL_METHOD\n");
-            break;
+            return "CALL_METHOD";
         case CALL_FUNCTION:
-            printf("CALL_FUNCTION\n");
-            break;
+            return "CALL_FUNCTION";
         case SET_LOCAL:
-            printf("SET_LOCAL\n");
-            break;
+            return "SET_LOCAL";
         case GET_LOCAL:
-            printf("GET_LOCAL\n");
-            break;
+            return "GET_LOCAL";
         case SET_GLOBAL:
-            printf("SET_GLOBAL\n");
-            break;
+            return "SET_GLOBAL";
         case GET_GLOBAL:
-            printf("GET_GLOBAL\n");
-            break;
+            return "GET_GLOBAL";
         case BRANCH:
-            printf("BRANCH\n");
-            break;
+            return "BRANCH";
         case JUMP:
-            printf("JUMP\n");
-            break;
+            return "JUMP";
         case RETURN:
-            printf("RETURN\n");
-            break;
+            return "RETURN";
         default:
-            printf("Unknown instruction: 0x%02X\n", ins);
-            exit(1);
+            return NULL;
     }
 }
 
+void print_instruction_type(Instruction ins) {
+    const char *name = instruction_name(ins);
+    if (name == NULL) {
+        runtime_error("Unknown instruction: 0x%02X\n", ins);
+    }
+    out_cstr(name);
+    out_cstr("\n");
+}
+
+void check_integer_operands(Value obj, Value arg, Str m_name) {
+    if (*obj != VK_INTEGER || *arg != VK_INTEGER)
+        runtime_error("Error: The operands of %.*s have to be integers\n", (int)m_name.len, m_name.str);
+}
+
+void check_divisor(i32 dividend, i32 divisor) {
+    if (divisor == 0)
+        runtime_error("Error: Division by zero\n");
+    if (dividend == INT32_MIN && divisor == -1)
+        runtime_error("Error: Integer overflow in division\n");
+}
+
+void check_argc(int argc, int expected, Str m_name) {
+    if (argc != expected)
+        runtime_error("Error: %.*s takes %d argument%s, got %d\n", (int)m_name.len, m_name.str,
+                      expected, expected == 1 ? "" : "s", argc);
+}
+
+void check_array_index(Value array, Value index) {
+    if (*index != VK_INTEGER)
+        runtime_error("Error: An array index has to be an integer\n");
+    i32 i = ((Integer *)index)->val;
+    if (i < 0 || (size_t)i >= ((Array *)array)->size)
+        runtime_error("Error: Index %d out of bounds of an array of size %zu\n", i, ((Array *)array)->size);
+}
+
 bool is_primitive(ValueKind kind){
     return kind == VK_BOOLEAN || kind == VK_INTEGER || kind == VK_FUNCTION || kind == VK_NULL;
 }
@@ -5,14 +5,21 @@
 #pragma once
 
 #include <stddef.h>
+#include <setjmp.h>
 #include "types.h"
 
 void print_val(Value val);
 
+//prints `args` interleaved with the pre-split literal runs of a print format
+void print_format(const Str *literals, size_t holes, Value *args);
+
 void print_op_stack(Value *stack, size_t size);
 
 void print_instruction_type(Instruction ins);
 
+//name of the instruction or NULL if the opcode is unknown
+const char *instruction_name(Instruction ins);
+
 bool is_primitive(ValueKind kind);
 
 uint16_t deserialize_u16(const uint8_t *data);
@@ -22,3 +29,36 @@ int16_t deserialize_i16(const uint8_t *data);
 uint32_t deserialize_u32(const uint8_t *data);
 
 bool truthiness(Value val);
+
+//checks of the built-in methods, both interpreters report a wrong use with runtime_error
+//the operands of the arithmetic and comparison methods have to be integers
+void check_integer_operands(Value obj, Value arg, Str m_name);
+
+//division and remainder by 0, or of INT32_MIN by -1, would trap
+void check_divisor(i32 dividend, i32 divisor);
+
+void check_argc(int argc, int expected, Str m_name);
+
+//`index` is an integer within the array
+void check_array_index(Value array, Value index);
+
+//where runtime_error goes instead of ending the process
+//the program can't go on after it, only its VM may still be freed
+typedef struct {
+    jmp_buf env;
+    //the message, without the trailing newline
+    char msg[256];
+    //set when it was limit_exceeded rather than runtime_error
+    bool limit;
+} ErrorTrap;
+
+//set by whoever runs a program on the thread, NULL makes runtime_error exit
+extern _Thread_local ErrorTrap *error_trap;
+
+//reports an error of the running or loading program
+//prints the message and exits with 1, or longjmps to the error_trap of the thread
+_Noreturn void runtime_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+//same as runtime_error for a program stopped by its instruction or time limit
+//exits with FML_LIMIT instead of 1
+_Noreturn void limit_exceeded(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
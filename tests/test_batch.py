@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""Checks that a failing script doesn't cost `fml batch` the other results.
+
+tests/batch/manifest has a script which fails with a runtime error among
+good ones. In every mode the output of all of them has to be printed in
+manifest order, the failing one followed by its error, and the exit status
+has to be 1.
+
+    tests/test_batch.py --fml build/fml
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+
+MANIFEST = os.path.join(os.path.dirname(os.path.abspath(__file__)), "batch", "manifest")
+
+EXPECTED = {
+    "sum.fml": "sum = 45\n",
+    "fail.fml": "before\nerror: Error: Field a not found\n",
+    "../../benchmarks/recursion.bc": "fib(22) = 17711\nack(2, 100) = 203\n",
+    "loop.fml": "count = 1000\n",
+}
+
+MODES = [[], ["--workers", "2"], ["--green"], ["--green", "--slice", "1"]]
+
+
+def sections(stdout):
+    """Splits the output into {script: output} by the `==> <script> <==` lines."""
+    result = {}
+    script = None
+    for line in stdout.splitlines(keepends=True):
+        if line.startswith("==> ") and line.rstrip("\n").endswith(" <=="):
+            #the paths are the manifest lines prefixed with its directory
+            script = line[4:-5][len(os.path.dirname(MANIFEST)) + 1:]
+            result[script] = ""
+        else:
+            result[script] += line
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--fml", required=True, help="the fml executable")
+    args = parser.parse_args()
+
+    failed = False
+    for mode in MODES:
+        proc = subprocess.run([args.fml, "batch", *mode, MANIFEST], capture_output=True, text=True, timeout=60)
+        name = " ".join(["batch", *mode])
+        if proc.returncode != 1:
+            print(f"{name}: exit status {proc.returncode}, expected 1\n{proc.stderr}")
+            failed = True
+            continue
+        got = sections(proc.stdout)
+        if list(got.items()) != list(EXPECTED.items()):
+            print(f"{name}: unexpected output\n{proc.stdout}")
+            failed = True
+        summary = "4 scripts, 1 failed" in proc.stderr
+        if "--green" in mode:
+            #the .fml scripts of the manifest can't be suspended
+            summary = summary and "3 source not interleaved" in proc.stderr
+        if not summary:
+            print(f"{name}: unexpected summary\n{proc.stderr}")
+            failed = True
+    if failed:
+        return 1
+    print("ok")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
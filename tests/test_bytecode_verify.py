@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Checks that bc_load rejects bytecode with invalid operands.
+
+Every case is a small program with one bad instruction operand: a constant,
+local or global index out of range or of the wrong kind, a jump outside the
+function or into the middle of an instruction, a function whose control runs
+off its end. Each has to be refused at load time with exit status 1 instead
+of crashing the interpreter. The unmodified program has to run. The depth
+of the operand stack is checked as the program runs, taking more operands
+than there are has to end it with status 1 as well.
+
+    tests/test_bytecode_verify.py --fml build/fml
+"""
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+DROP, CONSTANT, PRINT, GET_LOCAL, SET_GLOBAL, GET_GLOBAL, BRANCH, JUMP, RETURN = \
+    0x00, 0x01, 0x02, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+
+
+def u16(v):
+    return struct.pack("<H", v & 0xFFFF)
+
+
+def program(code):
+    """The constants are 0: "x" (the global), 1: "~\\n", 2: 42, 3: the entry point."""
+    consts = [
+        b"\x02" + struct.pack("<I", 1) + b"x",
+        b"\x02" + struct.pack("<I", 2) + b"~\n",
+        b"\x00" + struct.pack("<i", 42),
+        b"\x03" + struct.pack("<BHI", 1, 0, len(code)) + code,
+    ]
+    return (b"FML\n" + u16(len(consts)) + b"".join(consts)
+            + u16(1) + u16(0) + u16(3))
+
+
+def body(*ins):
+    return b"".join(ins)
+
+
+#prints 42 through a global, then returns the receiver, the only local
+VALID = body(bytes([CONSTANT]) + u16(2), bytes([SET_GLOBAL]) + u16(0), bytes([DROP]),
+             bytes([GET_GLOBAL]) + u16(0), bytes([PRINT]) + u16(1) + b"\x01",
+             bytes([GET_LOCAL]) + u16(0), bytes([RETURN]))
+
+INVALID = {
+    "constant out of range": body(bytes([CONSTANT]) + u16(9), bytes([RETURN])),
+    "print format not a string": body(bytes([CONSTANT]) + u16(2), bytes([PRINT]) + u16(2) + b"\x01", bytes([RETURN])),
+    "local out of range": body(bytes([GET_LOCAL]) + u16(1), bytes([RETURN])),
+    "global not declared": body(bytes([GET_GLOBAL]) + u16(1), bytes([RETURN])),
+    "global out of range": body(bytes([CONSTANT]) + u16(2), bytes([SET_GLOBAL]) + u16(500), bytes([RETURN])),
+    "jump past the end": body(bytes([JUMP]) + u16(10), bytes([RETURN])),
+    "jump before the start": body(bytes([JUMP]) + u16(-4), bytes([RETURN])),
+    "jump into an instruction": body(bytes([CONSTANT]) + u16(2), bytes([BRANCH]) + u16(-5), bytes([RETURN])),
+    "falls off the end": body(bytes([CONSTANT]) + u16(2)),
+    "truncated instruction": body(bytes([RETURN]), bytes([CONSTANT]) + b"\x02"),
+    "unknown opcode": body(b"\x42", bytes([RETURN])),
+}
+
+
+UNDERFLOW = {
+    "drop on an empty stack": body(bytes([DROP]), bytes([GET_LOCAL]) + u16(0), bytes([RETURN])),
+    "print without its argument": body(bytes([PRINT]) + u16(1) + b"\x01", bytes([RETURN])),
+}
+
+
+def run(fml, tmp, name, blob):
+    path = os.path.join(tmp, name.replace(" ", "_") + ".bc")
+    with open(path, "wb") as f:
+        f.write(blob)
+    return subprocess.run([fml, "bc_interpret", path], capture_output=True, text=True, timeout=30)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--fml", required=True, help="the fml executable")
+    args = parser.parse_args()
+
+    failed = False
+    with tempfile.TemporaryDirectory() as tmp:
+        proc = run(args.fml, tmp, "valid", program(VALID))
+        if proc.returncode != 0 or proc.stdout != "42\n":
+            print(f"valid: exit status {proc.returncode}, output {proc.stdout!r}")
+            failed = True
+        for name, code in INVALID.items():
+            proc = run(args.fml, tmp, name, program(code))
+            if proc.returncode != 1 or "Invalid" not in proc.stdout:
+                print(f"{name}: exit status {proc.returncode}, output {proc.stdout!r} {proc.stderr!r}")
+                failed = True
+        for name, code in UNDERFLOW.items():
+            proc = run(args.fml, tmp, name, program(code))
+            if proc.returncode != 1 or "underflow" not in proc.stdout:
+                print(f"{name}: exit status {proc.returncode}, output {proc.stdout!r} {proc.stderr!r}")
+                failed = True
+    if failed:
+        return 1
+    print("ok")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
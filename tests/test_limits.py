@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Checks the boundary of --max-instructions in both interpreters.
+
+The limit counts safepoints (backward jumps, loop iterations and calls) and a
+program may pass exactly that many: with the limit set to the number of
+safepoints of the program it has to finish with exit status 0, one less has
+to stop it with status 2 (FML_LIMIT).
+
+    tests/test_limits.py --fml build/fml
+"""
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+#3 loop iterations, 4 calls of < and 3 of +
+SOURCE = b'let i = 0;\nwhile i < 3 do i <- i + 1;\nprint("~\\n", i);\n'
+SOURCE_SAFEPOINTS = 10
+
+CONSTANT, PRINT, CALL_METHOD, SET_LOCAL, GET_LOCAL, DROP, BRANCH, RETURN = \
+    0x01, 0x02, 0x07, 0x09, 0x0A, 0x00, 0x0D, 0x0F
+
+
+def u16(v):
+    return struct.pack("<H", v & 0xFFFF)
+
+
+def bytecode():
+    """Counts a local down from 3 to 0: 3 calls of -, 3 of > and 2 taken backward branches."""
+    code = b"".join([
+        bytes([CONSTANT]) + u16(0), bytes([SET_LOCAL]) + u16(1), bytes([DROP]),
+        #loop start, 7
+        bytes([GET_LOCAL]) + u16(1), bytes([CONSTANT]) + u16(1), bytes([CALL_METHOD]) + u16(3) + b"\x02",
+        bytes([SET_LOCAL]) + u16(1), bytes([CONSTANT]) + u16(2), bytes([CALL_METHOD]) + u16(4) + b"\x02",
+        bytes([BRANCH]) + u16(7 - 30),
+        bytes([GET_LOCAL]) + u16(1), bytes([PRINT]) + u16(5) + b"\x01", bytes([RETURN]),
+    ])
+    consts = [
+        b"\x00" + struct.pack("<i", 3),
+        b"\x00" + struct.pack("<i", 1),
+        b"\x00" + struct.pack("<i", 0),
+        b"\x02" + struct.pack("<I", 1) + b"-",
+        b"\x02" + struct.pack("<I", 1) + b">",
+        b"\x02" + struct.pack("<I", 2) + b"~\n",
+        b"\x03" + struct.pack("<BHI", 1, 1, len(code)) + code,
+    ]
+    return b"FML\n" + u16(len(consts)) + b"".join(consts) + u16(0) + u16(6)
+
+
+BYTECODE_SAFEPOINTS = 8
+
+
+def run(fml, mode, path, limit):
+    return subprocess.run([fml, mode, "--max-instructions", str(limit), path],
+                          capture_output=True, text=True, timeout=30)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--fml", required=True, help="the fml executable")
+    args = parser.parse_args()
+
+    failed = False
+    with tempfile.TemporaryDirectory() as tmp:
+        cases = []
+        for name, blob, mode, safepoints, output in [
+                ("loop.fml", SOURCE, "ast_interpret", SOURCE_SAFEPOINTS, "3\n"),
+                ("loop.bc", bytecode(), "bc_interpret", BYTECODE_SAFEPOINTS, "0\n")]:
+            path = os.path.join(tmp, name)
+            with open(path, "wb") as f:
+                f.write(blob)
+            cases.append((mode, path, safepoints, 0, output))
+            cases.append((mode, path, safepoints - 1, 2, None))
+        for mode, path, limit, status, output in cases:
+            proc = run(args.fml, mode, path, limit)
+            if proc.returncode != status or (output is not None and proc.stdout != output):
+                print(f"{mode} --max-instructions {limit}: exit status {proc.returncode} (expected {status}), "
+                      f"output {proc.stdout!r} {proc.stderr!r}")
+                failed = True
+    if failed:
+        return 1
+    print("ok")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
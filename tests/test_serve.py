@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""Checks that a failing script fails only its own request of `fml serve`.
+
+A script that hits a runtime error is sent first, then a good one over a new
+connection: the first gets an `error` frame and status 1, the second has to
+be served normally by the same server. A prefork server with one worker gets
+two `run` requests: the second is served by the worker forked to replace the
+first, and both runs have to start from the loaded program, unaffected by
+the globals the other one changed.
+
+    tests/test_serve.py --fml build/fml
+"""
+
+import argparse
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+FAILING = b'let x = 1;\nprint("~\\n", x.a);\n'
+GOOD = b'let x = 20;\nprint("~\\n", x + 22);\n'
+
+
+#counts its runs in a global
+COUNTER = b'let runs = 0;\nruns <- runs + 1;\nprint("run ~\\n", runs);\n'
+
+
+def run(sock_path, script):
+    """Sends the source and returns (output, error, status)."""
+    return request(sock_path, b"source " + str(len(script)).encode() + b"\n" + script)
+
+
+def request(sock_path, data):
+    """Sends the request and returns (output, error, status)."""
+    output, error, status = b"", b"", None
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as conn:
+        conn.connect(sock_path)
+        conn.sendall(data)
+        stream = conn.makefile("rb")
+        while True:
+            header = stream.readline()
+            if not header:
+                break
+            tag, length = header.split()
+            payload = stream.read(int(length))
+            if tag == b"output":
+                output += payload
+            elif tag == b"error":
+                error += payload
+            elif tag == b"stats":
+                stats = dict(line.split(" ", 1) for line in payload.decode().splitlines())
+                status = int(stats["status"])
+    return output, error, status
+
+
+def wait_for(path, server):
+    for _ in range(100):
+        if os.path.exists(path):
+            return
+        if server.poll() is not None:
+            sys.exit(f"the server exited with {server.returncode}")
+        time.sleep(0.05)
+    sys.exit("the server did not create its socket")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--fml", required=True, help="the fml executable")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        sock_path = os.path.join(tmp, "fml.sock")
+        server = subprocess.Popen([args.fml, "serve", "--socket", sock_path, "--workers", "2"])
+        try:
+            wait_for(sock_path, server)
+            output, error, status = run(sock_path, FAILING)
+            assert status == 1, f"failing script: status {status}"
+            assert b"Field a not found" in error, f"failing script: error {error!r}"
+            output, error, status = run(sock_path, GOOD)
+            assert status == 0, f"good script: status {status}, error {error!r}"
+            assert output == b"42\n", f"good script: output {output!r}"
+            assert server.poll() is None, "the server exited"
+        finally:
+            server.terminate()
+            server.wait(timeout=10)
+
+        program = os.path.join(tmp, "counter.fml")
+        with open(program, "wb") as f:
+            f.write(COUNTER)
+        sock_path = os.path.join(tmp, "prefork.sock")
+        server = subprocess.Popen([args.fml, "serve", "--socket", sock_path, "--workers", "1",
+                                   "--prefork", program])
+        try:
+            wait_for(sock_path, server)
+            for i in range(2):
+                output, error, status = request(sock_path, b"run\n")
+                assert status == 0, f"prefork run {i}: status {status}, error {error!r}"
+                assert output == b"run 1\n", f"prefork run {i}: output {output!r}"
+            assert server.poll() is None, "the prefork server exited"
+        finally:
+            server.terminate()
+            server.wait(timeout=10)
+    print("ok")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""Checks fml snapshot and fml run --from-snapshot.
+
+A small program prints before and after its call of snapshot(), which it
+makes from inside a function, so the image holds two frames, a heap cell in
+a local and the stack of the caller. The output of the snapshot run followed
+by the run of the image has to be that of a plain run. Images which are
+truncated or have a constant, the resume address or a return address
+corrupted have to be refused with exit status 1, and no single corrupted
+byte of the const pool or word of the rest may crash fml.
+
+    tests/test_snapshot.py --fml build/fml
+"""
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+CONSTANT, PRINT, CALL_FUNCTION, SET_LOCAL, GET_LOCAL, SET_GLOBAL, GET_GLOBAL, DROP, RETURN = \
+    0x01, 0x02, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x00, 0x0F
+
+
+def u16(v):
+    return struct.pack("<H", v & 0xFFFF)
+
+
+def string(s):
+    return b"\x02" + struct.pack("<I", len(s)) + s
+
+
+def function(params, locals_cnt, code):
+    return b"\x03" + struct.pack("<BHI", params, locals_cnt, len(code)) + code
+
+
+#warm(): keeps 7 in a local, prints it, calls snapshot() and returns the local
+WARM = b"".join([
+    bytes([CONSTANT]) + u16(3), bytes([SET_LOCAL]) + u16(1), bytes([DROP]),
+    bytes([GET_LOCAL]) + u16(1), bytes([PRINT]) + u16(4) + b"\x01", bytes([DROP]),
+    bytes([GET_GLOBAL]) + u16(0), bytes([CALL_FUNCTION]) + b"\x00",
+])
+#where warm resumes after snapshot()
+WARM_RESUME = len(WARM)
+WARM += bytes([DROP]) + bytes([GET_LOCAL]) + u16(1) + bytes([RETURN])
+
+#stores warm in its global, calls it and prints its result next to 3
+ENTRY = b"".join([
+    bytes([CONSTANT]) + u16(6), bytes([SET_GLOBAL]) + u16(7), bytes([DROP]),
+    bytes([GET_GLOBAL]) + u16(7), bytes([CALL_FUNCTION]) + b"\x00",
+])
+#where the entry point resumes after warm() returns
+ENTRY_RESUME = len(ENTRY)
+ENTRY += bytes([CONSTANT]) + u16(2) + bytes([PRINT]) + u16(5) + b"\x02" + bytes([RETURN])
+
+CONSTS = [
+    string(b"snapshot"),
+    string(b"~\n"),
+    b"\x00" + struct.pack("<i", 3),
+    b"\x00" + struct.pack("<i", 7),
+    string(b"before ~\n"),
+    string(b"after ~ ~\n"),
+    function(1, 1, WARM),
+    string(b"warm"),
+    function(1, 0, ENTRY),
+]
+
+PROGRAM = (b"FML\n" + u16(len(CONSTS)) + b"".join(CONSTS)
+           + u16(2) + u16(0) + u16(7) + u16(8))
+
+EXPECTED = "before 7\nafter 7 3\n"
+
+#the words of the image header, see bc_snapshot.c
+HEADER_WORDS = 6
+POOL_OFFSET, POOL_SIZE, DATA_OFFSET, DATA_WORDS = 2, 3, 4, 5
+REF_POOL = 2
+
+
+def fml(args, *argv):
+    return subprocess.run([args.fml, *argv], capture_output=True, text=True, errors="replace", timeout=30)
+
+
+def words(image):
+    return list(struct.unpack("<%dQ" % HEADER_WORDS, image[:8 * HEADER_WORDS]))
+
+
+def run_image(args, path, image):
+    with open(path, "wb") as f:
+        f.write(image)
+    return fml(args, "run", "--max-instructions", "100000", "--from-snapshot", path)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--fml", required=True, help="the fml executable")
+    args = parser.parse_args()
+
+    failures = []
+    with tempfile.TemporaryDirectory() as tmp:
+        program = os.path.join(tmp, "warm.bc")
+        image_path = os.path.join(tmp, "warm.img")
+        broken_path = os.path.join(tmp, "broken.img")
+        with open(program, "wb") as f:
+            f.write(PROGRAM)
+
+        plain = fml(args, "run", program)
+        if plain.returncode != 0 or plain.stdout != EXPECTED:
+            failures.append(f"plain run: exit status {plain.returncode}, output {plain.stdout!r}")
+        snap = fml(args, "snapshot", program, image_path)
+        restored = fml(args, "run", "--from-snapshot", image_path)
+        if snap.returncode != 0 or restored.returncode != 0 or snap.stdout + restored.stdout != plain.stdout:
+            failures.append(f"snapshot: exit status {snap.returncode} and {restored.returncode}, "
+                            f"output {snap.stdout!r} and {restored.stdout!r}")
+        if not failures:
+            with open(image_path, "rb") as f:
+                image = f.read()
+            header = words(image)
+            pool_at, pool_size = header[POOL_OFFSET], header[POOL_SIZE]
+            data_at, data_words = header[DATA_OFFSET], header[DATA_WORDS]
+            pool = image[pool_at:pool_at + pool_size]
+
+            broken = {"truncated": image[:len(image) // 2]}
+            #the length of the body of warm, right in front of it
+            warm_at = pool.index(WARM)
+            broken["function length"] = (image[:pool_at + warm_at - 4] + struct.pack("<I", 0xFFFFFF00)
+                                         + image[pool_at + warm_at:])
+            #the resume address and the return address into the entry point, moved into an instruction
+            for name, offset in [("resume address", warm_at + WARM_RESUME),
+                                 ("return address", pool.index(ENTRY) + ENTRY_RESUME)]:
+                word = struct.pack("<Q", offset << 2 | REF_POOL)
+                at = image.index(word, data_at)
+                broken[name] = image[:at] + struct.pack("<Q", (offset + 2) << 2 | REF_POOL) + image[at + 8:]
+            for name, blob in broken.items():
+                proc = run_image(args, broken_path, blob)
+                if proc.returncode != 1:
+                    failures.append(f"{name}: exit status {proc.returncode}, output {proc.stdout!r}")
+
+            #any outcome but a crash will do, a changed constant or index may still be a valid program
+            mutations = [pool_at + i for i in range(pool_size)]
+            mutations += [data_at + 8 * i for i in range(data_words)]
+            for at in mutations:
+                blob = image[:at] + bytes([image[at] ^ 0xFF]) + image[at + 1:]
+                proc = run_image(args, broken_path, blob)
+                if proc.returncode not in (0, 1, 2):
+                    failures.append(f"byte {at} flipped: exit status {proc.returncode}, output {proc.stdout!r}")
+
+    if failures:
+        print("\n".join(failures))
+        return 1
+    print("ok")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
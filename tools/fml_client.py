@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""Runs a script on a server started with `fml serve --socket <path>`.
+
+The script is sent as bytecode when its name ends in .bc, as source otherwise.
+With --path only its path is sent and the server reads the file itself. The
+output of the program goes to stdout, the error and with --stats the
+statistics of the run to stderr. The exit status is the one of the run, like
+with the fml executable. See src/serve.h for the protocol.
+
+    tools/fml_client.py --socket /tmp/fml.sock examples/fibo.fml
+
+A server started with --prefork runs its own program, which is requested
+without a script:
+
+    tools/fml_client.py --socket /tmp/fml.sock
+"""
+
+import argparse
+import os
+import socket
+import sys
+
+
+def request(args):
+    if args.script is None:
+        return b"run\n"
+    if args.path:
+        return b"path " + os.path.abspath(args.script).encode() + b"\n"
+    with open(args.script, "rb") as f:
+        script = f.read()
+    kind = b"bytecode" if args.script.endswith(".bc") else b"source"
+    return kind + b" " + str(len(script)).encode() + b"\n" + script
+
+
+def frames(conn):
+    """Yields (tag, payload) until the server closes the connection."""
+    stream = conn.makefile("rb")
+    while True:
+        header = stream.readline()
+        if not header:
+            return
+        tag, length = header.split()
+        payload = stream.read(int(length))
+        yield tag.decode(), payload
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--socket", required=True, help="socket the server listens on")
+    parser.add_argument("--path", action="store_true", help="send the path instead of the script")
+    parser.add_argument("--stats", action="store_true", help="print the statistics of the run")
+    parser.add_argument("script", nargs="?", help="omitted for a server started with --prefork")
+    args = parser.parse_args()
+
+    status = 1
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as conn:
+        conn.connect(args.socket)
+        conn.sendall(request(args))
+        for tag, payload in frames(conn):
+            if tag == "output":
+                sys.stdout.buffer.write(payload)
+            elif tag == "error":
+                sys.stdout.flush()
+                print(payload.decode(), file=sys.stderr)
+            elif tag == "stats":
+                stats = dict(line.split(" ", 1) for line in payload.decode().splitlines())
+                status = int(stats["status"])
+                if args.stats:
+                    for name, value in stats.items():
+                        print(f"{name:<24} {value:>14}", file=sys.stderr)
+    sys.stdout.flush()
+    return status
+
+
+if __name__ == "__main__":
+    sys.exit(main())
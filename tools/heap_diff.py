@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Compares two heap snapshots written by `fml --heap-snapshot`.
+
+Cells have no identity across runs, so the snapshots are compared in
+aggregate: per ValueKind (all cells and those reachable from the roots) and
+per object shape, the sorted field names of an object. A shape whose reachable
+count keeps growing between two snapshots of the same run, or between two
+versions of a script, is the usual sign of a leak.
+
+    tools/heap_diff.py before.json after.json
+"""
+
+import argparse
+import json
+from collections import Counter
+
+
+def load(path):
+    with open(path) as f:
+        return json.load(f)
+
+
+def histogram(snapshot):
+    return {row["kind"]: row for row in snapshot["histogram"]}
+
+
+def shapes(snapshot):
+    """(count, bytes) of reachable objects per shape."""
+    count = Counter()
+    size = Counter()
+    for node in snapshot["nodes"]:
+        if node["kind"] != "object" or not node["reachable"]:
+            continue
+        shape = "{" + ", ".join(sorted(node["fields"])) + "}"
+        count[shape] += 1
+        size[shape] += node["size"]
+    return count, size
+
+
+def delta(old, new):
+    return f"{new - old:+d}"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("before")
+    parser.add_argument("after")
+    parser.add_argument("--top", type=int, default=20, help="number of shapes to show")
+    args = parser.parse_args()
+
+    before = load(args.before)
+    after = load(args.after)
+
+    print(f"{'':24} {'before':>14} {'after':>14} {'delta':>14}")
+    for key in ["heap_size", "cells", "reachable"]:
+        print(f"{key:24} {before[key]:>14} {after[key]:>14} {delta(before[key], after[key]):>14}")
+
+    hist_before = histogram(before)
+    hist_after = histogram(after)
+    print(f"\n{'kind':12} {'count':>12} {'bytes':>14} {'reachable':>12} {'reach. bytes':>14}")
+    empty = {"count": 0, "bytes": 0, "reachable_count": 0, "reachable_bytes": 0}
+    for kind in sorted(set(hist_before) | set(hist_after)):
+        b = hist_before.get(kind, empty)
+        a = hist_after.get(kind, empty)
+        print(f"{kind:12} {delta(b['count'], a['count']):>12} {delta(b['bytes'], a['bytes']):>14} "
+              f"{delta(b['reachable_count'], a['reachable_count']):>12} "
+              f"{delta(b['reachable_bytes'], a['reachable_bytes']):>14}")
+
+    count_before, size_before = shapes(before)
+    count_after, size_after = shapes(after)
+    growth = sorted(set(count_before) | set(count_after),
+                    key=lambda s: size_after[s] - size_before[s], reverse=True)
+    print(f"\nreachable objects by shape, largest growth first")
+    print(f"{'before':>10} {'after':>10} {'delta':>10} {'bytes delta':>12}  shape")
+    for shape in growth[:args.top]:
+        print(f"{count_before[shape]:>10} {count_after[shape]:>10} "
+              f"{delta(count_before[shape], count_after[shape]):>10} "
+              f"{delta(size_before[shape], size_after[shape]):>12}  {shape}")
+
+
+if __name__ == "__main__":
+    main()